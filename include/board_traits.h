@@ -0,0 +1,172 @@
+// Compile-time description of each target board.
+//
+// What differs between the boards (the DFPlayer transport, the pin map,
+// where persistent data lives and how large the RAM buffers can be) is
+// collected in one BoardTraits specialization per board, picked by the
+// build's board flag and used through the Board typedef. The HAL and the
+// player logic take their constants from Board, and the storage backend is
+// chosen by specializing on Board::store (src/hal_arduino.cpp), so each
+// image only carries its own board's code and nothing is decided at run
+// time. Only the selected board's specialization is compiled, since the
+// others name peripherals the build does not have.
+#pragma once
+
+#include <stdint.h>
+
+enum BoardId
+{
+  BOARD_ID_NATIVE,  // Linux host, [env:native]
+  BOARD_ID_XIAO,    // Seeed XIAO (SAMD21)
+  BOARD_ID_NANO,    // Arduino Nano (ATmega328P)
+  BOARD_ID_GENERIC  // no board flag: XIAO-like wiring on the default pins
+};
+
+// Where the store slots and the settings journal are kept
+enum StoreBackend
+{
+  STORE_NVM,    // rows of program flash, written through the NVM controller
+  STORE_EEPROM, // the AVR's data EEPROM
+  STORE_RAM     // plain memory, lost at exit
+};
+
+template <BoardId id>
+struct BoardTraits;
+
+#ifndef ARDUINO
+
+template <>
+struct BoardTraits<BOARD_ID_NATIVE>
+{
+  // Storage
+  static constexpr StoreBackend store = STORE_RAM;
+  static constexpr uint16_t storeSlotSize = 256;
+  static constexpr uint16_t settingsRowSize = 256; // same geometry as the XIAO
+  static constexpr uint16_t settingsPageSize = 64;
+  static constexpr uint8_t settingsRows = 4;
+
+  // Buffers
+  static constexpr uint8_t playerQueueSize = 12;
+  static constexpr uint8_t scheduledTasks = 8;
+  static constexpr uint8_t benchSamples = 32;
+
+  // Supply current for the idle budget, the board without the DFPlayer;
+  // the XIAO's figures, so the simulation reports something plausible
+  static constexpr uint32_t awakeMicroamps = 7000;
+  static constexpr uint32_t sleepMicroamps = 100;
+};
+
+typedef BoardTraits<BOARD_ID_NATIVE> Board;
+
+#elif defined(BOARD_SEEED_XIAO)
+
+template <>
+struct BoardTraits<BOARD_ID_XIAO>
+{
+  // Transport: USB for the console, the hardware UART for the DFPlayer
+  typedef decltype(Serial1) PlayerPort;
+  static PlayerPort &playerPort() { return Serial1; }
+  static Stream &console() { return Serial; }
+
+  // Pins
+  static constexpr uint8_t button1Pin = 10;
+  static constexpr uint8_t button2Pin = 2;
+  static constexpr uint8_t button3Pin = 3;
+  static constexpr uint8_t noisePin = A0; // unconnected analog input used to seed random()
+
+  // Storage: 256-byte NVM erase rows of four 64-byte write pages
+  static constexpr StoreBackend store = STORE_NVM;
+  static constexpr uint16_t storeSlotSize = 256;
+  static constexpr uint16_t settingsRowSize = 256;
+  static constexpr uint16_t settingsPageSize = 64;
+  static constexpr uint8_t settingsRows = 4;
+
+  // Buffers
+  static constexpr uint8_t playerQueueSize = 12;
+  static constexpr uint8_t scheduledTasks = 8;
+  static constexpr uint8_t benchSamples = 32;
+
+  // Supply current for the idle budget, the board without the DFPlayer:
+  // running at 48 MHz, and in standby with the regulator's quiescent draw
+  static constexpr uint32_t awakeMicroamps = 7000;
+  static constexpr uint32_t sleepMicroamps = 100;
+};
+
+typedef BoardTraits<BOARD_ID_XIAO> Board;
+
+#elif defined(BOARD_NANO)
+
+#include <TimerSerial.h>
+
+template <>
+struct BoardTraits<BOARD_ID_NANO>
+{
+  // Transport: the only hardware UART is on USB, so the DFPlayer gets the
+  // interrupt-driven software UART (lib/TimerSerial, Timer2) on A5/A4
+  typedef TimerSerial PlayerPort;
+  static PlayerPort &playerPort()
+  {
+    static TimerSerial port(19, 18); // RX, TX
+    return port;
+  }
+  static Stream &console() { return Serial; }
+
+  // Pins
+  static constexpr uint8_t button1Pin = 2;
+  static constexpr uint8_t button2Pin = 3;
+  static constexpr uint8_t button3Pin = 4;
+  static constexpr uint8_t noisePin = A6; // analog-only pin, left floating
+
+  // Storage: 1 KB of EEPROM, laid out as the three store slots followed by
+  // the journal rows (928 bytes). The journal gets the minimum of two rows.
+  static constexpr StoreBackend store = STORE_EEPROM;
+  static constexpr uint16_t storeSlotSize = 224;
+  static constexpr uint16_t settingsRowSize = 128;
+  static constexpr uint16_t settingsPageSize = 128; // written a byte at a time
+  static constexpr uint8_t settingsRows = 2;
+
+  // Buffers, trimmed for 2 KB of RAM. The libraries' buffers are sized by
+  // the env's build flags (platformio.ini).
+  static constexpr uint8_t playerQueueSize = 6;
+  static constexpr uint8_t scheduledTasks = 7; // five save/prompt tasks, two more for the bench
+  static constexpr uint8_t benchSamples = 16;
+
+  // Supply current for the idle budget, the board without the DFPlayer.
+  // Power-down stops the MCU, but the power LED, the regulator and the USB
+  // bridge keep drawing.
+  static constexpr uint32_t awakeMicroamps = 19000;
+  static constexpr uint32_t sleepMicroamps = 6000;
+};
+
+typedef BoardTraits<BOARD_ID_NANO> Board;
+
+#else
+
+template <>
+struct BoardTraits<BOARD_ID_GENERIC>
+{
+  typedef decltype(Serial1) PlayerPort;
+  static PlayerPort &playerPort() { return Serial1; }
+  static Stream &console() { return Serial; }
+
+  static constexpr uint8_t button1Pin = 2;
+  static constexpr uint8_t button2Pin = 3;
+  static constexpr uint8_t button3Pin = 4;
+  static constexpr uint8_t noisePin = A0;
+
+  static constexpr StoreBackend store = STORE_NVM;
+  static constexpr uint16_t storeSlotSize = 256;
+  static constexpr uint16_t settingsRowSize = 256;
+  static constexpr uint16_t settingsPageSize = 64;
+  static constexpr uint8_t settingsRows = 4;
+
+  static constexpr uint8_t playerQueueSize = 12;
+  static constexpr uint8_t scheduledTasks = 8;
+  static constexpr uint8_t benchSamples = 32;
+
+  static constexpr uint32_t awakeMicroamps = 7000;
+  static constexpr uint32_t sleepMicroamps = 100;
+};
+
+typedef BoardTraits<BOARD_ID_GENERIC> Board;
+
+#endif
@@ -0,0 +1,98 @@
+// Binary control protocol shared by the firmware and host tools.
+//
+// A frame is: SYNC, LEN, LEN payload bytes, CRC16 (big-endian) over LEN and
+// the payload. The payload is one or more commands back to back, each a
+// command id followed by its fixed-size big-endian arguments. The firmware
+// answers every request frame with one reply frame holding, per command, the
+// command id and a ControlResult; a STATUS command is followed by the
+// CONTROL_STATUS_LENGTH status bytes.
+//
+// SYNC is not printable ASCII, so a port can carry both this and the text
+// commands: a frame is recognised when SYNC arrives at the start of a line.
+#pragma once
+
+#include <stdint.h>
+
+#define CONTROL_FRAME_SYNC 0xA5
+#define CONTROL_MAX_PAYLOAD 64
+#define CONTROL_FRAME_TIMEOUT 100 // ms between bytes before a partial frame is dropped
+
+enum ControlCommandId
+{
+  CONTROL_PLAY = 0x01,        // track (2 bytes)
+  CONTROL_PLAY_FOLDER = 0x02, // folder, track (1 byte each)
+  CONTROL_NEXT = 0x03,
+  CONTROL_PREVIOUS = 0x04,
+  CONTROL_PAUSE = 0x05,
+  CONTROL_RESUME = 0x06,
+  CONTROL_STOP = 0x07,
+  CONTROL_VOLUME = 0x08, // volume 0-30 (1 byte)
+  CONTROL_VOLUME_UP = 0x09,
+  CONTROL_VOLUME_DOWN = 0x0A,
+  CONTROL_EQ = 0x0B,          // DFPLAYER_EQ_* value (1 byte)
+  CONTROL_LOOP_FOLDER = 0x0C, // folder (1 byte)
+  CONTROL_SLEEP = 0x0D,
+  CONTROL_RESET = 0x0E,
+  CONTROL_STATUS = 0x0F,
+  CONTROL_REPEAT = 0x10,          // ContinuousModes value (1 byte)
+  CONTROL_PLAYLIST_ADD = 0x11,    // playlist from 1, folder, track (1 byte each)
+  CONTROL_PLAYLIST_REMOVE = 0x12, // playlist from 1, position from 1 (1 byte each)
+  CONTROL_PLAYLIST_CLEAR = 0x13,  // playlist from 1 (1 byte)
+  CONTROL_FAVORITE = 0x14         // button from 1, folder, track; folder 0 for the default (1 byte each)
+};
+
+enum ControlResult
+{
+  CONTROL_OK = 0,
+  CONTROL_ERR_UNKNOWN = 1, // unknown command id; the rest of the frame is skipped
+  CONTROL_ERR_ARGS = 2,    // arguments missing or out of range
+  CONTROL_ERR_BUSY = 3     // player command queue full
+};
+
+// Status bytes following a CONTROL_STATUS result:
+// playback state (0 stopped, 1 playing, 2 paused), volume, eq, folder, track,
+// mode, playback order, continuous mode
+#define CONTROL_STATUS_LENGTH 8
+
+// Argument bytes for a command id, or -1 for an unknown id
+inline int controlArgLength(uint8_t id)
+{
+  switch (id)
+  {
+  case CONTROL_PLAYLIST_ADD:
+  case CONTROL_FAVORITE:
+    return 3;
+  case CONTROL_PLAY:
+  case CONTROL_PLAY_FOLDER:
+  case CONTROL_PLAYLIST_REMOVE:
+    return 2;
+  case CONTROL_VOLUME:
+  case CONTROL_EQ:
+  case CONTROL_LOOP_FOLDER:
+  case CONTROL_REPEAT:
+  case CONTROL_PLAYLIST_CLEAR:
+    return 1;
+  case CONTROL_NEXT:
+  case CONTROL_PREVIOUS:
+  case CONTROL_PAUSE:
+  case CONTROL_RESUME:
+  case CONTROL_STOP:
+  case CONTROL_VOLUME_UP:
+  case CONTROL_VOLUME_DOWN:
+  case CONTROL_SLEEP:
+  case CONTROL_RESET:
+  case CONTROL_STATUS:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+// CRC-16/CCITT-FALSE, one byte at a time; start from 0xFFFF
+inline uint16_t controlCrc16(uint16_t crc, uint8_t byte)
+{
+  crc ^= (uint16_t)byte << 8;
+  for (uint8_t i = 0; i < 8; i++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
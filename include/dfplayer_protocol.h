@@ -0,0 +1,123 @@
+// DFPlayer Mini serial protocol, shared by the firmware and host tools.
+//
+// Every message either way is a 10-byte frame:
+//   7E FF 06 CMD FEEDBACK PARAM_H PARAM_L CHECKSUM_H CHECKSUM_L EF
+// where the checksum is the two's complement of the sum of bytes 1..6. With
+// FEEDBACK set the module answers each command with an ACK frame.
+#pragma once
+
+#include <stdint.h>
+
+#define DFPLAYER_FRAME_LENGTH 10
+#define DFPLAYER_FRAME_START 0x7E
+#define DFPLAYER_FRAME_VERSION 0xFF
+#define DFPLAYER_FRAME_DATA_LENGTH 0x06
+#define DFPLAYER_FRAME_END 0xEF
+
+enum PlayerCommandId
+{
+  PLAYER_CMD_NEXT = 0x01,
+  PLAYER_CMD_PREVIOUS = 0x02,
+  PLAYER_CMD_PLAY = 0x03, // param = file index in card order
+  PLAYER_CMD_VOLUME_UP = 0x04,
+  PLAYER_CMD_VOLUME_DOWN = 0x05,
+  PLAYER_CMD_VOLUME = 0x06,
+  PLAYER_CMD_EQ = 0x07,
+  PLAYER_CMD_OUTPUT_DEVICE = 0x09,
+  PLAYER_CMD_SLEEP = 0x0A,
+  PLAYER_CMD_RESET = 0x0C,
+  PLAYER_CMD_START = 0x0D,
+  PLAYER_CMD_PAUSE = 0x0E,
+  PLAYER_CMD_PLAY_FOLDER = 0x0F, // param = (folder << 8) | track
+  PLAYER_CMD_PLAY_MP3_FOLDER = 0x12, // param = NNNN of MP3/NNNN.mp3
+  PLAYER_CMD_STOP = 0x16,
+  PLAYER_CMD_LOOP_FOLDER = 0x17,
+  // Queries; each reply carries the same command id
+  PLAYER_CMD_QUERY_STATUS = 0x42, // param = (device << 8) | 0 stopped, 1 playing, 2 paused
+  PLAYER_CMD_QUERY_VOLUME = 0x43,
+  PLAYER_CMD_QUERY_EQ = 0x44,
+  PLAYER_CMD_QUERY_SD_FILES = 0x48,
+  PLAYER_CMD_QUERY_SD_CURRENT = 0x4C,
+  PLAYER_CMD_QUERY_FOLDER_FILES = 0x4E,
+  PLAYER_CMD_QUERY_FOLDERS = 0x4F
+};
+
+// Unsolicited/feedback frames sent by the module
+enum PlayerFeedbackId
+{
+  PLAYER_FB_CARD_INSERTED = 0x3A,
+  PLAYER_FB_CARD_REMOVED = 0x3B,
+  PLAYER_FB_PLAY_FINISHED = 0x3D,
+  PLAYER_FB_CARD_ONLINE = 0x3F,
+  PLAYER_FB_ERROR = 0x40,
+  PLAYER_FB_ACK = 0x41
+};
+
+// Parameter of a PLAYER_FB_ERROR frame
+enum PlayerErrorCode
+{
+  Busy = 1,
+  Sleeping = 2,
+  SerialWrongStack = 3,
+  CheckSumNotMatch = 4,
+  FileIndexOut = 5,
+  FileMismatch = 6,
+  Advertise = 7
+};
+
+// Event types as reported by DFRobotDFPlayerMini::readType()
+enum PlayerEventType
+{
+  TimeOut = 0,
+  WrongStack = 1,
+  DFPlayerCardInserted = 2,
+  DFPlayerCardRemoved = 3,
+  DFPlayerCardOnline = 4,
+  DFPlayerPlayFinished = 5,
+  DFPlayerError = 6,
+  DFPlayerUSBInserted = 7,
+  DFPlayerUSBRemoved = 8,
+  DFPlayerUSBOnline = 9
+};
+
+#define DFPLAYER_EQ_NORMAL 0
+#define DFPLAYER_EQ_POP 1
+#define DFPLAYER_EQ_ROCK 2
+#define DFPLAYER_EQ_JAZZ 3
+#define DFPLAYER_EQ_CLASSIC 4
+#define DFPLAYER_EQ_BASS 5
+
+#define DFPLAYER_DEVICE_U_DISK 1
+#define DFPLAYER_DEVICE_SD 2
+
+// Checksum over bytes 1..6 of a frame
+inline uint16_t dfplayerChecksum(const uint8_t *frame)
+{
+  uint16_t sum = 0;
+  for (int i = 1; i < 7; i++)
+    sum += frame[i];
+  return -sum;
+}
+
+// Start byte, end byte and checksum of a received frame
+inline bool dfplayerFrameValid(const uint8_t *frame)
+{
+  return frame[0] == DFPLAYER_FRAME_START && frame[9] == DFPLAYER_FRAME_END &&
+         dfplayerChecksum(frame) == ((frame[7] << 8) | frame[8]);
+}
+
+// Build a frame for `command` into frame[DFPLAYER_FRAME_LENGTH]
+inline void dfplayerEncodeFrame(uint8_t *frame, uint8_t command, bool feedback, uint16_t param)
+{
+  frame[0] = DFPLAYER_FRAME_START;
+  frame[1] = DFPLAYER_FRAME_VERSION;
+  frame[2] = DFPLAYER_FRAME_DATA_LENGTH;
+  frame[3] = command;
+  frame[4] = feedback ? 1 : 0;
+  frame[5] = param >> 8;
+  frame[6] = param;
+  uint16_t checksum = dfplayerChecksum(frame);
+  frame[7] = checksum >> 8;
+  frame[8] = checksum;
+  frame[9] = DFPLAYER_FRAME_END;
+}
@@ -0,0 +1,134 @@
+// Hardware abstraction for the player firmware.
+//
+// Everything the player logic in src/main.cpp needs from the board goes
+// through here: the clock, the serial link to the DFPlayer module, the
+// buttons, persistent storage and the console port. src/hal_arduino.cpp
+// implements it for the XIAO and Nano; src/hal_native.cpp simulates the
+// peripherals so the same logic builds and runs on Linux ([env:native]).
+// What differs between those targets is described in include/board_traits.h.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include "Arduino.h"
+#else
+#include "hal_native.h" // the parts of the Arduino API the logic relies on
+#endif
+
+#include "board_traits.h"
+#include "ButtonInput.h"
+#include "SettingsJournal.h"
+
+// Open the console and player ports and configure the board's pins
+void halBegin();
+
+// -- Clock --
+
+unsigned long halMillis();
+
+// Free-running CPU cycle count, wrapping at 2^32; HAL_CYCLES_PER_US converts
+// it to time. Derived from SysTick on the SAMD21 (a Cortex-M0+ has no DWT
+// cycle counter), from micros() on the AVR and from the clock on native.
+uint32_t halCycles();
+
+#ifdef F_CPU
+#define HAL_CYCLES_PER_US (F_CPU / 1000000UL)
+#else
+#define HAL_CYCLES_PER_US 1
+#endif
+
+// -- Player transport --
+
+// Serial link to the DFPlayer (9600 baud)
+extern Stream &PlayerSerial;
+
+// Bring the module online, resetting it first if asked. Blocks until the
+// module reports its card online; false if it never does.
+bool halPlayerBegin(bool reset);
+
+// True while the module's BUSY pin reports playback. Only meaningful when
+// the pin is wired (DFPLAYER_BUSY_PIN).
+bool halPlayerBusy();
+
+// -- Buttons --
+
+#define HAL_BUTTON_COUNT 3
+
+typedef void (*HalButtonCallback)();
+typedef void (*HalButtonEventCallback)(const ButtonEvent &event);
+
+// onPressed runs when a short press is released; onLongPressed runs once a
+// press has been held for longPressMs (0 for none). Edges are captured by
+// pin interrupts with their time, so a press made while loop() is blocked is
+// still reported afterwards, and classified by how long it really lasted
+// (lib/ButtonInput).
+void halButtonBegin(uint8_t button, HalButtonCallback onPressed, uint32_t longPressMs, HalButtonCallback onLongPressed);
+
+// Also receive every classified event (down, up, clicks with their count,
+// long presses), stamped with when it happened, ahead of the callbacks
+void halButtonOnEvent(HalButtonEventCallback callback);
+
+// Debounce and classify the edges captured since the last call and run the
+// callbacks; called every loop()
+void halButtonsRead();
+
+#ifdef LATENCY_BENCH
+// Press or release a button from software, for scripted benchmark runs. The
+// input still goes through the same debouncing and callbacks; on the boards
+// it replaces the pins in bench builds.
+void halButtonInject(uint8_t button, bool pressed);
+
+// Drive LATENCY_PROBE_PIN, if defined, for a scope or logic analyser
+void halProbe(bool level);
+#endif
+
+// -- Persistent store --
+
+// Fixed-size records kept across power cycles, up to HAL_STORE_SLOT_SIZE
+// bytes each, in flash or EEPROM depending on the board (Board::store). A
+// slot that was never written reads back as all 0x00 or all 0xFF, so records
+// carry their own validity marker.
+enum HalStoreSlot
+{
+  HAL_STORE_TRACK_INDEX,
+  HAL_STORE_SHUFFLE,
+  HAL_STORE_PLAYLISTS,
+  HAL_STORE_SLOT_COUNT
+};
+
+#define HAL_STORE_SLOT_SIZE Board::storeSlotSize
+
+void halStoreRead(uint8_t slot, void *data, size_t size);
+void halStoreWrite(uint8_t slot, const void *data, size_t size);
+
+// Part of a slot, size bytes from offset; the rest of the slot is left as it
+// was. Reads are direct, so a record can be walked without a RAM copy. A
+// write costs a whole row rewrite on flash but only the bytes given on EEPROM.
+void halStoreReadAt(uint8_t slot, size_t offset, void *data, size_t size);
+void halStoreWriteAt(uint8_t slot, size_t offset, const void *data, size_t size);
+
+// Flash rows (EEPROM on the Nano) behind the settings journal
+extern const JournalFlash halSettingsFlash;
+
+// -- Power --
+
+// Stop the CPU in the deepest state a button can still wake it from
+// (standby on the SAMD21, power-down on the AVR) and return once one has.
+// The waking press is captured like any other and comes out of the next
+// halButtonsRead(). The millisecond clock stands still while asleep, and the
+// console cannot wake the board. On native the sleep happens between loop()
+// calls instead: this returns at once and loop() is not called again until a
+// button is pressed.
+void halSleep();
+
+// -- Console --
+
+// Debug and command port (USB serial on the boards)
+extern Stream &Console;
+
+// -- Entropy --
+
+// Unpredictable bits for seeding random(), e.g. ADC noise
+uint32_t halEntropy();
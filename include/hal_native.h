@@ -0,0 +1,60 @@
+// The subset of the Arduino core API the player logic uses, for the native
+// (Linux) build. Flash-resident strings and tables are ordinary memory here.
+#pragma once
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void *const *)(addr))
+#define strcmp_P strcmp
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const __FlashStringHelper *s) { return print((const char *)s); }
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int n) { return print((long)n); }
+  size_t print(unsigned int n) { return print((unsigned long)n); }
+  size_t print(long n);
+  size_t print(unsigned long n);
+
+  size_t println() { return print('\r') + print('\n'); }
+  template <typename T>
+  size_t println(T value) { return print(value) + println(); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+// Simulation control, for host tests that link the player without the
+// simulation driver's main() (HAL_NATIVE_NO_MAIN, implied by pio test) and
+// step it themselves
+void simBegin(bool realTime);                        // erase the store, run setup(); realTime clocks it from the host
+void simStep();                                      // one loop() pass, then one clock tick
+void simPress(uint8_t button, unsigned long holdMs); // press a button, release it holdMs later
+bool simConsoleFd(int fd);                           // console over a tty or pty instead of stdin/stdout
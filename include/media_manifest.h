@@ -0,0 +1,121 @@
+// Generated by scripts/generate_media_manifest.py from media/tf. Do not edit.
+#pragma once
+
+#include <stdint.h>
+
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
+#define MEDIA_NUM_FOLDERS 4
+
+struct MediaTrack
+{
+  uint8_t number;       // file number within the folder (NNN.mp3)
+  int8_t gainSteps;     // volume offset bringing it to the content's median loudness
+  uint16_t bitrateKbps; // average bitrate
+  uint32_t durationMs;  // playback length
+};
+
+struct MediaFolder
+{
+  uint8_t count;            // number of tracks in the folder
+  uint8_t maxTrack;         // highest track number
+  const MediaTrack *tracks; // sorted by number
+  uint32_t present[2];      // bit n-1 set if track n exists (tracks 1..64)
+};
+
+#define MEDIA_FOLDER_01_COUNT 13
+#define MEDIA_FOLDER_02_COUNT 1
+#define MEDIA_FOLDER_03_COUNT 18
+#define MEDIA_FOLDER_04_COUNT 1
+
+constexpr MediaTrack MEDIA_FOLDER_01_TRACKS[] PROGMEM = {
+    {1, 0, 116, 5146},
+    {2, 0, 256, 1296},
+    {3, 0, 108, 522},
+    {4, 0, 92, 600},
+    {5, 0, 89, 720},
+    {6, 0, 92, 672},
+    {7, 0, 95, 768},
+    {8, 0, 118, 130},
+    {9, 0, 93, 574},
+    {10, 0, 90, 480},
+    {11, 0, 82, 864},
+    {12, 0, 88, 792},
+    {13, 0, 106, 504},
+};
+
+constexpr MediaTrack MEDIA_FOLDER_02_TRACKS[] PROGMEM = {
+    {1, 0, 69, 3648},
+};
+
+constexpr MediaTrack MEDIA_FOLDER_03_TRACKS[] PROGMEM = {
+    {2, 0, 128, 163604},
+    {3, 0, 128, 170579},
+    {4, 0, 115, 213264},
+    {6, 0, 121, 181942},
+    {7, 0, 131, 173217},
+    {9, 0, 128, 240692},
+    {11, 0, 128, 227422},
+    {12, 0, 128, 203676},
+    {14, 0, 128, 201576},
+    {17, 0, 117, 192104},
+    {21, 0, 133, 184163},
+    {22, 0, 128, 214177},
+    {23, 0, 128, 224104},
+    {24, 0, 128, 229172},
+    {25, 0, 128, 229015},
+    {27, 0, 131, 206053},
+    {29, 0, 128, 224182},
+    {30, 0, 130, 193123},
+};
+
+constexpr MediaTrack MEDIA_FOLDER_04_TRACKS[] PROGMEM = {
+    {1, 0, 93, 15386},
+};
+
+// Indexed by folder number - 1
+constexpr MediaFolder MEDIA_FOLDERS[MEDIA_NUM_FOLDERS] PROGMEM = {
+    {13, 13, MEDIA_FOLDER_01_TRACKS, {0x00001FFFUL, 0x00000000UL}},
+    {1, 1, MEDIA_FOLDER_02_TRACKS, {0x00000001UL, 0x00000000UL}},
+    {18, 30, MEDIA_FOLDER_03_TRACKS, {0x35F12D6EUL, 0x00000000UL}},
+    {1, 1, MEDIA_FOLDER_04_TRACKS, {0x00000001UL, 0x00000000UL}},
+};
+
+// Named UI sounds in folder 01: X(name, track)
+#define MEDIA_UI_SOUNDS(X) \
+  X(startup, 1) \
+  X(tone1, 2) \
+  X(tone2, 3) \
+  X(music_mode, 4) \
+  X(voice_mode, 5) \
+  X(candids_mode, 6) \
+  X(settings_mode, 7) \
+  X(tone3, 8) \
+  X(favorites_mode, 9) \
+  X(settings_volume_mode, 10) \
+  X(settings_playback_order_mode, 11) \
+  X(sequential_playback, 12) \
+  X(random_playback, 13) \
+  X(playlists_mode, 14)
+
+#define MEDIA_NUM_UI_SOUNDS 14
+
+enum UISound
+{
+  UI_SOUND_STARTUP = 1,
+  UI_SOUND_TONE1 = 2,
+  UI_SOUND_TONE2 = 3,
+  UI_SOUND_MUSIC_MODE = 4,
+  UI_SOUND_VOICE_MODE = 5,
+  UI_SOUND_CANDIDS_MODE = 6,
+  UI_SOUND_SETTINGS_MODE = 7,
+  UI_SOUND_TONE3 = 8,
+  UI_SOUND_FAVORITES_MODE = 9,
+  UI_SOUND_SETTINGS_VOLUME_MODE = 10,
+  UI_SOUND_SETTINGS_PLAYBACK_ORDER_MODE = 11,
+  UI_SOUND_SEQUENTIAL_PLAYBACK = 12,
+  UI_SOUND_RANDOM_PLAYBACK = 13,
+  UI_SOUND_PLAYLISTS_MODE = 3, // stand-in until media/tf/01/014.mp3 is recorded
+};
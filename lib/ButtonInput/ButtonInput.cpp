@@ -0,0 +1,259 @@
+#include "ButtonInput.h"
+
+#define BUTTON_EDGE_MASK (BUTTON_EDGE_QUEUE_SIZE - 1)
+
+// Keeps the compiler from moving the slot access past the index update. The
+// targets are single-core, so ordering the stores is all it takes.
+#define BUTTON_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// a is before b, allowing for the millisecond clock wrapping
+static bool before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+ButtonEdgeQueue::ButtonEdgeQueue() : head_(0), tail_(0), dropped_(0)
+{
+}
+
+bool ButtonEdgeQueue::push(uint8_t button, bool pressed, uint32_t atMs)
+{
+  uint8_t head = head_;
+  uint8_t next = (head + 1) & BUTTON_EDGE_MASK;
+  if (next == tail_)
+  {
+    dropped_++;
+    return false;
+  }
+  edges_[head].atMs = atMs;
+  edges_[head].button = button;
+  edges_[head].pressed = pressed;
+  BUTTON_BARRIER();
+  head_ = next;
+  return true;
+}
+
+bool ButtonEdgeQueue::pop(ButtonEdge *edge)
+{
+  uint8_t tail = tail_;
+  if (tail == head_)
+    return false;
+  *edge = edges_[tail];
+  BUTTON_BARRIER();
+  tail_ = (tail + 1) & BUTTON_EDGE_MASK;
+  return true;
+}
+
+ButtonClassifier::ButtonClassifier()
+    : button_(0), longPressMs_(0), stable_(false), raw_(false), locked_(false), longFired_(false), clicks_(0),
+      lockedAt_(0), pressedAt_(0), releasedAt_(0)
+{
+}
+
+void ButtonClassifier::begin(uint8_t button, uint16_t longPressMs)
+{
+  button_ = button;
+  longPressMs_ = longPressMs;
+}
+
+void ButtonClassifier::edge(bool pressed, uint32_t atMs, ButtonEventHandler handler, void *context)
+{
+  advance(atMs, handler, context);
+  raw_ = pressed;
+  // The first edge of a bounce counts straight away; the rest are ignored
+  // until the debounce time is up, when the level is checked again
+  if (!locked_ && raw_ != stable_)
+    accept(raw_, atMs, handler, context);
+}
+
+uint8_t ButtonClassifier::nextDue(uint32_t *atMs) const
+{
+  uint8_t due = DUE_NONE;
+  if (locked_)
+  {
+    due = DUE_UNLOCK;
+    *atMs = lockedAt_ + BUTTON_DEBOUNCE_MS;
+  }
+  if (stable_ && longPressMs_ > 0 && !longFired_)
+  {
+    uint32_t at = pressedAt_ + longPressMs_;
+    if (due == DUE_NONE || before(at, *atMs))
+    {
+      due = DUE_LONG_PRESS;
+      *atMs = at;
+    }
+  }
+  if (!stable_ && clicks_ > 0)
+  {
+    uint32_t at = releasedAt_ + BUTTON_MULTI_CLICK_MS;
+    if (due == DUE_NONE || before(at, *atMs))
+    {
+      due = DUE_CLICKS_DONE;
+      *atMs = at;
+    }
+  }
+  return due;
+}
+
+void ButtonClassifier::advance(uint32_t nowMs, ButtonEventHandler handler, void *context)
+{
+  uint32_t dueAt;
+  uint8_t due;
+  while ((due = nextDue(&dueAt)) != DUE_NONE && !before(nowMs, dueAt))
+    fire(due, dueAt, handler, context);
+}
+
+void ButtonClassifier::fire(uint8_t due, uint32_t atMs, ButtonEventHandler handler, void *context)
+{
+  ButtonEvent event = {0, button_, clicks_, atMs};
+  switch (due)
+  {
+  case DUE_UNLOCK:
+    locked_ = false;
+    if (raw_ != stable_)
+      accept(raw_, atMs, handler, context);
+    break;
+  case DUE_LONG_PRESS:
+    longFired_ = true;
+    if (clicks_ > 0)
+    {
+      // Holding ends a click sequence
+      event.type = BUTTON_CLICKS_DONE;
+      handler(context, event);
+      clicks_ = 0;
+    }
+    event.type = BUTTON_LONG_PRESS;
+    event.clicks = 0;
+    handler(context, event);
+    break;
+  case DUE_CLICKS_DONE:
+    event.type = BUTTON_CLICKS_DONE;
+    clicks_ = 0;
+    handler(context, event);
+    break;
+  }
+}
+
+void ButtonClassifier::accept(bool pressed, uint32_t atMs, ButtonEventHandler handler, void *context)
+{
+  stable_ = pressed;
+  locked_ = true;
+  lockedAt_ = atMs;
+  ButtonEvent event = {(uint8_t)(pressed ? BUTTON_DOWN : BUTTON_UP), button_, clicks_, atMs};
+  if (pressed)
+  {
+    pressedAt_ = atMs;
+    longFired_ = false;
+    handler(context, event);
+    return;
+  }
+
+  handler(context, event);
+  // A press released no later than the debounce time was a glitch
+  if (longFired_ || atMs - pressedAt_ <= BUTTON_DEBOUNCE_MS)
+    return;
+  if (clicks_ < 255)
+    clicks_++;
+  releasedAt_ = atMs;
+  event.type = BUTTON_CLICK;
+  event.clicks = clicks_;
+  handler(context, event);
+}
+
+ButtonInput::ButtonInput() : count_(0), droppedSeen_(0), handler_(NULL), context_(NULL)
+{
+  for (uint8_t i = 0; i < BUTTON_INPUT_MAX; i++)
+  {
+    onClick_[i] = NULL;
+    onLongPress_[i] = NULL;
+  }
+}
+
+void ButtonInput::begin(uint8_t button, uint16_t longPressMs, ButtonCallback onClick, ButtonCallback onLongPress)
+{
+  if (button >= BUTTON_INPUT_MAX)
+    return;
+  buttons_[button].begin(button, longPressMs);
+  onClick_[button] = onClick;
+  onLongPress_[button] = longPressMs > 0 ? onLongPress : NULL;
+  if (button >= count_)
+    count_ = button + 1;
+}
+
+void ButtonInput::setHandler(ButtonEventHandler handler, void *context)
+{
+  handler_ = handler;
+  context_ = context;
+}
+
+void ButtonInput::dispatch(void *input, const ButtonEvent &event)
+{
+  ButtonInput *self = (ButtonInput *)input;
+  if (self->handler_)
+    self->handler_(self->context_, event);
+  ButtonCallback callback = NULL;
+  if (event.type == BUTTON_CLICK)
+    callback = self->onClick_[event.button];
+  else if (event.type == BUTTON_LONG_PRESS)
+    callback = self->onLongPress_[event.button];
+  if (callback)
+    callback();
+}
+
+void ButtonInput::update(uint32_t nowMs)
+{
+  // Edges from all buttons arrive in time order; timed events of the other
+  // buttons are brought up to each edge first so the events come out in
+  // order too
+  ButtonEdge edge;
+  while (queue_.pop(&edge))
+  {
+    if (edge.button >= count_)
+      continue;
+    advanceAll(edge.atMs);
+    buttons_[edge.button].edge(edge.pressed, edge.atMs, dispatch, this);
+  }
+  advanceAll(nowMs);
+}
+
+void ButtonInput::sync(uint8_t button, bool pressed, uint32_t nowMs)
+{
+  if (button >= count_)
+    return;
+  advanceAll(nowMs);
+  buttons_[button].edge(pressed, nowMs, dispatch, this);
+}
+
+bool ButtonInput::overflowed()
+{
+  uint8_t dropped = queue_.dropped();
+  if (dropped == droppedSeen_)
+    return false;
+  droppedSeen_ = dropped;
+  return true;
+}
+
+// Timed events of all buttons, earliest first
+void ButtonInput::advanceAll(uint32_t nowMs)
+{
+  while (true)
+  {
+    uint8_t next = count_;
+    uint8_t nextDue = ButtonClassifier::DUE_NONE;
+    uint32_t nextAt = 0;
+    for (uint8_t i = 0; i < count_; i++)
+    {
+      uint32_t at;
+      uint8_t due = buttons_[i].nextDue(&at);
+      if (due != ButtonClassifier::DUE_NONE && (next == count_ || before(at, nextAt)))
+      {
+        next = i;
+        nextDue = due;
+        nextAt = at;
+      }
+    }
+    if (next == count_ || before(nowMs, nextAt))
+      return;
+    buttons_[next].fire(nextDue, nextAt, dispatch, this);
+  }
+}
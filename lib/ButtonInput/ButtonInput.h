@@ -0,0 +1,165 @@
+// Interrupt-fed button input.
+//
+// Pin-change interrupts timestamp each edge and push it into a lock-free
+// single-producer/single-consumer ring (ButtonEdgeQueue); nothing else runs
+// in interrupt context. update(), called from loop(), drains the ring in
+// order and hands every edge to its button's ButtonClassifier, which
+// debounces it and turns presses into events: down and up, clicks with
+// their multi-click count, and long presses.
+//
+// Decisions are made from the edges' own timestamps rather than from when
+// loop() gets round to them, so a press made while loop() is blocked (a
+// flash erase, a wait for the module) is still seen once it resumes, and
+// with its real length: a 200 ms tap during a 1 s stall is a click, not a
+// long press.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUTTON_INPUT_MAX 4          // buttons per ButtonInput
+#ifndef BUTTON_EDGE_QUEUE_SIZE
+#define BUTTON_EDGE_QUEUE_SIZE 32   // edges buffered between update()s, a power of two
+#endif
+#define BUTTON_DEBOUNCE_MS 35       // edges this soon after an accepted one are contact bounce
+#define BUTTON_MULTI_CLICK_MS 300   // a click within this of the previous release continues a sequence
+
+struct ButtonEdge
+{
+  uint32_t atMs;
+  uint8_t button;
+  bool pressed;
+};
+
+// Ring of edges: push() from one interrupt context, pop() from loop(). Each
+// side only writes its own index, and a slot is filled before the index that
+// publishes it, so neither side needs to disable interrupts.
+class ButtonEdgeQueue
+{
+public:
+  ButtonEdgeQueue();
+
+  // Producer side. False, and the edge is counted as dropped, if full.
+  bool push(uint8_t button, bool pressed, uint32_t atMs);
+
+  // Consumer side. False if empty.
+  bool pop(ButtonEdge *edge);
+
+  // Edges lost to a full ring, counted modulo 256
+  uint8_t dropped() const { return dropped_; }
+
+private:
+  ButtonEdge edges_[BUTTON_EDGE_QUEUE_SIZE];
+  volatile uint8_t head_; // next slot to fill, written by the producer
+  volatile uint8_t tail_; // next slot to read, written by the consumer
+  volatile uint8_t dropped_;
+};
+
+enum ButtonEventType
+{
+  BUTTON_DOWN,       // debounced press
+  BUTTON_UP,         // debounced release
+  BUTTON_CLICK,      // release of a press that did not become a long press
+  BUTTON_LONG_PRESS, // held for longPressMs; no click follows on release
+  BUTTON_CLICKS_DONE // BUTTON_MULTI_CLICK_MS after the last click of a sequence
+};
+
+struct ButtonEvent
+{
+  uint8_t type;   // ButtonEventType
+  uint8_t button;
+  uint8_t clicks; // BUTTON_CLICK: clicks so far in the sequence; BUTTON_CLICKS_DONE: total
+  uint32_t atMs;  // when it happened, which may be well before it is delivered
+};
+
+typedef void (*ButtonEventHandler)(void *context, const ButtonEvent &event);
+typedef void (*ButtonCallback)();
+
+// Debouncing and classification for one button. Edges and time must be fed
+// in order; every event is stamped with the time it happened.
+class ButtonClassifier
+{
+public:
+  ButtonClassifier();
+
+  void begin(uint8_t button, uint16_t longPressMs);
+
+  // Raw level change at atMs
+  void edge(bool pressed, uint32_t atMs, ButtonEventHandler handler, void *context);
+
+  // Fire the timed events (debounce expiry, long press, end of a click
+  // sequence) that fall due up to nowMs
+  void advance(uint32_t nowMs, ButtonEventHandler handler, void *context);
+
+  // The same one at a time, so several buttons can be interleaved: the next
+  // timed event and when it falls due, then fire() it
+  enum Due
+  {
+    DUE_NONE,
+    DUE_UNLOCK,
+    DUE_LONG_PRESS,
+    DUE_CLICKS_DONE
+  };
+  uint8_t nextDue(uint32_t *atMs) const;
+  void fire(uint8_t due, uint32_t atMs, ButtonEventHandler handler, void *context);
+
+  bool pressed() const { return stable_; }
+
+private:
+  uint8_t button_;
+  uint16_t longPressMs_; // 0 for none
+  bool stable_;          // debounced level
+  bool raw_;             // level of the latest edge
+  bool locked_;          // within BUTTON_DEBOUNCE_MS of lockedAt_
+  bool longFired_;       // this press already reported a long press
+  uint8_t clicks_;       // clicks in the current sequence
+  uint32_t lockedAt_;
+  uint32_t pressedAt_;
+  uint32_t releasedAt_;
+
+  void accept(bool pressed, uint32_t atMs, ButtonEventHandler handler, void *context);
+};
+
+// Edge queue and classifiers for a set of buttons
+class ButtonInput
+{
+public:
+  ButtonInput();
+
+  // onClick runs for every BUTTON_CLICK and onLongPress for BUTTON_LONG_PRESS
+  // (longPressMs 0 for none), as EasyButton's onPressed/onPressedFor did
+  void begin(uint8_t button, uint16_t longPressMs, ButtonCallback onClick, ButtonCallback onLongPress);
+
+  // Also receive every event, ahead of the callbacks
+  void setHandler(ButtonEventHandler handler, void *context);
+
+  // From the pin-change interrupt. False if the edge was dropped.
+  bool edge(uint8_t button, bool pressed, uint32_t atMs) { return queue_.push(button, pressed, atMs); }
+
+  // From loop(): classify the queued edges and the timed events up to nowMs
+  void update(uint32_t nowMs);
+
+  // Give a button's current level directly, bypassing the queue: for pins
+  // without an interrupt, and to recover after edges were dropped. Call
+  // after update().
+  void sync(uint8_t button, bool pressed, uint32_t nowMs);
+
+  // True once after edges were dropped since the last call; levels should
+  // then be re-read with sync()
+  bool overflowed();
+
+  bool pressed(uint8_t button) const { return buttons_[button].pressed(); }
+
+private:
+  ButtonEdgeQueue queue_;
+  ButtonClassifier buttons_[BUTTON_INPUT_MAX];
+  ButtonCallback onClick_[BUTTON_INPUT_MAX];
+  ButtonCallback onLongPress_[BUTTON_INPUT_MAX];
+  uint8_t count_; // buttons begun
+  uint8_t droppedSeen_;
+  ButtonEventHandler handler_;
+  void *context_;
+
+  static void dispatch(void *input, const ButtonEvent &event);
+  void advanceAll(uint32_t nowMs);
+};
@@ -0,0 +1,201 @@
+#include "SettingsJournal.h"
+
+#include <string.h>
+
+#define JOURNAL_ROW_MAGIC 0x534A // "SJ", first half of a committed row header
+#define JOURNAL_HEADER_SIZE 4    // row header and record header are both 4 bytes
+#define JOURNAL_ERASED 0xFF
+
+static_assert(JOURNAL_MAX_RECORD % 4 == 0, "a padded record must fit appendRecord()'s buffer");
+
+// Row header, written after the row's first record to commit the row
+struct JournalRowHeader
+{
+  uint16_t magic;
+  uint16_t sequence; // one more than the row it replaced
+};
+
+// Record header; the payload follows, padded to a multiple of 4 bytes
+struct JournalRecordHeader
+{
+  uint8_t length;
+  uint8_t version;
+  uint16_t crc; // over length, version and payload
+};
+
+// CRC-16/CCITT-FALSE
+static uint16_t journalCrc16(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+  while (length--)
+  {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static uint16_t recordCrc(uint8_t length, uint8_t version, const uint8_t *payload)
+{
+  uint8_t header[2] = {length, version};
+  return journalCrc16(journalCrc16(0xFFFF, header, 2), payload, length);
+}
+
+static uint16_t recordSize(uint8_t length)
+{
+  return JOURNAL_HEADER_SIZE + ((length + 3) & ~3);
+}
+
+SettingsJournal::SettingsJournal(const JournalFlash &flash)
+    : flash_(flash), activeRow_(-1), sequence_(0), appendOffset_(0), latestAddress_(0),
+      latestLength_(0), latestVersion_(0), appends_(0), erases_(0)
+{
+}
+
+void SettingsJournal::begin()
+{
+  activeRow_ = -1;
+  latestLength_ = 0;
+  appends_ = 0;
+  erases_ = 0;
+  for (uint8_t row = 0; row < flash_.rowCount; row++)
+  {
+    uint16_t sequence;
+    if (!rowSequence(row, &sequence))
+      continue;
+    // Sequence numbers wrap; the newest is the one the others are behind
+    if (activeRow_ < 0 || (int16_t)(sequence - sequence_) > 0)
+    {
+      activeRow_ = row;
+      sequence_ = sequence;
+    }
+  }
+  if (activeRow_ >= 0)
+    scanRow(activeRow_);
+}
+
+uint8_t SettingsJournal::read(void *data, uint8_t capacity, uint8_t *version) const
+{
+  if (latestLength_ == 0)
+    return 0;
+  flash_.read(flash_.context, latestAddress_ + JOURNAL_HEADER_SIZE, data,
+              latestLength_ < capacity ? latestLength_ : capacity);
+  if (version)
+    *version = latestVersion_;
+  return latestLength_;
+}
+
+JournalWriteResult SettingsJournal::write(const void *data, uint8_t length, uint8_t version)
+{
+  if (length == 0 || length > JOURNAL_MAX_RECORD)
+    return JOURNAL_TOO_LARGE;
+
+  if (latestLength_ == length && latestVersion_ == version)
+  {
+    uint8_t stored[JOURNAL_MAX_RECORD];
+    flash_.read(flash_.context, latestAddress_ + JOURNAL_HEADER_SIZE, stored, length);
+    if (memcmp(stored, data, length) == 0)
+      return JOURNAL_UNCHANGED;
+  }
+
+  if (activeRow_ >= 0 && appendOffset_ + recordSize(length) <= flash_.rowSize)
+  {
+    appendRecord(activeRow_, appendOffset_, data, length, version);
+    return JOURNAL_WRITTEN;
+  }
+
+  // Active row full (or none yet): start the next row with just this record
+  // and only then commit it with its header, so a reset part way through
+  // leaves the previous row as the newest complete one
+  uint8_t row = activeRow_ >= 0 ? (activeRow_ + 1) % flash_.rowCount : 0;
+  flash_.erase(flash_.context, row);
+  erases_++;
+  appendRecord(row, JOURNAL_HEADER_SIZE, data, length, version);
+  JournalRowHeader header = {JOURNAL_ROW_MAGIC, (uint16_t)(sequence_ + 1)};
+  program((uint32_t)row * flash_.rowSize, &header, sizeof(header));
+  activeRow_ = row;
+  sequence_ = header.sequence;
+  return JOURNAL_COMPACTED;
+}
+
+bool SettingsJournal::rowSequence(uint8_t row, uint16_t *sequence) const
+{
+  JournalRowHeader header;
+  flash_.read(flash_.context, (uint32_t)row * flash_.rowSize, &header, sizeof(header));
+  if (header.magic != JOURNAL_ROW_MAGIC)
+    return false;
+  *sequence = header.sequence;
+  return true;
+}
+
+// Walk the row's records to find the latest valid one and the end of the
+// log. A record that fails its CRC was torn by a reset mid-write: the ones
+// before it stand, and the row is treated as full so the next write moves on
+// to a clean row rather than programming over the damaged bytes.
+void SettingsJournal::scanRow(uint8_t row)
+{
+  uint32_t base = (uint32_t)row * flash_.rowSize;
+  uint16_t offset = JOURNAL_HEADER_SIZE;
+  while (offset + JOURNAL_HEADER_SIZE <= flash_.rowSize)
+  {
+    JournalRecordHeader header;
+    flash_.read(flash_.context, base + offset, &header, sizeof(header));
+    if (header.length == JOURNAL_ERASED && header.version == JOURNAL_ERASED && header.crc == 0xFFFF)
+      break; // end of the log
+
+    uint8_t payload[JOURNAL_MAX_RECORD];
+    if (header.length == 0 || header.length > JOURNAL_MAX_RECORD ||
+        offset + recordSize(header.length) > flash_.rowSize)
+    {
+      offset = flash_.rowSize;
+      break;
+    }
+    flash_.read(flash_.context, base + offset + JOURNAL_HEADER_SIZE, payload, header.length);
+    if (recordCrc(header.length, header.version, payload) != header.crc)
+    {
+      offset = flash_.rowSize;
+      break;
+    }
+    latestAddress_ = base + offset;
+    latestLength_ = header.length;
+    latestVersion_ = header.version;
+    offset += recordSize(header.length);
+  }
+  appendOffset_ = offset;
+}
+
+// Program one record, header first, so a torn write always leaves a
+// non-erased, CRC-failing header behind
+void SettingsJournal::appendRecord(uint8_t row, uint16_t offset, const void *data, uint8_t length, uint8_t version)
+{
+  uint8_t record[JOURNAL_HEADER_SIZE + JOURNAL_MAX_RECORD];
+  uint16_t size = recordSize(length);
+  memset(record, JOURNAL_ERASED, size);
+  JournalRecordHeader header = {length, version, recordCrc(length, version, (const uint8_t *)data)};
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + JOURNAL_HEADER_SIZE, data, length);
+  program((uint32_t)row * flash_.rowSize + offset, record, size);
+
+  latestAddress_ = (uint32_t)row * flash_.rowSize + offset;
+  latestLength_ = length;
+  latestVersion_ = version;
+  appendOffset_ = offset + size;
+  appends_++;
+}
+
+// Split a program at page boundaries. The SAMD21's NVM controller writes a
+// whole page from its page buffer, so a range that runs on into the next
+// page would land in the wrong place.
+void SettingsJournal::program(uint32_t address, const void *data, uint16_t length)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (length > 0)
+  {
+    uint16_t room = flash_.pageSize - address % flash_.pageSize;
+    uint16_t chunk = length < room ? length : room;
+    flash_.program(flash_.context, address, bytes, chunk);
+    address += chunk;
+    bytes += chunk;
+    length -= chunk;
+  }
+}
@@ -0,0 +1,83 @@
+// Append-only settings journal for NOR flash.
+//
+// Settings are written as small records appended to a flash row instead of
+// rewriting one fixed block, so a row is erased only once it is full rather
+// than on every save. Each record carries a payload version (for migrating
+// older layouts) and a CRC; the newest valid record wins. Rows are used as a
+// ring: when the active row is full the latest record is copied into the next
+// row, which becomes active once its row header is written. The previous row
+// is left intact until the ring comes back round, so power loss at any point
+// leaves at least one complete copy.
+//
+// The journal only needs read/program/erase primitives (JournalFlash), so it
+// runs on the SAMD21's NVM in the firmware and on an emulated flash on the
+// host (tools/flash_emulator).
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest payload in bytes, a multiple of 4. write() and the row scan each
+// keep a payload this size on the stack, so a board short of RAM lowers it to
+// what it actually stores.
+#ifndef JOURNAL_MAX_RECORD
+#define JOURNAL_MAX_RECORD 64
+#endif
+
+// Flash geometry and primitives. program() may only clear bits (erased flash
+// reads 0xFF) and is never given a range that crosses a page boundary;
+// addresses are byte offsets from the start of the journal area.
+struct JournalFlash
+{
+  uint16_t rowSize;  // erase unit in bytes, a multiple of 4
+  uint16_t pageSize; // write unit, a multiple of 4 dividing rowSize; rowSize if writes have no such limit
+  uint8_t rowCount;  // rows given to the journal, at least 2
+  void *context;    // passed back to the primitives
+  void (*read)(void *context, uint32_t address, void *data, uint16_t length);
+  void (*program)(void *context, uint32_t address, const void *data, uint16_t length);
+  void (*erase)(void *context, uint8_t row);
+};
+
+enum JournalWriteResult
+{
+  JOURNAL_WRITTEN,   // appended to the active row
+  JOURNAL_COMPACTED, // active row was full; written to a freshly erased row
+  JOURNAL_UNCHANGED, // same as the latest record, nothing written
+  JOURNAL_TOO_LARGE  // payload longer than JOURNAL_MAX_RECORD
+};
+
+class SettingsJournal
+{
+public:
+  explicit SettingsJournal(const JournalFlash &flash);
+
+  // Scan the rows for the newest valid record. Call once before read/write.
+  void begin();
+
+  // Copy the latest record into `data` (at most `capacity` bytes). Returns
+  // the record's length, or 0 if the journal is empty; `version` receives the
+  // payload version it was written with.
+  uint8_t read(void *data, uint8_t capacity, uint8_t *version) const;
+
+  JournalWriteResult write(const void *data, uint8_t length, uint8_t version);
+
+  // Wear statistics since begin()
+  uint32_t appends() const { return appends_; }
+  uint32_t erases() const { return erases_; }
+
+private:
+  const JournalFlash &flash_;
+  int activeRow_;          // -1 until the first record is written
+  uint16_t sequence_;      // sequence number of the active row
+  uint16_t appendOffset_;  // where the next record goes in the active row
+  uint32_t latestAddress_; // address of the latest record's header
+  uint8_t latestLength_;
+  uint8_t latestVersion_;
+  uint32_t appends_;
+  uint32_t erases_;
+
+  bool rowSequence(uint8_t row, uint16_t *sequence) const;
+  void scanRow(uint8_t row);
+  void appendRecord(uint8_t row, uint16_t offset, const void *data, uint8_t length, uint8_t version);
+  void program(uint32_t address, const void *data, uint16_t length);
+};
@@ -0,0 +1,188 @@
+#include "TimerSerial.h"
+
+#ifdef ARDUINO_ARCH_AVR
+
+// Timer2 runs free at F_CPU / 8 and each channel's compare register is
+// moved on by a bit period at every match, so the bits stay on the timer's
+// grid however late an interrupt is serviced. Timer2 otherwise only drives
+// PWM on pins 3 and 11, which the firmware does not use.
+#define TIMER_SERIAL_PRESCALE 8
+#define TIMER_SERIAL_TX_LEAD 16 // ticks from write() to the first start bit
+
+TimerSerial *TimerSerial::active_ = NULL;
+
+TimerSerial::TimerSerial(uint8_t rxPin, uint8_t txPin)
+    : rxPin_(rxPin), txPin_(txPin), rxPort_(NULL), rxMask_(0), txPort_(NULL), txMask_(0), rxPcMask_(NULL),
+      rxPcBit_(0), rxPcFlag_(0), ticksPerBit_(0), transmitting_(false)
+{
+}
+
+void TimerSerial::begin(unsigned long baud)
+{
+  ticksPerBit_ = F_CPU / TIMER_SERIAL_PRESCALE / baud;
+  rxPort_ = portInputRegister(digitalPinToPort(rxPin_));
+  rxMask_ = digitalPinToBitMask(rxPin_);
+  txPort_ = portOutputRegister(digitalPinToPort(txPin_));
+  txMask_ = digitalPinToBitMask(txPin_);
+  rxPcMask_ = digitalPinToPCMSK(rxPin_);
+  rxPcBit_ = _BV(digitalPinToPCMSKbit(rxPin_));
+  rxPcFlag_ = _BV(digitalPinToPCICRbit(rxPin_));
+
+  pinMode(rxPin_, INPUT_PULLUP);
+  digitalWrite(txPin_, HIGH); // idle line
+  pinMode(txPin_, OUTPUT);
+
+  uint8_t oldSREG = SREG;
+  cli();
+  active_ = this;
+  rx_.cancel();
+  transmitting_ = false;
+  TIMSK2 &= ~(_BV(OCIE2A) | _BV(OCIE2B));
+  TCCR2A = 0;          // normal mode, counting 0-255
+  TCCR2B = _BV(CS21);  // F_CPU / 8
+  *rxPcMask_ |= rxPcBit_;
+  PCIFR = rxPcFlag_;
+  PCICR |= rxPcFlag_;
+  SREG = oldSREG;
+}
+
+void TimerSerial::end()
+{
+  flush();
+  uint8_t oldSREG = SREG;
+  cli();
+  TIMSK2 &= ~(_BV(OCIE2A) | _BV(OCIE2B));
+  *rxPcMask_ &= ~rxPcBit_;
+  rx_.cancel();
+  active_ = NULL;
+  SREG = oldSREG;
+}
+
+int TimerSerial::available()
+{
+  return rx_.received().count();
+}
+
+int TimerSerial::read()
+{
+  uint8_t byte;
+  return rx_.received().pop(&byte) ? byte : -1;
+}
+
+int TimerSerial::peek()
+{
+  return rx_.received().peek();
+}
+
+size_t TimerSerial::write(uint8_t byte)
+{
+  while (tx_.full())
+    ;
+  tx_.push(byte);
+  // Pushed first, so a transmit interrupt that finds the ring empty and
+  // stops has done so before this looks
+  if (!transmitting_)
+    startTransmit();
+  return 1;
+}
+
+int TimerSerial::availableForWrite()
+{
+  return tx_.space();
+}
+
+void TimerSerial::flush()
+{
+  while (transmitting_)
+    ;
+}
+
+void TimerSerial::startTransmit()
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  if (!transmitting_)
+  {
+    transmitting_ = true;
+    OCR2A = TCNT2 + TIMER_SERIAL_TX_LEAD;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 |= _BV(OCIE2A);
+  }
+  SREG = oldSREG;
+}
+
+// A bit period has ended: drive the next bit, starting the next queued byte
+// once the stop bit is done, or stop when there is none
+void TimerSerial::onTransmitTick()
+{
+  TimerSerial *port = active_;
+  if (!port->transmitter_.busy())
+  {
+    uint8_t byte;
+    if (!port->tx_.pop(&byte))
+    {
+      TIMSK2 &= ~_BV(OCIE2A);
+      port->transmitting_ = false;
+      return;
+    }
+    port->transmitter_.load(byte);
+  }
+  if (port->transmitter_.nextLevel())
+    *port->txPort_ |= port->txMask_;
+  else
+    *port->txPort_ &= ~port->txMask_;
+  OCR2A += port->ticksPerBit_;
+}
+
+// The middle of a bit of the frame being received
+void TimerSerial::onReceiveTick()
+{
+  TimerSerial *port = active_;
+  OCR2B += port->ticksPerBit_;
+  if (!port->rx_.sample(*port->rxPort_ & port->rxMask_))
+    return;
+  // Back to waiting for a start bit
+  TIMSK2 &= ~_BV(OCIE2B);
+  PCIFR = port->rxPcFlag_;
+  *port->rxPcMask_ |= port->rxPcBit_;
+}
+
+// A falling edge on an idle RX line is a start bit: sample it half a bit
+// later, then every bit. Changes on other pins of the group are ignored.
+void TimerSerial::onPinChange()
+{
+  TimerSerial *port = active_;
+  if (!port || !port->rx_.startBit(*port->rxPort_ & port->rxMask_))
+    return;
+  OCR2B = TCNT2 + port->ticksPerBit_ / 2;
+  *port->rxPcMask_ &= ~port->rxPcBit_; // the data bits' edges are not needed
+  TIFR2 = _BV(OCF2B);
+  TIMSK2 |= _BV(OCIE2B);
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  TimerSerial::onTransmitTick();
+}
+
+ISR(TIMER2_COMPB_vect)
+{
+  TimerSerial::onReceiveTick();
+}
+
+// Every pin-change vector, as SoftwareSerial does, whichever group the RX
+// pin is in. The others' pins can then wake the CPU from sleep (halSleep()
+// in src/hal_arduino.cpp) without landing in the default reset vector.
+ISR(PCINT0_vect)
+{
+  TimerSerial::onPinChange();
+}
+
+#ifdef PCINT1_vect
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+#endif
+#ifdef PCINT2_vect
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+#endif
+
+#endif
@@ -0,0 +1,265 @@
+// Interrupt-driven software UART.
+//
+// Two compare channels of a free-running timer clock the bits: one shifts
+// the byte being sent out onto the TX pin, the other samples the RX pin in
+// the middle of each bit, started by a pin-change interrupt on the falling
+// edge of the start bit. Bytes are queued through ring buffers, so write()
+// returns as soon as the byte is queued and each bit costs a few
+// microseconds of interrupt time. SoftwareSerial instead holds interrupts off
+// for the whole frame (about 1 ms a byte at 9600 baud), which loses button
+// edges and USB serial input.
+//
+// The framing (start bit, 8 data bits LSB first, stop bit) is in
+// SerialTransmitter and SerialReceiver, which know nothing of the hardware,
+// the buffering in SerialByteRing, and what the receive interrupts decide in
+// SerialReceivePath. TimerSerial binds them to the AVR's Timer2 and
+// pin-change vectors behind the Stream interface that DFRobotDFPlayerMini and
+// the player command queue use. As with AltSoftSerial, one instance can be
+// active at a time.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TIMER_SERIAL_TX_BUFFER_SIZE
+#define TIMER_SERIAL_TX_BUFFER_SIZE 32 // bytes queued for sending, a power of two
+#endif
+#ifndef TIMER_SERIAL_RX_BUFFER_SIZE
+#define TIMER_SERIAL_RX_BUFFER_SIZE 64 // bytes received between reads, a power of two
+#endif
+
+// Keeps the compiler from moving the slot access past the index update. The
+// targets are single-core, so ordering the stores is all it takes.
+#define SERIAL_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// Ring of bytes between an interrupt and loop(). Each side only writes its
+// own index, and a slot is filled before the index that publishes it, so
+// neither side needs to disable interrupts.
+template <uint8_t size>
+class SerialByteRing
+{
+public:
+  SerialByteRing() : head_(0), tail_(0), dropped_(0) {}
+
+  // Producer side. False, and the byte is counted as dropped, if full.
+  bool push(uint8_t byte)
+  {
+    uint8_t head = head_;
+    uint8_t next = (head + 1) & (size - 1);
+    if (next == tail_)
+    {
+      dropped_++;
+      return false;
+    }
+    bytes_[head] = byte;
+    SERIAL_BARRIER();
+    head_ = next;
+    return true;
+  }
+
+  // Consumer side. False if empty.
+  bool pop(uint8_t *byte)
+  {
+    uint8_t tail = tail_;
+    if (tail == head_)
+      return false;
+    *byte = bytes_[tail];
+    SERIAL_BARRIER();
+    tail_ = (tail + 1) & (size - 1);
+    return true;
+  }
+
+  int peek() const { return tail_ == head_ ? -1 : bytes_[tail_]; }
+  uint8_t count() const { return (head_ - tail_) & (size - 1); }
+  uint8_t space() const { return size - 1 - count(); }
+  bool full() const { return space() == 0; }
+
+  // Bytes lost to a full ring, counted modulo 256
+  uint8_t dropped() const { return dropped_; }
+
+private:
+  static_assert(size >= 2 && size <= 128 && (size & (size - 1)) == 0, "ring size must be a power of two");
+
+  uint8_t bytes_[size];
+  volatile uint8_t head_; // next slot to fill, written by the producer
+  volatile uint8_t tail_; // next slot to read, written by the consumer
+  volatile uint8_t dropped_;
+};
+
+// Shifts a byte out as line levels, one per bit period
+class SerialTransmitter
+{
+public:
+  SerialTransmitter() : frame_(0), bits_(0) {}
+
+  // Start a frame; only while !busy()
+  void load(uint8_t byte)
+  {
+    frame_ = (uint16_t)byte << 1 | 0x200; // start bit low, stop bit high
+    bits_ = 10;
+  }
+
+  // A frame has bit periods left to start
+  bool busy() const { return bits_ != 0; }
+
+  // Level to drive for the next bit period
+  bool nextLevel()
+  {
+    bool level = frame_ & 1;
+    frame_ >>= 1;
+    bits_--;
+    return level;
+  }
+
+private:
+  uint16_t frame_;
+  uint8_t bits_;
+};
+
+enum SerialSampleResult
+{
+  SERIAL_SAMPLE_MORE,    // the frame goes on, sample again a bit later
+  SERIAL_SAMPLE_BYTE,    // the stop bit was seen, the byte is complete
+  SERIAL_SAMPLE_NOISE,   // the start bit did not last to its middle
+  SERIAL_SAMPLE_FRAMING  // no stop bit; the byte is discarded
+};
+
+// Assembles a byte from samples taken in the middle of each bit period,
+// starting with the start bit
+class SerialReceiver
+{
+public:
+  SerialReceiver() : data_(0), bit_(0) {}
+
+  void begin()
+  {
+    data_ = 0;
+    bit_ = 0;
+  }
+
+  SerialSampleResult sample(bool level)
+  {
+    uint8_t bit = bit_++;
+    if (bit == 0)
+      return level ? SERIAL_SAMPLE_NOISE : SERIAL_SAMPLE_MORE;
+    if (bit <= 8)
+    {
+      data_ = (data_ >> 1) | (level ? 0x80 : 0);
+      return SERIAL_SAMPLE_MORE;
+    }
+    return level ? SERIAL_SAMPLE_BYTE : SERIAL_SAMPLE_FRAMING;
+  }
+
+  uint8_t data() const { return data_; }
+
+private:
+  uint8_t data_;
+  uint8_t bit_;
+};
+
+// The receive side of TimerSerial without its registers. The pin-change
+// interrupt hands startBit() the RX level: a low level on an idle line starts
+// a frame, to be sampled half a bit later and then every bit. The sample
+// interrupt hands sample() the level, until it says the frame is over and the
+// line should be watched for the next start bit again.
+template <uint8_t size>
+class SerialReceivePath
+{
+public:
+  SerialReceivePath() : receiving_(false), framingErrors_(0) {}
+
+  // True if a frame starts: arm the first sample and stop watching edges
+  bool startBit(bool level)
+  {
+    if (receiving_ || level)
+      return false;
+    receiving_ = true;
+    receiver_.begin();
+    return true;
+  }
+
+  // True once the frame is over, whether a byte was queued or not
+  bool sample(bool level)
+  {
+    SerialSampleResult result = receiver_.sample(level);
+    if (result == SERIAL_SAMPLE_MORE)
+      return false;
+    if (result == SERIAL_SAMPLE_BYTE)
+      rx_.push(receiver_.data());
+    else if (result == SERIAL_SAMPLE_FRAMING)
+      framingErrors_++;
+    receiving_ = false;
+    return true;
+  }
+
+  // Abandon a frame being received (the port is being stopped)
+  void cancel() { receiving_ = false; }
+
+  bool receiving() const { return receiving_; }
+  SerialByteRing<size> &received() { return rx_; }
+  const SerialByteRing<size> &received() const { return rx_; }
+
+  // Frames without a stop bit, counted modulo 256
+  uint8_t framingErrors() const { return framingErrors_; }
+
+private:
+  SerialReceiver receiver_;
+  SerialByteRing<size> rx_;
+  volatile bool receiving_;
+  volatile uint8_t framingErrors_;
+};
+
+#ifdef ARDUINO_ARCH_AVR
+#include <Arduino.h>
+
+class TimerSerial : public Stream
+{
+public:
+  TimerSerial(uint8_t rxPin, uint8_t txPin);
+
+  // Take over Timer2 and the pin-change interrupt of the RX pin. A bit must
+  // last under 256 ticks of F_CPU / 8: 9600 to 38400 baud at 16 MHz.
+  void begin(unsigned long baud);
+  void end();
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  // Waits for room only when the transmit buffer is full
+  size_t write(uint8_t byte) override;
+  int availableForWrite() override;
+  // Wait until everything queued has left the pin
+  void flush() override;
+  using Print::write;
+
+  // Bytes lost to a full receive buffer and frames without a stop bit,
+  // both counted modulo 256
+  uint8_t overflows() const { return rx_.received().dropped(); }
+  uint8_t framingErrors() const { return rx_.framingErrors(); }
+
+  // For the interrupt handlers
+  static void onTransmitTick();
+  static void onReceiveTick();
+  static void onPinChange();
+
+private:
+  void startTransmit();
+
+  uint8_t rxPin_;
+  uint8_t txPin_;
+  volatile uint8_t *rxPort_; // PINx of the RX pin
+  uint8_t rxMask_;
+  volatile uint8_t *txPort_; // PORTx of the TX pin
+  uint8_t txMask_;
+  volatile uint8_t *rxPcMask_; // PCMSKx of the RX pin
+  uint8_t rxPcBit_;
+  uint8_t rxPcFlag_; // its group's bit in PCICR and PCIFR
+  uint8_t ticksPerBit_;
+  volatile bool transmitting_;
+  SerialTransmitter transmitter_;
+  SerialByteRing<TIMER_SERIAL_TX_BUFFER_SIZE> tx_;
+  SerialReceivePath<TIMER_SERIAL_RX_BUFFER_SIZE> rx_;
+
+  static TimerSerial *active_;
+};
+#endif
@@ -0,0 +1,142 @@
+"""Measure the loudness of every track on the SD card image in media/tf.
+
+Each media/tf/NN/NNN.mp3 is decoded and measured by ffmpeg's ebur128 filter
+(integrated loudness per EBU R128 / ITU-R BS.1770), one ffmpeg process per
+core. The results are kept in media/loudness.json with a SHA-1 of each file,
+so a later run only measures files that were added or changed:
+
+    python scripts/analyse_loudness.py [--jobs N] [--force]
+
+scripts/generate_media_manifest.py reads the cache to give every track a
+volume offset, which the firmware applies when it plays the track. The
+manifest is regenerated at the end of a run. Needs ffmpeg on the PATH; the
+build itself does not, and without a cache every offset is 0.
+"""
+
+import argparse
+import concurrent.futures
+import hashlib
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+import generate_media_manifest
+
+# The summary ffmpeg prints at the end: "    I:         -16.3 LUFS"
+INTEGRATED = re.compile(r"^\s*I:\s+(-?[\d.]+|-inf)\s+LUFS", re.MULTILINE)
+
+
+def file_sha1(path):
+    digest = hashlib.sha1()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(1 << 20), b""):
+            digest.update(block)
+    return digest.hexdigest()
+
+
+def measure(path):
+    """Integrated loudness of a file in LUFS, None for silence."""
+    result = subprocess.run(
+        ["ffmpeg", "-nostats", "-hide_banner", "-i", path, "-filter_complex", "ebur128=framelog=quiet",
+         "-f", "null", "-"],
+        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, check=True)
+    matches = INTEGRATED.findall(result.stderr.decode(errors="replace"))
+    if not matches:
+        raise RuntimeError("no loudness summary from ffmpeg for %s" % path)
+    return None if matches[-1] == "-inf" else float(matches[-1])
+
+
+def failure_reason(error):
+    """One line on why measuring a file failed."""
+    if isinstance(error, subprocess.CalledProcessError):
+        lines = (error.stderr or b"").decode(errors="replace").strip().splitlines()
+        return "ffmpeg failed: %s" % (lines[-1] if lines else "exit status %d" % error.returncode)
+    return str(error)
+
+
+def card_tracks(media_dir):
+    """Relative paths of the NN/NNN*.mp3 files, as the manifest sees them."""
+    paths = []
+    for name in sorted(os.listdir(media_dir)):
+        if not re.fullmatch(r"\d{2}", name):
+            continue
+        for entry in sorted(os.listdir(os.path.join(media_dir, name))):
+            if re.match(r"\d{3}", entry) and entry.lower().endswith(".mp3"):
+                paths.append(name + "/" + entry)
+    return paths
+
+
+def load_cache(cache_path):
+    try:
+        with open(cache_path) as f:
+            return json.load(f).get("tracks", {})
+    except (OSError, ValueError):
+        return {}
+
+
+def analyse(project_dir, jobs, force):
+    media_dir = os.path.join(project_dir, "media", "tf")
+    cache_path = os.path.join(project_dir, generate_media_manifest.LOUDNESS_CACHE)
+    cached = load_cache(cache_path)
+
+    tracks = {}
+    stale = []
+    for rel in card_tracks(media_dir):
+        sha1 = file_sha1(os.path.join(media_dir, rel))
+        entry = cached.get(rel)
+        if not force and entry and entry.get("sha1") == sha1:
+            tracks[rel] = entry
+        else:
+            stale.append((rel, sha1))
+
+    # ffmpeg does the work, so threads are enough to keep every core busy.
+    # A file that cannot be measured does not stop the others: every result
+    # is cached, and the failures are returned once the cache is written.
+    failures = []
+    measured = 0
+    with concurrent.futures.ThreadPoolExecutor(max_workers=jobs) as pool:
+        futures = {pool.submit(measure, os.path.join(media_dir, rel)): (rel, sha1) for rel, sha1 in stale}
+        for future in concurrent.futures.as_completed(futures):
+            rel, sha1 = futures[future]
+            try:
+                lufs = future.result()
+            except (subprocess.CalledProcessError, RuntimeError, OSError) as e:
+                failures.append((rel, failure_reason(e)))
+                # A forced run keeps the earlier figure for an unchanged file
+                entry = cached.get(rel)
+                if entry and entry.get("sha1") == sha1:
+                    tracks[rel] = entry
+                continue
+            tracks[rel] = {"sha1": sha1, "lufs": lufs}
+            measured += 1
+            print("%s: %s" % (rel, "silent" if lufs is None else "%.1f LUFS" % lufs))
+
+    with open(cache_path, "w") as f:
+        json.dump({"tracks": dict(sorted(tracks.items()))}, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print("loudness: %d measured, %d unchanged, %d failed" % (measured, len(tracks) - measured, len(failures)))
+    return sorted(failures)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="files measured at once")
+    parser.add_argument("--force", action="store_true", help="measure every file again")
+    args = parser.parse_args()
+
+    if not shutil.which("ffmpeg"):
+        sys.exit("loudness: ffmpeg not found on the PATH")
+    project_dir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    failures = analyse(project_dir, args.jobs, args.force)
+    generate_media_manifest.generate(project_dir)
+    if failures:
+        for rel, reason in failures:
+            print("loudness: error: %s: %s" % (rel, reason), file=sys.stderr)
+        sys.exit("loudness: %d file(s) could not be measured" % len(failures))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,318 @@
+"""Generate include/media_manifest.h from the SD card image in media/tf.
+
+Walks media/tf/NN/*.mp3, reads each file's MP3 frame headers to get its
+bitrate and duration, takes its loudness from media/loudness.json (written
+by scripts/analyse_loudness.py) if measured, and writes a header with a
+constexpr folder/track table and the named UI sound constants. Runs as a PlatformIO pre-build script
+(extra_scripts = pre:scripts/generate_media_manifest.py) or standalone:
+
+    python scripts/generate_media_manifest.py
+
+The header is only rewritten when its contents change, so unchanged media
+does not trigger a rebuild.
+"""
+
+import json
+import os
+import re
+import struct
+
+# Names for the UI prompts in folder 01, by track number. The firmware refers
+# to these through the generated UI_SOUND_* constants, so every one must have
+# its file: a missing one fails the build, unless it has a stand-in below.
+UI_SOUND_NAMES = {
+    1: "startup",
+    2: "tone1",
+    3: "tone2",
+    4: "music_mode",
+    5: "voice_mode",
+    6: "candids_mode",
+    7: "settings_mode",
+    8: "tone3",
+    9: "favorites_mode",
+    10: "settings_volume_mode",
+    11: "settings_playback_order_mode",
+    12: "sequential_playback",
+    13: "random_playback",
+    14: "playlists_mode",
+}
+
+# Prompts the card needs but that are not recorded yet (media/audio_list.md
+# lists what each should say). Until its file is added, such a sound's
+# UI_SOUND_* constant plays the stand-in track given here and the build only
+# warns; once the file exists the sound plays it.
+UI_SOUND_STAND_INS = {
+    14: 3,  # playlists_mode: tone2
+}
+
+UI_FOLDER = 1
+MAX_TRACKS_PER_FOLDER = 64  # must match MAX_TRACKS_PER_FOLDER in src/main.cpp
+
+# Loudness normalisation: each track's offset from the median loudness of
+# the content folders, in DFPlayer volume steps. The UI prompts are short
+# tones and speech, so they are offset from that median but do not set it. The module's volume curve is not
+# documented; around the usual listening volumes a step is roughly 1.5 dB.
+LOUDNESS_CACHE = os.path.join("media", "loudness.json")
+DB_PER_VOLUME_STEP = 1.5
+MAX_GAIN_STEPS = 6  # keeps a badly mastered track from swinging the volume
+
+# kbps, indexed by [version is MPEG-1][layer 3/2/1][bitrate index]
+BITRATES = {
+    (True, 1): [0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448],
+    (True, 2): [0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384],
+    (True, 3): [0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320],
+    (False, 1): [0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256],
+    (False, 2): [0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160],
+    (False, 3): [0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160],
+}
+SAMPLE_RATES = {3: [44100, 48000, 32000], 2: [22050, 24000, 16000], 0: [11025, 12000, 8000]}
+
+
+def parse_frame_header(data, pos):
+    """Return (frame_length, samples, bitrate_kbps, sample_rate) or None."""
+    if pos + 4 > len(data):
+        return None
+    b1, b2, b3 = data[pos + 1], data[pos + 2], data[pos + 3]
+    if data[pos] != 0xFF or (b1 & 0xE0) != 0xE0:
+        return None
+    version = (b1 >> 3) & 0x03  # 3 = MPEG-1, 2 = MPEG-2, 0 = MPEG-2.5
+    layer = 4 - ((b1 >> 1) & 0x03)
+    bitrate_index = (b2 >> 4) & 0x0F
+    rate_index = (b2 >> 2) & 0x03
+    if version == 1 or layer == 4 or bitrate_index in (0, 15) or rate_index == 3:
+        return None
+    mpeg1 = version == 3
+    bitrate = BITRATES[(mpeg1, layer)][bitrate_index]
+    sample_rate = SAMPLE_RATES[version][rate_index]
+    padding = (b2 >> 1) & 0x01
+    if layer == 1:
+        samples = 384
+        length = (12 * bitrate * 1000 // sample_rate + padding) * 4
+    else:
+        samples = 1152 if (layer == 2 or mpeg1) else 576
+        length = samples // 8 * bitrate * 1000 // sample_rate + padding
+    return length, samples, bitrate, sample_rate
+
+
+def skip_id3v2(data):
+    if len(data) >= 10 and data[:3] == b"ID3":
+        size = 0
+        for b in data[6:10]:
+            size = (size << 7) | (b & 0x7F)
+        footer = 10 if data[5] & 0x10 else 0
+        return 10 + size + footer
+    return 0
+
+
+def analyse_mp3(path):
+    """Return (duration_ms, bitrate_kbps) for an MP3 file."""
+    with open(path, "rb") as f:
+        data = f.read()
+    pos = skip_id3v2(data)
+
+    # Find the first frame whose successor is also a valid frame header
+    while pos < len(data):
+        header = parse_frame_header(data, pos)
+        if header and parse_frame_header(data, pos + header[0]):
+            break
+        pos += 1
+    else:
+        return 0, 0
+
+    length, samples, bitrate, sample_rate = header
+
+    # A Xing/Info tag in the first frame gives the frame count directly
+    side_info = 32 if (data[pos + 1] >> 3) & 0x03 == 3 else 17
+    if (data[pos + 3] >> 6) == 3:  # mono
+        side_info = 17 if side_info == 32 else 9
+    tag = pos + 4 + side_info
+    if data[tag:tag + 4] in (b"Xing", b"Info"):
+        flags = struct.unpack(">I", data[tag + 4:tag + 8])[0]
+        if flags & 0x01:
+            frames = struct.unpack(">I", data[tag + 8:tag + 12])[0]
+            byte_count = struct.unpack(">I", data[tag + 12:tag + 16])[0] if flags & 0x02 else 0
+            duration_ms = frames * samples * 1000 // sample_rate
+            if byte_count and duration_ms:
+                bitrate = byte_count * 8 // duration_ms
+            return duration_ms, bitrate
+
+    # Otherwise walk every frame (handles VBR without a tag)
+    total_samples = 0
+    total_bytes = 0
+    while True:
+        header = parse_frame_header(data, pos)
+        if not header:
+            break
+        length, samples, _, sample_rate = header
+        total_samples += samples
+        total_bytes += length
+        pos += length
+    duration_ms = total_samples * 1000 // sample_rate
+    if duration_ms:
+        bitrate = total_bytes * 8 // duration_ms
+    return duration_ms, bitrate
+
+
+def load_loudness(cache_path):
+    """Return {"NN/NNN.mp3": lufs} for the measured, non-silent tracks."""
+    try:
+        with open(cache_path) as f:
+            tracks = json.load(f).get("tracks", {})
+    except (OSError, ValueError):
+        return {}
+    return {rel: entry["lufs"] for rel, entry in tracks.items() if entry.get("lufs") is not None}
+
+
+def gain_steps(loudness):
+    """Return {"NN/NNN.mp3": volume steps} bringing each track to the content median."""
+    levels = sorted(lufs for rel, lufs in loudness.items() if rel[:2] != "%02d" % UI_FOLDER)
+    if not levels:
+        return {}
+    median = levels[len(levels) // 2]
+    steps = {}
+    for rel, lufs in loudness.items():
+        step = int(round((median - lufs) / DB_PER_VOLUME_STEP))
+        steps[rel] = max(-MAX_GAIN_STEPS, min(MAX_GAIN_STEPS, step))
+    return steps
+
+
+def scan_media(media_dir, gains):
+    """Return {folder: [(track, duration_ms, bitrate_kbps, gain_steps), ...]} for NN folders."""
+    folders = {}
+    for name in sorted(os.listdir(media_dir)):
+        if not re.fullmatch(r"\d{2}", name):
+            continue  # e.g. the MP3/ folder used by playMp3Folder()
+        folder = int(name)
+        tracks = []
+        for entry in sorted(os.listdir(os.path.join(media_dir, name))):
+            match = re.match(r"(\d{3})", entry)
+            if not match or not entry.lower().endswith(".mp3"):
+                continue
+            duration_ms, bitrate = analyse_mp3(os.path.join(media_dir, name, entry))
+            tracks.append((int(match.group(1)), duration_ms, bitrate, gains.get(name + "/" + entry, 0)))
+        folders[folder] = tracks
+    return folders
+
+
+def render_header(folders):
+    num_folders = max(folders) if folders else 0
+    out = [
+        "// Generated by scripts/generate_media_manifest.py from media/tf. Do not edit.",
+        "#pragma once",
+        "",
+        "#include <stdint.h>",
+        "",
+        "#ifndef PROGMEM",
+        "#define PROGMEM",
+        "#endif",
+        "",
+        "#define MEDIA_NUM_FOLDERS %d" % num_folders,
+        "",
+        "struct MediaTrack",
+        "{",
+        "  uint8_t number;       // file number within the folder (NNN.mp3)",
+        "  int8_t gainSteps;     // volume offset bringing it to the content's median loudness",
+        "  uint16_t bitrateKbps; // average bitrate",
+        "  uint32_t durationMs;  // playback length",
+        "};",
+        "",
+        "struct MediaFolder",
+        "{",
+        "  uint8_t count;            // number of tracks in the folder",
+        "  uint8_t maxTrack;         // highest track number",
+        "  const MediaTrack *tracks; // sorted by number",
+        "  uint32_t present[2];      // bit n-1 set if track n exists (tracks 1..64)",
+        "};",
+        "",
+    ]
+    for folder in range(1, num_folders + 1):
+        tracks = folders.get(folder, [])
+        out.append("#define MEDIA_FOLDER_%02d_COUNT %d" % (folder, len(tracks)))
+    out.append("")
+    for folder in range(1, num_folders + 1):
+        tracks = folders.get(folder, [])
+        if not tracks:
+            continue
+        out.append("constexpr MediaTrack MEDIA_FOLDER_%02d_TRACKS[] PROGMEM = {" % folder)
+        for track, duration_ms, bitrate, gain in tracks:
+            out.append("    {%d, %d, %d, %d}," % (track, gain, bitrate, duration_ms))
+        out.append("};")
+        out.append("")
+
+    out.append("// Indexed by folder number - 1")
+    out.append("constexpr MediaFolder MEDIA_FOLDERS[MEDIA_NUM_FOLDERS] PROGMEM = {")
+    for folder in range(1, num_folders + 1):
+        tracks = folders.get(folder, [])
+        present = 0
+        for track, _, _, _ in tracks:
+            if track <= MAX_TRACKS_PER_FOLDER:
+                present |= 1 << (track - 1)
+        table = "MEDIA_FOLDER_%02d_TRACKS" % folder if tracks else "nullptr"
+        out.append("    {%d, %d, %s, {0x%08XUL, 0x%08XUL}}," % (
+            len(tracks), max((t[0] for t in tracks), default=0), table,
+            present & 0xFFFFFFFF, present >> 32))
+    out.append("};")
+    out.append("")
+
+    ui_tracks = {t[0] for t in folders.get(UI_FOLDER, [])}
+    out.append("// Named UI sounds in folder %02d: X(name, track)" % UI_FOLDER)
+    out.append("#define MEDIA_UI_SOUNDS(X) \\")
+    names = sorted(UI_SOUND_NAMES.items())
+    for i, (track, name) in enumerate(names):
+        out.append("  X(%s, %d)%s" % (name, track, " \\" if i < len(names) - 1 else ""))
+    out.append("")
+    out.append("#define MEDIA_NUM_UI_SOUNDS %d" % len(names))
+    out.append("")
+    standing_in = [(track, name) for track, name in names
+                   if track not in ui_tracks and UI_SOUND_STAND_INS.get(track) in ui_tracks]
+    out.append("enum UISound")
+    out.append("{")
+    for track, name in names:
+        if (track, name) in standing_in:
+            out.append("  UI_SOUND_%s = %d, // stand-in until media/tf/%02d/%03d.mp3 is recorded" % (
+                name.upper(), UI_SOUND_STAND_INS[track], UI_FOLDER, track))
+        else:
+            out.append("  UI_SOUND_%s = %d," % (name.upper(), track))
+    out.append("};")
+    out.append("")
+
+    # Also stops a build that uses a header left over from before the file
+    # went missing
+    missing = [(track, name) for track, name in names
+               if track not in ui_tracks and (track, name) not in standing_in]
+    for track, name in missing:
+        out.append('#error "UI sound %s has no file media/tf/%02d/%03d.mp3"' % (name, UI_FOLDER, track))
+    if missing:
+        out.append("")
+    return "\n".join(out), missing, standing_in
+
+
+def generate(project_dir):
+    media_dir = os.path.join(project_dir, "media", "tf")
+    header_path = os.path.join(project_dir, "include", "media_manifest.h")
+    gains = gain_steps(load_loudness(os.path.join(project_dir, LOUDNESS_CACHE)))
+    header, missing, standing_in = render_header(scan_media(media_dir, gains))
+
+    try:
+        with open(header_path) as f:
+            unchanged = f.read() == header
+    except OSError:
+        unchanged = False
+    if not unchanged:
+        with open(header_path, "w") as f:
+            f.write(header)
+        print("media manifest: wrote %s" % os.path.relpath(header_path, project_dir))
+
+    for track, name in standing_in:
+        print("media manifest: warning: UI sound %s is not recorded; the card needs media/tf/%02d/%03d.mp3, "
+              "track %d stands in" % (name, UI_FOLDER, track, UI_SOUND_STAND_INS[track]))
+    if missing:
+        raise SystemExit("media manifest: error: no file for UI sound %s" % ", ".join(
+            "%s (media/tf/%02d/%03d.mp3)" % (name, UI_FOLDER, track) for track, name in missing))
+
+
+if "Import" in globals():
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    generate(env["PROJECT_DIR"])  # noqa: F821
+elif __name__ == "__main__":
+    generate(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
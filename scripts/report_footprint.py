@@ -0,0 +1,105 @@
+"""Report each firmware image's flash and RAM use.
+
+Runs as a PlatformIO post-build script (extra_scripts =
+post:scripts/report_footprint.py): once the ELF is linked it is measured with
+the toolchain's size tool, a line is printed against the board's limits, and
+the figures are recorded in .pio/build/footprint.csv, one row per env, so
+`pio run` across all envs leaves a side-by-side table. Standalone, it prints
+that table:
+
+    python scripts/report_footprint.py
+
+Envs without a size tool (native) are skipped.
+"""
+
+import csv
+import os
+import re
+import subprocess
+
+# Sections counted by PlatformIO's own size check
+FLASH_SECTIONS = re.compile(r"^(?:\.text|\.data|\.rodata|\.text\.align|\.ARM\.exidx)\s+(\d+)")
+RAM_SECTIONS = re.compile(r"^(?:\.data|\.bss|\.noinit)\s+(\d+)")
+
+# Static RAM must leave at least this much for the stack and heap (the Nano
+# has 2 KB in all); a build that leaves less gets a warning
+STACK_RESERVE = 512
+
+FIELDS = ["env", "build", "flash", "flash_max", "ram", "ram_max"]
+
+
+def measure(size_tool, elf_path):
+    output = subprocess.check_output([size_tool, "-A", elf_path]).decode()
+    flash = ram = 0
+    for line in output.splitlines():
+        match = FLASH_SECTIONS.match(line)
+        if match:
+            flash += int(match.group(1))
+        match = RAM_SECTIONS.match(line)
+        if match:
+            ram += int(match.group(1))
+    return flash, ram
+
+
+def git_revision(project_dir):
+    try:
+        return subprocess.check_output(
+            ["git", "rev-parse", "--short", "HEAD"], cwd=project_dir, stderr=subprocess.DEVNULL
+        ).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def read_table(table_path):
+    try:
+        with open(table_path) as f:
+            return list(csv.DictReader(f))
+    except OSError:
+        return []
+
+
+def record(table_path, row):
+    rows = [r for r in read_table(table_path) if r["env"] != row["env"]]
+    rows.append(row)
+    rows.sort(key=lambda r: r["env"])
+    with open(table_path, "w") as f:
+        writer = csv.DictWriter(f, fieldnames=FIELDS, lineterminator="\n")
+        writer.writeheader()
+        writer.writerows(rows)
+
+
+def percent(used, limit):
+    return " (%.1f%% of %d)" % (100.0 * used / limit, limit) if limit else ""
+
+
+def report(env):
+    size_tool = env.subst("$SIZETOOL")
+    if not size_tool:
+        return
+    elf_path = env.subst("$BUILD_DIR/${PROGNAME}.elf")
+    board = env.BoardConfig()
+    flash_max = int(board.get("upload.maximum_size", 0))
+    ram_max = int(board.get("upload.maximum_ram_size", 0))
+    flash, ram = measure(size_tool, elf_path)
+    print("footprint %s: flash %d%s, RAM %d%s" % (
+        env["PIOENV"], flash, percent(flash, flash_max), ram, percent(ram, ram_max)))
+    if ram_max and ram_max - ram < STACK_RESERVE:
+        print("warning: %s leaves %d bytes of RAM for the stack, under %d" % (
+            env["PIOENV"], ram_max - ram, STACK_RESERVE))
+    record(os.path.join(env.subst("$PROJECT_BUILD_DIR"), "footprint.csv"), {
+        "env": env["PIOENV"], "build": git_revision(env["PROJECT_DIR"]),
+        "flash": flash, "flash_max": flash_max, "ram": ram, "ram_max": ram_max,
+    })
+
+
+if "Import" in globals():
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", lambda target, source, env: report(env))  # noqa: F821
+elif __name__ == "__main__":
+    project_dir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    rows = read_table(os.path.join(project_dir, ".pio", "build", "footprint.csv"))
+    if not rows:
+        print("no footprint recorded yet; run `pio run` first")
+    for row in rows:
+        print("%-20s flash %6s / %-7s RAM %6s / %-6s %s" % (
+            row["env"], row["flash"], row["flash_max"], row["ram"], row["ram_max"], row["build"]))
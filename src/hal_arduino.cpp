@@ -0,0 +1,444 @@
+// HAL implementation for the boards (include/hal.h)
+#ifdef ARDUINO
+
+#include "hal.h"
+#include "ButtonInput.h"
+#include "DFRobotDFPlayerMini.h"
+
+Board::PlayerPort &FPSerial = Board::playerPort();
+Stream &PlayerSerial = FPSerial;
+Stream &Console = Board::console();
+
+DFRobotDFPlayerMini DFPlayer;
+
+// Buttons are wired active low with the internal pull-ups. Their pin
+// interrupts only timestamp edges into the queue; classification runs in
+// halButtonsRead(). Bench builds leave the pins alone and take edges from
+// halButtonInject() instead.
+static const uint8_t buttonPins[HAL_BUTTON_COUNT] = {Board::button1Pin, Board::button2Pin, Board::button3Pin};
+ButtonInput buttonInput;
+uint8_t sampledButtons = 0; // bit per button whose pin has no interrupt
+
+void halBegin()
+{
+  Serial.begin(USB_SERIAL_BAUD);
+  FPSerial.begin(FP_SERIAL_BAUD);
+#ifdef DFPLAYER_BUSY_PIN
+  pinMode(DFPLAYER_BUSY_PIN, INPUT);
+#endif
+#if defined(LATENCY_BENCH) && defined(LATENCY_PROBE_PIN)
+  pinMode(LATENCY_PROBE_PIN, OUTPUT);
+  digitalWrite(LATENCY_PROBE_PIN, LOW);
+#endif
+}
+
+unsigned long halMillis()
+{
+  return millis();
+}
+
+#ifdef ARDUINO_ARCH_SAMD
+// SysTick counts the core clock down from LOAD once per millisecond
+uint32_t halCycles()
+{
+  uint32_t ticks, ms;
+  do
+  {
+    ticks = SysTick->VAL;
+    ms = millis();
+  } while (SysTick->VAL > ticks); // reloaded in between: read again
+  return ms * (SysTick->LOAD + 1) + (SysTick->LOAD - ticks);
+}
+#else
+uint32_t halCycles()
+{
+  return micros() * HAL_CYCLES_PER_US;
+}
+#endif
+
+// The library is only used to reset and bring the module online; runtime
+// commands are framed by the firmware itself
+bool halPlayerBegin(bool reset)
+{
+  return DFPlayer.begin(FPSerial, /*isACK = */ true, /*doReset = */ reset);
+}
+
+bool halPlayerBusy()
+{
+#ifdef DFPLAYER_BUSY_PIN
+  return digitalRead(DFPLAYER_BUSY_PIN) == LOW;
+#else
+  return false;
+#endif
+}
+
+void button1ISR()
+{
+  buttonInput.edge(0, digitalRead(Board::button1Pin) == LOW, millis());
+}
+
+void button2ISR()
+{
+  buttonInput.edge(1, digitalRead(Board::button2Pin) == LOW, millis());
+}
+
+void button3ISR()
+{
+  buttonInput.edge(2, digitalRead(Board::button3Pin) == LOW, millis());
+}
+
+static void (*const buttonISRs[HAL_BUTTON_COUNT])() = {button1ISR, button2ISR, button3ISR};
+
+#ifdef __AVR__
+// Pins without an external interrupt (the Nano's pin 4; its pin-change
+// vectors are taken by the player's TimerSerial) are sampled at 1 kHz from Timer0's
+// compare match, which millis() leaves free. AVR interrupts do not nest, so
+// the queue still has a single producer at a time.
+ISR(TIMER0_COMPA_vect)
+{
+  static uint8_t levels = 0;
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+  {
+    uint8_t bit = 1 << i;
+    if (!(sampledButtons & bit))
+      continue;
+    bool pressed = digitalRead(buttonPins[i]) == LOW;
+    if (pressed != ((levels & bit) != 0))
+    {
+      levels ^= bit;
+      buttonInput.edge(i, pressed, millis());
+    }
+  }
+}
+#endif
+
+static bool pinHasInterrupt(uint8_t pin)
+{
+#ifdef ARDUINO_ARCH_SAMD
+  return g_APinDescription[pin].ulExtInt != NOT_AN_INTERRUPT;
+#else
+  return digitalPinToInterrupt(pin) != NOT_AN_INTERRUPT;
+#endif
+}
+
+void halButtonBegin(uint8_t button, HalButtonCallback onPressed, uint32_t longPressMs, HalButtonCallback onLongPressed)
+{
+  buttonInput.begin(button, longPressMs, onPressed, onLongPressed);
+#ifndef LATENCY_BENCH
+  uint8_t pin = buttonPins[button];
+  pinMode(pin, INPUT_PULLUP);
+  if (pinHasInterrupt(pin))
+    attachInterrupt(digitalPinToInterrupt(pin), buttonISRs[button], CHANGE);
+#ifdef __AVR__
+  else
+  {
+    sampledButtons |= 1 << button;
+    OCR0A = 0x80;
+    TIMSK0 |= _BV(OCIE0A);
+  }
+#endif
+#endif
+}
+
+static HalButtonEventCallback buttonEventCallback = NULL;
+
+static void forwardButtonEvent(void *context, const ButtonEvent &event)
+{
+  buttonEventCallback(event);
+}
+
+void halButtonOnEvent(HalButtonEventCallback callback)
+{
+  buttonEventCallback = callback;
+  buttonInput.setHandler(callback ? forwardButtonEvent : NULL, NULL);
+}
+
+void halButtonsRead()
+{
+  buttonInput.update(millis());
+#ifndef LATENCY_BENCH
+  // Edges were lost while loop() was away: take the pins as they are now
+  if (buttonInput.overflowed())
+  {
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+      buttonInput.sync(i, digitalRead(buttonPins[i]) == LOW, now);
+  }
+#endif
+}
+
+#ifdef LATENCY_BENCH
+// The only producer in bench builds, so calling it from loop() is safe
+void halButtonInject(uint8_t button, bool pressed)
+{
+  buttonInput.edge(button, pressed, millis());
+}
+
+void halProbe(bool level)
+{
+#ifdef LATENCY_PROBE_PIN
+  digitalWrite(LATENCY_PROBE_PIN, level ? HIGH : LOW);
+#endif
+}
+#endif
+
+// -- Persistent store --
+
+// One specialization per StoreBackend, each behind its architecture's
+// headers; Board::store picks the one that is compiled in
+template <StoreBackend backend>
+struct BoardStore;
+
+#ifdef ARDUINO_ARCH_SAMD
+#include <FlashStorage_SAMD.h>
+
+// Flash areas for the store slots and the settings journal, each aligned to
+// an erase row. Uploading the firmware fills them with zeros.
+__attribute__((__aligned__(Board::settingsRowSize))) static const uint8_t storeArea[HAL_STORE_SLOT_COUNT][HAL_STORE_SLOT_SIZE] = {};
+__attribute__((__aligned__(Board::settingsRowSize))) static const uint8_t settingsJournalArea[Board::settingsRows * Board::settingsRowSize] = {};
+
+// Reads go through FlashClass too, so they are not optimised against the
+// all-zero initialisers
+FlashClass storeNvm(storeArea, sizeof(storeArea));
+FlashClass settingsNvm(settingsJournalArea, sizeof(settingsJournalArea));
+
+template <>
+struct BoardStore<STORE_NVM>
+{
+  static void read(uint8_t slot, void *data, size_t size)
+  {
+    storeNvm.read(storeArea[slot], data, size);
+  }
+
+  static void write(uint8_t slot, const void *data, size_t size)
+  {
+    storeNvm.erase(storeArea[slot], HAL_STORE_SLOT_SIZE);
+    storeNvm.write(storeArea[slot], data, size);
+  }
+
+  static void readAt(uint8_t slot, size_t offset, void *data, size_t size)
+  {
+    storeNvm.read(storeArea[slot] + offset, data, size);
+  }
+
+  // The row is erased as a whole, so the bytes around the patch go through RAM
+  static void writeAt(uint8_t slot, size_t offset, const void *data, size_t size)
+  {
+    uint8_t row[HAL_STORE_SLOT_SIZE];
+    storeNvm.read(storeArea[slot], row, sizeof(row));
+    memcpy(row + offset, data, size);
+    write(slot, row, sizeof(row));
+  }
+
+  static void journalRead(void *context, uint32_t address, void *data, uint16_t length)
+  {
+    settingsNvm.read(settingsJournalArea + address, data, length);
+  }
+
+  // FlashClass::write() fills one page buffer per page from the start
+  // address on, so it is only right for a range within a page; the journal
+  // splits its programs at Board::settingsPageSize
+  static void journalProgram(void *context, uint32_t address, const void *data, uint16_t length)
+  {
+    settingsNvm.write(settingsJournalArea + address, data, length);
+  }
+
+  static void journalErase(void *context, uint8_t row)
+  {
+    settingsNvm.erase(settingsJournalArea + (uint32_t)row * Board::settingsRowSize, Board::settingsRowSize);
+  }
+};
+#endif
+
+#ifdef __AVR__
+#include <avr/eeprom.h>
+
+// The store slots, then the journal rows. Blank EEPROM reads 0xFF like
+// erased flash; programming ANDs into what is there, as on NOR, so the
+// journal sees the same semantics. Only bytes that change are written,
+// which spares both time (3.4 ms a byte) and wear.
+#define EEPROM_JOURNAL_BASE (HAL_STORE_SLOT_COUNT * HAL_STORE_SLOT_SIZE)
+
+static_assert(EEPROM_JOURNAL_BASE + Board::settingsRows * Board::settingsRowSize <= E2END + 1,
+              "store slots and settings journal must fit in EEPROM");
+
+static uint8_t *eepromCell(uint16_t address)
+{
+  return (uint8_t *)(uintptr_t)address;
+}
+
+template <>
+struct BoardStore<STORE_EEPROM>
+{
+  static void read(uint8_t slot, void *data, size_t size)
+  {
+    eeprom_read_block(data, eepromCell(slot * HAL_STORE_SLOT_SIZE), size);
+  }
+
+  static void write(uint8_t slot, const void *data, size_t size)
+  {
+    eeprom_update_block(data, eepromCell(slot * HAL_STORE_SLOT_SIZE), size);
+  }
+
+  static void readAt(uint8_t slot, size_t offset, void *data, size_t size)
+  {
+    eeprom_read_block(data, eepromCell(slot * HAL_STORE_SLOT_SIZE + offset), size);
+  }
+
+  static void writeAt(uint8_t slot, size_t offset, const void *data, size_t size)
+  {
+    eeprom_update_block(data, eepromCell(slot * HAL_STORE_SLOT_SIZE + offset), size);
+  }
+
+  static void journalRead(void *context, uint32_t address, void *data, uint16_t length)
+  {
+    eeprom_read_block(data, eepromCell(EEPROM_JOURNAL_BASE + address), length);
+  }
+
+  static void journalProgram(void *context, uint32_t address, const void *data, uint16_t length)
+  {
+    uint8_t *cell = eepromCell(EEPROM_JOURNAL_BASE + address);
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (uint16_t i = 0; i < length; i++)
+      eeprom_update_byte(cell + i, eeprom_read_byte(cell + i) & bytes[i]);
+  }
+
+  static void journalErase(void *context, uint8_t row)
+  {
+    uint8_t *cell = eepromCell(EEPROM_JOURNAL_BASE + row * Board::settingsRowSize);
+    for (uint16_t i = 0; i < Board::settingsRowSize; i++)
+      eeprom_update_byte(cell + i, 0xFF);
+  }
+};
+#endif
+
+typedef BoardStore<Board::store> Store;
+
+void halStoreRead(uint8_t slot, void *data, size_t size)
+{
+  Store::read(slot, data, size);
+}
+
+void halStoreWrite(uint8_t slot, const void *data, size_t size)
+{
+  Store::write(slot, data, size);
+}
+
+void halStoreReadAt(uint8_t slot, size_t offset, void *data, size_t size)
+{
+  Store::readAt(slot, offset, data, size);
+}
+
+void halStoreWriteAt(uint8_t slot, size_t offset, const void *data, size_t size)
+{
+  Store::writeAt(slot, offset, data, size);
+}
+
+const JournalFlash halSettingsFlash = {Board::settingsRowSize, Board::settingsPageSize, Board::settingsRows, NULL,
+                                       Store::journalRead, Store::journalProgram, Store::journalErase};
+
+// -- Power --
+
+#ifdef ARDUINO_ARCH_SAMD
+static void eicClock(uint32_t generator)
+{
+  GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCM_EIC) | generator | GCLK_CLKCTRL_CLKEN;
+  while (GCLK->STATUS.bit.SYNCBUSY)
+    ;
+}
+
+// The EIC runs from the 48 MHz clock, which standby stops, so for the sleep
+// it moves to GCLK6 on the 32 kHz ultra-low-power oscillator and the
+// buttons' lines become wake-up sources. Their CHANGE interrupts then run on
+// waking as usual and queue the press.
+void halSleep()
+{
+  Serial.flush();
+  GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(6) | GCLK_GENCTRL_SRC_OSCULP32K | GCLK_GENCTRL_GENEN | GCLK_GENCTRL_RUNSTDBY;
+  while (GCLK->STATUS.bit.SYNCBUSY)
+    ;
+  eicClock(GCLK_CLKCTRL_GEN_GCLK6);
+  uint32_t wakeLines = 0;
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+    if (pinHasInterrupt(buttonPins[i]))
+      wakeLines |= 1UL << g_APinDescription[buttonPins[i]].ulExtInt;
+  EIC->WAKEUP.reg |= wakeLines;
+  USBDevice.standby();
+
+  // A pending SysTick can keep the core from entering standby
+  SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+  SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  __DSB();
+  __WFI();
+  SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+  SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+
+  EIC->WAKEUP.reg &= ~wakeLines;
+  eicClock(GCLK_CLKCTRL_GEN_GCLK0);
+}
+#elif defined(__AVR__)
+#include <avr/sleep.h>
+
+// INT0/INT1 only see edges while the I/O clock runs, which power-down stops,
+// so the buttons wake the CPU through pin-change interrupts instead. Their
+// vectors belong to the player's TimerSerial, whose handler ignores pins it
+// is not receiving on; all they need to do here is wake. Timer2 stops too,
+// so a frame still going out to the module is finished first. The press on an INT0/INT1
+// pin is then queued by hand, as its own interrupt missed it; Timer0's
+// sampler picks up the other pins once it runs again.
+void halSleep()
+{
+  Serial.flush();
+  FPSerial.flush();
+  uint8_t savedPcicr = PCICR;
+  uint8_t savedMasks[3] = {PCMSK0, PCMSK1, PCMSK2};
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+  {
+    *digitalPinToPCMSK(buttonPins[i]) |= _BV(digitalPinToPCMSKbit(buttonPins[i]));
+    PCIFR = _BV(digitalPinToPCICRbit(buttonPins[i]));
+    PCICR |= _BV(digitalPinToPCICRbit(buttonPins[i]));
+  }
+
+  noInterrupts();
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  sleep_enable();
+#ifdef sleep_bod_disable
+  sleep_bod_disable();
+#endif
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+
+  PCICR = savedPcicr;
+  PCMSK0 = savedMasks[0];
+  PCMSK1 = savedMasks[1];
+  PCMSK2 = savedMasks[2];
+
+  // With interrupts off this is the queue's only producer
+  noInterrupts();
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+    if (!(sampledButtons & (1 << i)) && digitalRead(buttonPins[i]) == LOW)
+      buttonInput.edge(i, true, now);
+  interrupts();
+}
+#else
+// No sleep support: stay awake
+void halSleep()
+{
+}
+#endif
+
+// -- Entropy --
+
+// Low bits of a floating analog input, mixed with the jitter between
+// micros() and the ADC conversion time
+uint32_t halEntropy()
+{
+  uint32_t seed = micros();
+  for (uint8_t i = 0; i < 32; i++)
+    seed = ((seed << 3) | (seed >> 29)) ^ analogRead(Board::noisePin) ^ micros();
+  return seed;
+}
+
+#endif
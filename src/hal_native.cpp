@@ -0,0 +1,713 @@
+// HAL implementation for the native (Linux) build (include/hal.h).
+//
+// The peripherals are simulated in-process: a millisecond clock that moves
+// one tick per loop(), a DFPlayer that answers instantly from the media
+// manifest, buttons driven from stdin and flash kept in RAM. Lines on stdin
+// starting with '!' drive the simulation; any other line is typed into the
+// firmware's console as if it came over USB serial:
+//   !wait <ms>           let the firmware run for ms before reading on
+//   !press <button>      short press (0 = TopRight, 1 = BottomRight, 2 = BottomLeft)
+//   !hold <button> <ms>  press, hold for ms, release
+//   !stall <ms>          keep loop() from running for ms, as a blocking call
+//                        would; the clock, the module and button edges go on
+// While the firmware is asleep (halSleep()) loop() does not run and console
+// input waits; a press wakes it.
+//   !quit                exit
+// Options: --fast runs the clock as fast as the host allows instead of in
+// real time, waiting on stdin rather than polling it, which suits scripts;
+// --trace logs the player frames on stderr; --player <tty> talks to a
+// module on a serial device instead, e.g. tools/dfplayer_emulator's pty,
+// with the clock following real time.
+#ifndef ARDUINO
+
+#include "hal.h"
+#include "ButtonInput.h"
+#include "dfplayer_protocol.h"
+#include "media_manifest.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NATIVE_BUFFER_SIZE 512
+#define NATIVE_PRESS_MS 50 // how long !press holds a button down
+
+void setup();
+void loop();
+
+static unsigned long simNow = 0;
+static bool simInSetup = false;
+static bool simTrace = false;
+static bool simRealTime = false; // clock follows the host's, for --player
+static unsigned long simStallUntil = 0;
+static bool simAsleep = false; // halSleep() called, no button pressed since
+static struct timespec simStartedAt;
+
+static unsigned long realMillis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - simStartedAt.tv_sec) * 1000 + (now.tv_nsec - simStartedAt.tv_nsec) / 1000000;
+}
+
+// -- Print --
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+    n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(long n)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", n);
+  return print(text);
+}
+
+size_t Print::print(unsigned long n)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", n);
+  return print(text);
+}
+
+// Fixed-size byte FIFO behind the simulated serial ports
+struct NativeFifo
+{
+  uint8_t data[NATIVE_BUFFER_SIZE];
+  uint16_t head;
+  uint16_t count;
+
+  void push(uint8_t b)
+  {
+    if (count < NATIVE_BUFFER_SIZE)
+      data[(head + count++) % NATIVE_BUFFER_SIZE] = b;
+  }
+
+  int pop()
+  {
+    if (count == 0)
+      return -1;
+    uint8_t b = data[head];
+    head = (head + 1) % NATIVE_BUFFER_SIZE;
+    count--;
+    return b;
+  }
+
+  int peek() const { return count ? data[head] : -1; }
+};
+
+// -- Console --
+
+// Output goes straight to stdout; input is fed line by line from main().
+// simConsoleFd() moves both directions to a tty instead.
+class NativeConsole : public Stream
+{
+public:
+  NativeFifo rx;
+  Stream *tty = NULL;
+
+  size_t write(uint8_t b) override
+  {
+    if (tty)
+      return tty->write(b);
+    if (b != '\r')
+      putchar(b);
+    return 1;
+  }
+
+  int available() override { return tty ? tty->available() : rx.count; }
+  int read() override { return tty ? tty->read() : rx.pop(); }
+  int peek() override { return tty ? tty->peek() : rx.peek(); }
+};
+
+static NativeConsole nativeConsole;
+Stream &Console = nativeConsole;
+
+// -- Simulated DFPlayer --
+
+// Answers every frame as soon as it is complete. Playback ends after the
+// track's manifest duration; tracks missing from the manifest are reported
+// as FileMismatch, as the module does for files not on the card.
+class NativePlayer : public Stream
+{
+public:
+  NativeFifo rx; // module -> firmware
+  uint8_t frame[DFPLAYER_FRAME_LENGTH];
+  uint8_t frameLength;
+  bool playing;
+  bool paused;
+  bool asleep;               // after SLEEP, until OUTPUT_DEVICE or RESET
+  unsigned long remainingMs; // playback left when paused
+  unsigned long endsAt;
+
+  size_t write(uint8_t b) override
+  {
+    if (frameLength == 0 && b != DFPLAYER_FRAME_START)
+      return 1;
+    frame[frameLength++] = b;
+    if (frameLength == DFPLAYER_FRAME_LENGTH)
+    {
+      frameLength = 0;
+      if (dfplayerFrameValid(frame))
+        handleFrame(frame[3], frame[4], (frame[5] << 8) | frame[6]);
+      else
+        reply(PLAYER_FB_ERROR, CheckSumNotMatch);
+    }
+    return 1;
+  }
+
+  int available() override { return rx.count; }
+  int read() override { return rx.pop(); }
+  int peek() override { return rx.peek(); }
+
+  void reply(uint8_t command, uint16_t param)
+  {
+    uint8_t out[DFPLAYER_FRAME_LENGTH];
+    dfplayerEncodeFrame(out, command, false, param);
+    if (simTrace)
+      fprintf(stderr, "%8lu <- %02X %04X\n", simNow, command, param);
+    for (uint8_t i = 0; i < DFPLAYER_FRAME_LENGTH; i++)
+      rx.push(out[i]);
+  }
+
+  // Called once per simulated millisecond
+  void tick()
+  {
+    if (playing && !paused && (long)(simNow - endsAt) >= 0)
+    {
+      playing = false;
+      // The module reports the end of a track twice
+      reply(PLAYER_FB_PLAY_FINISHED, currentTrack);
+      reply(PLAYER_FB_PLAY_FINISHED, currentTrack);
+    }
+  }
+
+private:
+  uint16_t currentTrack;
+
+  void handleFrame(uint8_t command, bool feedback, uint16_t param)
+  {
+    if (simTrace)
+      fprintf(stderr, "%8lu -> %02X %04X\n", simNow, command, param);
+    if (feedback)
+      reply(PLAYER_FB_ACK, 0);
+    if (asleep && command != PLAYER_CMD_OUTPUT_DEVICE && command != PLAYER_CMD_RESET)
+    {
+      reply(PLAYER_FB_ERROR, Sleeping);
+      return;
+    }
+
+    switch (command)
+    {
+    case PLAYER_CMD_PLAY_FOLDER:
+    {
+      uint32_t durationMs = trackDuration(param >> 8, param & 0xFF);
+      if (durationMs == 0)
+      {
+        reply(PLAYER_FB_ERROR, FileMismatch);
+        break;
+      }
+      currentTrack = param & 0xFF;
+      playing = true;
+      paused = false;
+      endsAt = simNow + durationMs;
+      break;
+    }
+    case PLAYER_CMD_PAUSE:
+      if (playing && !paused)
+      {
+        paused = true;
+        remainingMs = endsAt - simNow;
+      }
+      break;
+    case PLAYER_CMD_START:
+      if (playing && paused)
+      {
+        paused = false;
+        endsAt = simNow + remainingMs;
+      }
+      break;
+    case PLAYER_CMD_STOP:
+      playing = false;
+      break;
+    case PLAYER_CMD_SLEEP:
+      playing = false;
+      asleep = true;
+      break;
+    case PLAYER_CMD_OUTPUT_DEVICE:
+      asleep = false;
+      break;
+    case PLAYER_CMD_RESET:
+      playing = false;
+      asleep = false;
+      reply(PLAYER_FB_CARD_ONLINE, DFPLAYER_DEVICE_SD);
+      break;
+    case PLAYER_CMD_QUERY_STATUS:
+      reply(PLAYER_CMD_QUERY_STATUS, (DFPLAYER_DEVICE_SD << 8) | (playing ? (paused ? 2 : 1) : 0));
+      break;
+    case PLAYER_CMD_QUERY_FOLDER_FILES:
+      reply(PLAYER_CMD_QUERY_FOLDER_FILES,
+            param >= 1 && param <= MEDIA_NUM_FOLDERS ? MEDIA_FOLDERS[param - 1].count : 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  static uint32_t trackDuration(uint8_t folder, uint8_t track)
+  {
+    if (folder < 1 || folder > MEDIA_NUM_FOLDERS)
+      return 0;
+    const MediaFolder &entry = MEDIA_FOLDERS[folder - 1];
+    for (uint8_t i = 0; i < entry.count; i++)
+      if (entry.tracks[i].number == track)
+        return entry.tracks[i].durationMs;
+    return 0;
+  }
+};
+
+static NativePlayer nativePlayer;
+
+// A serial device, raw and non-blocking: a module at 9600 baud for
+// --player, or the console for simConsoleFd()
+class NativeTtyPort : public Stream
+{
+public:
+  int fd = -1;
+  NativeFifo rx;
+
+  bool open(const char *path)
+  {
+    return attach(::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK), B9600);
+  }
+
+  bool attach(int tty, speed_t baud)
+  {
+    fd = tty;
+    struct termios settings;
+    if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 || tcgetattr(fd, &settings) != 0)
+      return false;
+    cfmakeraw(&settings);
+    cfsetispeed(&settings, baud);
+    cfsetospeed(&settings, baud);
+    return tcsetattr(fd, TCSANOW, &settings) == 0;
+  }
+
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    ssize_t n = ::write(fd, buffer, size);
+    return n > 0 ? n : 0;
+  }
+
+  int available() override
+  {
+    fill();
+    return rx.count;
+  }
+  int read() override
+  {
+    fill();
+    return rx.pop();
+  }
+  int peek() override
+  {
+    fill();
+    return rx.peek();
+  }
+
+private:
+  void fill()
+  {
+    uint8_t buffer[64];
+    ssize_t n;
+    while (rx.count + sizeof(buffer) <= NATIVE_BUFFER_SIZE && (n = ::read(fd, buffer, sizeof(buffer))) > 0)
+      for (ssize_t i = 0; i < n; i++)
+        rx.push(buffer[i]);
+  }
+};
+
+static NativeTtyPort nativeTty;
+static NativeTtyPort consoleTty;
+
+bool simConsoleFd(int fd)
+{
+  if (!consoleTty.attach(fd, B115200))
+    return false;
+  nativeConsole.tty = &consoleTty;
+  return true;
+}
+
+// PlayerSerial is bound before main() parses --player, so it forwards to
+// whichever module is in use
+class NativePlayerPort : public Stream
+{
+public:
+  Stream *target = &nativePlayer;
+
+  size_t write(uint8_t b) override { return target->write(b); }
+  size_t write(const uint8_t *buffer, size_t size) override { return target->write(buffer, size); }
+  int available() override { return target->available(); }
+  int read() override { return target->read(); }
+  int peek() override { return target->peek(); }
+};
+
+static NativePlayerPort nativePlayerPort;
+Stream &PlayerSerial = nativePlayerPort;
+
+void halBegin()
+{
+}
+
+// setup() has no loop() to move the simulated clock along, so there every
+// reading advances it; blocking waits then time out as they would on the
+// board
+unsigned long halMillis()
+{
+  if (simRealTime)
+    return realMillis();
+  if (simInSetup)
+    return simNow++;
+  return simNow;
+}
+
+// Microseconds (HAL_CYCLES_PER_US is 1). The simulated clock only has
+// millisecond steps, so latencies within one loop() read as zero; they count
+// whole loop passes and scheduler delays.
+uint32_t halCycles()
+{
+  if (simRealTime)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - simStartedAt.tv_sec) * 1000000 + (now.tv_nsec - simStartedAt.tv_nsec) / 1000;
+  }
+  return simNow * 1000;
+}
+
+// The simulated module keeps its power, so it is always online. A module on
+// a tty is brought up as DFRobotDFPlayerMini::begin() does: reset, wait up
+// to 2 s for the card to come online, then let it settle for 200 ms.
+bool halPlayerBegin(bool reset)
+{
+  if (nativePlayerPort.target == &nativePlayer)
+  {
+    if (reset)
+      nativePlayer.reply(PLAYER_FB_CARD_ONLINE, DFPLAYER_DEVICE_SD);
+    return true;
+  }
+  if (!reset)
+    return true;
+
+  uint8_t frame[DFPLAYER_FRAME_LENGTH];
+  dfplayerEncodeFrame(frame, PLAYER_CMD_RESET, /*feedback = */ true, 0);
+  nativeTty.write(frame, DFPLAYER_FRAME_LENGTH);
+  bool online = false;
+  uint8_t length = 0;
+  unsigned long startedAt = halMillis();
+  while (!online && halMillis() - startedAt < 2000)
+  {
+    int b = nativeTty.read();
+    if (b < 0 || (length == 0 && b != DFPLAYER_FRAME_START))
+    {
+      usleep(100);
+      continue;
+    }
+    frame[length++] = b;
+    if (length < DFPLAYER_FRAME_LENGTH)
+      continue;
+    length = 0;
+    online = dfplayerFrameValid(frame) && frame[3] == PLAYER_FB_CARD_ONLINE;
+  }
+  usleep(200000);
+  return online;
+}
+
+// A tty carries no BUSY pin, so with --player this stays false
+bool halPlayerBusy()
+{
+  return nativePlayer.playing && !nativePlayer.paused;
+}
+
+// -- Buttons --
+
+// Presses go through the same edge queue and classifier as on the boards;
+// simPress() and the clock tick stand in for the pin interrupt
+static ButtonInput nativeButtonInput;
+static unsigned long simReleaseAt[HAL_BUTTON_COUNT];
+static bool simHeld[HAL_BUTTON_COUNT];
+
+void halButtonBegin(uint8_t button, HalButtonCallback onPressed, uint32_t longPressMs, HalButtonCallback onLongPressed)
+{
+  nativeButtonInput.begin(button, longPressMs, onPressed, onLongPressed);
+}
+
+static HalButtonEventCallback buttonEventCallback = NULL;
+
+static void forwardButtonEvent(void *context, const ButtonEvent &event)
+{
+  buttonEventCallback(event);
+}
+
+void halButtonOnEvent(HalButtonEventCallback callback)
+{
+  buttonEventCallback = callback;
+  nativeButtonInput.setHandler(callback ? forwardButtonEvent : NULL, NULL);
+}
+
+void halButtonsRead()
+{
+  nativeButtonInput.update(simNow);
+}
+
+// Release edges of timed presses that are due
+static void simButtonEdges()
+{
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+  {
+    if (simHeld[i] && (long)(simNow - simReleaseAt[i]) >= 0)
+    {
+      simHeld[i] = false;
+      nativeButtonInput.edge(i, false, simReleaseAt[i]);
+    }
+  }
+}
+
+#ifdef LATENCY_BENCH
+void halButtonInject(uint8_t button, bool pressed)
+{
+  simHeld[button] = false;
+  nativeButtonInput.edge(button, pressed, simNow);
+}
+
+void halProbe(bool level)
+{
+}
+#endif
+
+void simPress(uint8_t button, unsigned long holdMs)
+{
+  if (button >= HAL_BUTTON_COUNT)
+    return;
+  nativeButtonInput.edge(button, true, simNow);
+  simHeld[button] = true;
+  if (simAsleep && simTrace)
+    fprintf(stderr, "%8lu wake\n", simNow);
+  simAsleep = false;
+  simReleaseAt[button] = simNow + holdMs;
+}
+
+// -- Persistent store --
+
+static uint8_t storeArea[HAL_STORE_SLOT_COUNT][HAL_STORE_SLOT_SIZE];
+static uint8_t settingsJournalArea[Board::settingsRows * Board::settingsRowSize];
+
+void halStoreRead(uint8_t slot, void *data, size_t size)
+{
+  memcpy(data, storeArea[slot], size);
+}
+
+void halStoreWrite(uint8_t slot, const void *data, size_t size)
+{
+  memset(storeArea[slot], 0xFF, HAL_STORE_SLOT_SIZE);
+  memcpy(storeArea[slot], data, size);
+}
+
+void halStoreReadAt(uint8_t slot, size_t offset, void *data, size_t size)
+{
+  memcpy(data, storeArea[slot] + offset, size);
+}
+
+void halStoreWriteAt(uint8_t slot, size_t offset, const void *data, size_t size)
+{
+  memcpy(storeArea[slot] + offset, data, size);
+}
+
+void settingsNvmRead(void *context, uint32_t address, void *data, uint16_t length)
+{
+  memcpy(data, settingsJournalArea + address, length);
+}
+
+// NOR semantics: programming can only clear bits
+void settingsNvmProgram(void *context, uint32_t address, const void *data, uint16_t length)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (uint16_t i = 0; i < length; i++)
+    settingsJournalArea[address + i] &= bytes[i];
+}
+
+void settingsNvmErase(void *context, uint8_t row)
+{
+  memset(settingsJournalArea + (uint32_t)row * Board::settingsRowSize, 0xFF, Board::settingsRowSize);
+}
+
+const JournalFlash halSettingsFlash = {Board::settingsRowSize, Board::settingsPageSize, Board::settingsRows, NULL,
+                                       settingsNvmRead, settingsNvmProgram, settingsNvmErase};
+
+// -- Power --
+
+void halSleep()
+{
+  if (simTrace)
+    fprintf(stderr, "%8lu sleep\n", simNow);
+  simAsleep = true;
+}
+
+// -- Entropy --
+
+// Fixed, so runs are reproducible
+uint32_t halEntropy()
+{
+  return 0x2545F491UL;
+}
+
+static uint32_t randomState = 1;
+
+void randomSeed(unsigned long seed)
+{
+  if (seed != 0)
+    randomState = seed;
+}
+
+// xorshift32
+long random(long howBig)
+{
+  if (howBig <= 0)
+    return 0;
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState % howBig;
+}
+
+long random(long howSmall, long howBig)
+{
+  if (howSmall >= howBig)
+    return howSmall;
+  return random(howBig - howSmall) + howSmall;
+}
+
+// -- Simulation driver --
+
+void simBegin(bool realTime)
+{
+  simRealTime = realTime;
+  clock_gettime(CLOCK_MONOTONIC, &simStartedAt);
+  memset(storeArea, 0xFF, sizeof(storeArea));
+  memset(settingsJournalArea, 0xFF, sizeof(settingsJournalArea));
+
+  simInSetup = true;
+  setup();
+  simInSetup = false;
+}
+
+void simStep()
+{
+  if (!simAsleep && (long)(simNow - simStallUntil) >= 0)
+    loop();
+  simNow = simRealTime ? realMillis() : simNow + 1;
+  simButtonEdges();
+  nativePlayer.tick();
+}
+
+// Unit tests (pio test -e native) link the player logic and bring their own
+// main(), so the driver is left out of them
+#if defined(PIO_UNIT_TESTING) && !defined(HAL_NATIVE_NO_MAIN)
+#define HAL_NATIVE_NO_MAIN
+#endif
+
+#ifndef HAL_NATIVE_NO_MAIN
+
+// Handle one line of stdin; false once the run should end
+static bool simCommand(char *line, unsigned long *waitUntil)
+{
+  if (line[0] != '!')
+  {
+    for (char *c = line; *c; c++)
+      nativeConsole.rx.push(*c);
+    return true;
+  }
+
+  char name[16];
+  unsigned long a = 0, b = 0;
+  int fields = sscanf(line + 1, "%15s %lu %lu", name, &a, &b);
+  if (fields < 1)
+    return true;
+  if (strcmp(name, "quit") == 0)
+    return false;
+  if (strcmp(name, "wait") == 0)
+    *waitUntil = simNow + a;
+  else if (strcmp(name, "press") == 0)
+    simPress(a, NATIVE_PRESS_MS);
+  else if (strcmp(name, "hold") == 0)
+    simPress(a, b);
+  else if (strcmp(name, "stall") == 0)
+    simStallUntil = simNow + a;
+  else
+    fprintf(stderr, "unknown simulation command: %s", line);
+  return true;
+}
+
+static bool stdinReady()
+{
+  struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+  return poll(&input, 1, 0) > 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool fast = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--fast") == 0)
+      fast = true;
+    else if (strcmp(argv[i], "--trace") == 0)
+      simTrace = true;
+    else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc)
+    {
+      if (!nativeTty.open(argv[++i]))
+      {
+        perror(argv[i]);
+        return 1;
+      }
+      nativePlayerPort.target = &nativeTty;
+      fast = false; // a real module cannot be fast-forwarded
+    }
+  }
+  simBegin(/*realTime = */ nativePlayerPort.target == &nativeTty);
+
+  unsigned long waitUntil = simNow;
+  bool inputOpen = true;
+  while (true)
+  {
+    // stdin is read only between waits, so a script's timing is exact
+    if (inputOpen && (long)(simNow - waitUntil) >= 0 && (fast || stdinReady()))
+    {
+      char line[128];
+      if (!fgets(line, sizeof(line), stdin))
+        inputOpen = false;
+      else if (!simCommand(line, &waitUntil))
+        break;
+      continue;
+    }
+    // At the end of the input, finish the last wait and the typed commands
+    if (!inputOpen && (long)(simNow - waitUntil) >= 0 && (nativeConsole.rx.count == 0 || simAsleep))
+      break;
+
+    simStep();
+    if (!fast)
+      usleep(1000);
+  }
+  fflush(stdout);
+  return 0;
+}
+
+#endif
+
+#endif
@@ -1,64 +1,110 @@
-#include "Arduino.h"
-#include "DFRobotDFPlayerMini.h"
-#include "EasyButton.h"
+#include "hal.h"
 #include <ctype.h>
-#include <FlashStorage_SAMD.h>
+#include "media_manifest.h" // generated from media/tf by scripts/generate_media_manifest.py
+#include "control_protocol.h"
+#include "dfplayer_protocol.h"
 
 #define DEFAULT_VOLUME 20 // Default volume if EEPROM is empty
 
-// Device settings stored in flash (FlashStorage_SAMD)
+// Device settings, stored as records in the settings journal. Fields are
+// only ever appended, so an older, shorter record migrates by reading it over
+// a blank struct and letting loadSettings() default the missing fields.
 struct DeviceSettings
 {
   uint8_t volume;
   uint8_t playbackOrderMode; // stores Mode as uint8_t
-  uint8_t reserved;
+  uint8_t version;           // SETTINGS_VERSION; was a reserved 0 in version 1
+  uint8_t continuousMode;    // stores ContinuousModes as uint8_t
+  // Version 2
+  uint8_t lastMode; // stores Mode as uint8_t
+  uint8_t lastFolder; // last content track played (not a UI sound)
+  uint8_t lastTrack;
+  uint8_t bootOptions; // BootOptions flags; a reserved 0 in version 2
+  uint32_t resumePositionMs; // how far into lastTrack playback had got
 };
 
-// Flash storage for the full settings struct
-FlashStorage(settingsFlash, DeviceSettings);
-
-// Board-specific serial port configurations
-#ifdef BOARD_SEEED_XIAO
-// XIAO uses Serial for USB communication and Serial1 for DFPlayer
-#define USBSerial Serial // USB serial for debug output
-#define FPSerial Serial1 // Hardware serial for DFPlayer
-
-#define BUTTON_1_PIN 10
-#define BUTTON_2_PIN 2
-#define BUTTON_3_PIN 3
-
-#elif defined(BOARD_NANO)
-// Nano uses Serial for USB and SoftwareSerial for DFPlayer
-#include <SoftwareSerial.h>
-#define USBSerial Serial  // USB serial for debug output
-SoftwareSerial DFSerial(19, 18); // RX, TX pins for DFPlayer
-#define FPSerial DFSerial // Software serial for DFPlayer
-#define BUTTON_1_PIN 2
-#define BUTTON_2_PIN 3
-#define BUTTON_3_PIN 4
-#else
-// Default configuration (assumes XIAO-like setup)
-#define USBSerial Serial
-#define FPSerial Serial1 // Hardware serial for DFPlayer (same as XIAO)
-#define BUTTON_1_PIN 2
-#define BUTTON_2_PIN 3
-#define BUTTON_3_PIN 4
-#endif
+#define SETTINGS_VERSION 3           // DeviceSettings layout, stored with each record
+#define SETTINGS_SAVE_DELAY 3000      // ms of quiet before changed settings are written
+#define RESUME_POSITION_STEP 1000     // ms; the saved resume position is rounded down to this
+
+#define NUM_FOLDERS MEDIA_NUM_FOLDERS // Folders 01..04 on the SD card
+#define MAX_TRACKS_PER_FOLDER 64  // Track numbers covered by the index
+#define TRACK_INDEX_MAGIC 0x5449  // Marks an initialised TrackIndex in flash
+#define TRACK_INDEX_SAVE_DELAY 5000 // ms of quiet before the index is written
+
+// Index of the track numbers present on the card, one bit per track (bit n-1
+// for track n). The module only reports how many files a folder holds, not
+// their numbers, so every slot starts as a candidate and is cleared when the
+// module answers FileMismatch for it. The per-folder counts identify the card;
+// the index is reset only when they change.
+struct TrackIndex
+{
+  uint16_t magic;
+  uint16_t fileCounts[NUM_FOLDERS];
+  uint32_t present[NUM_FOLDERS][MAX_TRACKS_PER_FOLDER / 32];
+};
+
+#define SHUFFLE_MAGIC 0x5349     // Marks an initialised ShuffleState in flash
+#define SHUFFLE_FOLDERS (NUM_FOLDERS - 1) // Folders 02 on; UI sounds are never shuffled
+#define SHUFFLE_ENTRY_BITS 6     // Enough for track numbers 1..MAX_TRACKS_PER_FOLDER
+#define SHUFFLE_ENTRY_MASK 0x3F
+#define SHUFFLE_SAVE_DELAY 10000 // ms of quiet before the shuffle position is written
+
+// Random-order playback: one Fisher-Yates permutation of each content
+// folder's indexed tracks (at index folder - 2), packed SHUFFLE_ENTRY_BITS
+// per entry (track number - 1).
+// Every track plays once before the folder is reshuffled, and the position
+// is kept in flash so a restart carries on through the same permutation.
+struct ShuffleState
+{
+  uint16_t magic;
+  uint8_t length[SHUFFLE_FOLDERS];   // entries in the permutation
+  uint8_t position[SHUFFLE_FOLDERS]; // next entry to play
+  uint8_t order[SHUFFLE_FOLDERS][(MAX_TRACKS_PER_FOLDER * SHUFFLE_ENTRY_BITS + 7) / 8];
+};
+
+#define PLAYLIST_MAGIC 0x504C      // Marks an initialised PlaylistStore in flash
+#define PLAYLIST_COUNT 4
+#define PLAYLIST_MAX_ENTRIES 48
+#define FAVORITE_COUNT 3            // one per physical button
+#define PLAYLIST_NO_ENTRY 0x00      // folder 01 (UI) is never an entry
+#define PLAYLIST_BEFORE_START 0xFF  // playlistPosition before the first entry
+#define PLAYLIST_SAVE_DELAY 3000    // ms of quiet before an edited header is written
+
+// A (folder, track) pair packed into a byte: folder - 1 in the top two bits,
+// track - 1 in the low six
+#define PLAYLIST_ENTRY(folder, track) ((uint8_t)((((folder) - 1) << 6) | ((track) - 1)))
+#define PLAYLIST_ENTRY_FOLDER(entry) (((entry) >> 6) + 1)
+#define PLAYLIST_ENTRY_TRACK(entry) (((entry) & 0x3F) + 1)
+
+// User playlists and the favorite buttons, edited over serial or by a long
+// press. Only the header is kept in RAM; entries are read from the store one
+// at a time as they are played, so stepping through a list is O(1) and no
+// list is ever copied into RAM.
+struct PlaylistHeader
+{
+  uint16_t magic;
+  uint8_t length[PLAYLIST_COUNT];     // entries in each playlist
+  uint8_t favorites[FAVORITE_COUNT];  // packed entries, PLAYLIST_NO_ENTRY for the default
+};
 
-// Simple track mapping structure
-struct TrackMapping
+struct PlaylistStore
 {
-  const char *name; // For named sounds (NULL for indexed tracks)
-  uint8_t track;    // Track number to play
+  PlaylistHeader header;
+  uint8_t entries[PLAYLIST_COUNT][PLAYLIST_MAX_ENTRIES];
 };
 
-// Maximum number of tracks in each folder
-#define NUM_UI_FILES 13     // Number of files in UI folder (01)
-#define NUM_VOICE_FILES 1   // Number of files in Voice folder (02)
-#define NUM_MUSIC_FILES 32  // Number of files in Music folder (03)
-#define NUM_CANDIDS_FILES 1 // Number of files in Candids folder (04)
+#define PLAYLIST_ENTRY_OFFSET(list, position) \
+  (offsetof(PlaylistStore, entries) + (list) * PLAYLIST_MAX_ENTRIES + (position))
+
+static_assert(sizeof(TrackIndex) <= HAL_STORE_SLOT_SIZE, "TrackIndex must fit a store slot");
+static_assert(sizeof(ShuffleState) <= HAL_STORE_SLOT_SIZE, "ShuffleState must fit a store slot");
+static_assert(sizeof(PlaylistStore) <= HAL_STORE_SLOT_SIZE, "PlaylistStore must fit a store slot");
+static_assert(NUM_FOLDERS <= 4 && MAX_TRACKS_PER_FOLDER <= 64, "a playlist entry must pack into a byte");
+static_assert(sizeof(DeviceSettings) <= JOURNAL_MAX_RECORD, "DeviceSettings must fit a journal record");
 
 #define BAUDRATE 115200
+#define BUTTON_LONG_PRESS_MS 1000
 
 enum Buttons
 {
@@ -81,31 +127,33 @@ enum PlaybackOrderModes
   PLAYBACK_ORDER_MODE_RANDOM
 };
 
-// Sound effects array (UI sounds, named tracks)
-const TrackMapping SOUNDS[NUM_UI_FILES] = {
-    // UI Sounds
-    {"startup", 1},
-    {"tone1", 2},
-    {"tone2", 3},
-    // Mode Change Voice Indicator
-    {"music_mode", 4},
-    {"voice_mode", 5},
-    {"candids_mode", 6},
-    {"settings_mode", 7},
-    {"tone3", 8}, // Placeholder for future use
-    {"favorites_mode", 9},
-    {"settings_volume_mode", 10},
-    {"settings_playback_order_mode", 11},
-    {"sequential_playback", 12},
-    {"random_playback", 13}};
+// What happens when a browsed track finishes
+enum ContinuousModes
+{
+  CONTINUOUS_OFF,         // stop after each track
+  CONTINUOUS_FOLDER,      // play on until the end of the folder
+  CONTINUOUS_REPEAT_ONE,  // repeat the same track
+  CONTINUOUS_REPEAT_ALL   // play on, wrapping around the folder
+};
+
+// Playing through to the end of the folder and stopping lets the player go
+// idle (and to sleep) on its own; repeat-all never ends
+#define DEFAULT_CONTINUOUS_MODE CONTINUOUS_FOLDER
 
+// Named UI sounds are the UISound constants from the media manifest. Each
+// value is the sound's track number in the UI folder, so a name resolves at
+// compile time and an unknown name does not build.
+
+// What each mode plays, announces and binds to the buttons is in MODES
 enum Mode
 {
   MODE_FAVORITES,
   MODE_VOICE,
   MODE_MUSIC,
   MODE_CANDIDS,
-  MODE_SETTINGS
+  MODE_PLAYLISTS, // after the folder modes, so stored lastMode values keep their meaning
+  MODE_SETTINGS,
+  MODE_COUNT
 };
 
 Mode currentMode = MODE_FAVORITES;
@@ -123,39 +171,415 @@ SettingsOption currentSetting = SET_VOLUME;
 Mode settingsPlaybackMode = MODE_FAVORITES; // temporary selection while in settings
 
 int lastPlayedTrack = 0; // last DFPlayer.play() track number
-bool isPlaying = false;
+uint8_t lastPlayedFolder = 0;
+// Playback state, updated from commands we send and from the module's
+// play-finished/error/card events (and the BUSY pin when wired)
+enum PlaybackState
+{
+  PLAYBACK_STOPPED,
+  PLAYBACK_PLAYING,
+  PLAYBACK_PAUSED
+};
+
+PlaybackState playbackState = PLAYBACK_STOPPED;
+unsigned long playbackStartedAt = 0;   // halMillis() when the current track was started
+uint32_t playbackDurationMs = 0;       // expected length from the manifest, 0 if unknown
+unsigned long playbackPausedAt = 0;
+int currentContinuousMode = DEFAULT_CONTINUOUS_MODE;
+
+// Track to start the moment the current one finishes, worked out when the
+// current one starts (0 when playback should stop)
+uint8_t preparedFolder = 0;
+uint8_t preparedTrack = 0;
+Mode preparedMode = MODE_FAVORITES; // mode the prepared track belongs to
+
+// Silence between tracks during continuous playback: from the end of one
+// track being detected to the next play frame going out
+unsigned long trackEndedAt = 0;
+bool trackGapPending = false;
+unsigned long lastTrackGapMs = 0;
+unsigned long maxTrackGapMs = 0;
 int currentPlaybackOrderMode = PLAYBACK_ORDER_MODE_SEQUENTIAL;
 int currentVolume = DEFAULT_VOLUME;
 
+// The module's volume is the user's setting moved by the playing track's
+// loudness offset from the media manifest, so tracks mastered at different
+// levels come out alike without the user reaching for the volume
+#define PLAYER_VOLUME_UNKNOWN 0xFF
+int8_t playbackGainSteps = 0;                // offset of the track playing
+uint8_t playerVolume = PLAYER_VOLUME_UNKNOWN; // volume last queued to the module
+
+// Last content track, for resuming after a restart
+uint8_t resumeFolder = 0;
+uint8_t resumeTrack = 0;
+// Position stored with it. Only a pause or sleep takes a new one, so other
+// saves while a track plays do not differ by the position alone.
+uint32_t resumePositionMs = 0;
+
+enum BootOptions
+{
+  BOOT_SKIP_JINGLE = 0x01 // resume straight away instead of after the startup sound
+};
+
+uint8_t bootOptions = 0;
+
+// Timestamps (millis) of the boot phases, for tracking time to first audio
+enum BootPhase
+{
+  BOOT_PLAYER_READY,    // module answered the probe, or finished its reset
+  BOOT_SETTINGS_LOADED,
+  BOOT_SETUP_DONE,
+  BOOT_FIRST_AUDIO,     // first play command sent to the module
+  BOOT_PHASE_COUNT
+};
+
+const char BOOT_PHASE_NAMES[][9] PROGMEM = {"player", "settings", "setup", "audio"};
+
+unsigned long bootPhaseAt[BOOT_PHASE_COUNT];
+bool bootWasFast = false; // module reset skipped
+
+// Idle sleep: once nothing has played, been queued, held or typed for
+// idleSleepMs the module is put to sleep, then the MCU until a button wakes
+// it. 0 turns it off. Bench builds press the buttons from software, which
+// cannot wake the board, so it is off there.
+#ifndef IDLE_SLEEP_MS
+#ifdef LATENCY_BENCH
+#define IDLE_SLEEP_MS 0
+#else
+#define IDLE_SLEEP_MS 120000UL
+#endif
+#endif
+
+// DFPlayer supply current when idle and asleep, for the idle budget. Rough
+// figures; measure the units in use and override with -D.
+#ifndef DFPLAYER_IDLE_MICROAMPS
+#define DFPLAYER_IDLE_MICROAMPS 20000UL
+#endif
+#ifndef DFPLAYER_SLEEP_MICROAMPS
+#define DFPLAYER_SLEEP_MICROAMPS 1000UL
+#endif
+
+enum IdleState
+{
+  IDLE_AWAKE,
+  IDLE_PLAYER_SLEEPING // sleep command queued, waiting for it to go out
+};
+
+unsigned long idleSleepMs = IDLE_SLEEP_MS;
+IdleState idleState = IDLE_AWAKE;
+unsigned long idleSince = 0; // last time anything was going on
+uint16_t idleSleeps = 0;
+
+// Wake to audio: from the press that woke the board going down to the
+// first play frame written after it
+bool wakePressPending = false; // asleep until the next press
+bool wakeAudioPending = false; // waking press seen, no play frame yet
+unsigned long wakePressAt = 0;
+unsigned long lastWakeLatencyMs = 0;
+unsigned long maxWakeLatencyMs = 0;
+unsigned long totalWakeLatencyMs = 0;
+uint16_t wakeLatencyCount = 0;
+
+#ifdef LATENCY_BENCH
+// Button-to-audio latency benchmark (build with -D LATENCY_BENCH). Each
+// scenario puts the player in a known mode, presses a button through
+// halButtonInject() and times from the edge that triggers the handler (the
+// release of a short press, the hold threshold of a long one) to the next
+// DFPlayer frame written. `bench [n]` runs every scenario n times and prints
+// one CSV row per scenario.
+#define BENCH_MAX_SAMPLES Board::benchSamples
+#define BENCH_DEFAULT_SAMPLES 20
+#define BENCH_SETTLE_MS 300    // quiet time before each press, for the command queue to drain
+#define BENCH_TIMEOUT_MS 2000  // no frame by then counts as a miss
+#define BENCH_SHORT_PRESS_MS 80
+#define BENCH_LONG_PRESS_MS (BUTTON_LONG_PRESS_MS + 100)
+#ifndef BENCH_BUILD_ID
+#define BENCH_BUILD_ID dev // e.g. the commit, -D BENCH_BUILD_ID=$(git rev-parse --short HEAD)
+#endif
+#define BENCH_STRING(x) BENCH_STRING_(x)
+#define BENCH_STRING_(x) #x
+
+struct BenchScenario
+{
+  char name[28];
+  uint8_t mode;
+  uint8_t button;
+  uint16_t holdMs;
+};
+
+// Named after the per-button handlers the gesture tables replaced, so runs
+// stay comparable across builds
+const BenchScenario BENCH_SCENARIOS[] PROGMEM = {
+    {"button1Pressed/favorites", MODE_FAVORITES, TopRight, BENCH_SHORT_PRESS_MS},
+    {"button2Pressed/favorites", MODE_FAVORITES, BottomRight, BENCH_SHORT_PRESS_MS},
+    {"button3Pressed/favorites", MODE_FAVORITES, BottomLeft, BENCH_SHORT_PRESS_MS},
+    {"button1Pressed/music", MODE_MUSIC, TopRight, BENCH_SHORT_PRESS_MS},
+    {"button2Pressed/music", MODE_MUSIC, BottomRight, BENCH_SHORT_PRESS_MS},
+    {"button3Pressed/music", MODE_MUSIC, BottomLeft, BENCH_SHORT_PRESS_MS},
+    {"button1longPressed/music", MODE_MUSIC, TopRight, BENCH_LONG_PRESS_MS},
+    {"button3longPressed/music", MODE_MUSIC, BottomLeft, BENCH_LONG_PRESS_MS}, // enterSettingsMode
+    {"button1Pressed/settings", MODE_SETTINGS, TopRight, BENCH_SHORT_PRESS_MS},
+    {"button3Pressed/settings", MODE_SETTINGS, BottomLeft, BENCH_SHORT_PRESS_MS},
+    {"button3longPressed/settings", MODE_SETTINGS, BottomLeft, BENCH_LONG_PRESS_MS}}; // exitSettingsMode
+
+#define BENCH_SCENARIO_COUNT (sizeof(BENCH_SCENARIOS) / sizeof(BENCH_SCENARIOS[0]))
+#define BENCH_IDLE 0xFF
+
+uint8_t benchScenario = BENCH_IDLE;
+uint8_t benchSamplesWanted = 0;
+uint8_t benchSampleCount = 0; // samples recorded in this scenario
+uint8_t benchMisses = 0;
+uint32_t benchLatencyUs[BENCH_MAX_SAMPLES];
+uint32_t benchStartCycles = 0; // when the handler was triggered
+bool benchArmed = false;       // waiting for the first frame after benchStartCycles
+bool benchReleased = false;
+int benchTimeoutTask = -1;
+// Player state put back after the run
+Mode benchSavedMode = MODE_FAVORITES;
+int benchSavedVolume = 0;
+#endif
+
+#ifdef LOOP_PROFILER
+// Loop profiler (build with -D LOOP_PROFILER). Scoped timers around the hot
+// paths feed fixed-size log2 histograms, read and reset with the `stats`
+// command. A sample costs two halCycles() reads and a few adds.
+enum ProfileProbe
+{
+  PROFILE_LOOP,    // loop() start to the next start: rate, jitter and stalls
+  PROFILE_BUTTONS,
+  PROFILE_PLAYER,  // command queue and received frames
+  PROFILE_SERIAL,  // console and control frame parsing
+  PROFILE_FLASH,   // settings, track index and shuffle writes
+  PROFILE_PROBE_COUNT
+};
+
+#define PROFILE_BUCKETS 16 // bucket i counts [2^i, 2^(i+1)) us, the last one everything longer
+
+const char PROFILE_PROBE_NAMES[][8] PROGMEM = {"loop", "buttons", "player", "serial", "flash"};
+
+struct ProfileStats
+{
+  uint32_t count; // stops at UINT32_MAX
+  uint64_t totalUs;
+  uint32_t maxUs;
+  uint32_t buckets[PROFILE_BUCKETS];
+};
+
+ProfileStats profileStats[PROFILE_PROBE_COUNT];
+uint32_t profileLoopStartedAt = 0;
+bool profileLoopStarted = false; // false until the first loop() after a reset
+
+void profileRecord(uint8_t probe, uint32_t cycles);
+
+// Times the enclosing block
+class ProfileScope
+{
+public:
+  explicit ProfileScope(uint8_t probe) : probe_(probe), startedAt_(halCycles()) {}
+  ~ProfileScope() { profileRecord(probe_, halCycles() - startedAt_); }
+
+private:
+  uint8_t probe_;
+  uint32_t startedAt_;
+};
+
+#define PROFILE_SCOPE(probe) ProfileScope profileScope(probe)
+#else
+#define PROFILE_SCOPE(probe)
+#endif
+
+// Settings changed since the last write; they are written together once
+// things have been quiet for SETTINGS_SAVE_DELAY
+enum SettingsDirtyFlags
+{
+  SETTINGS_DIRTY_VOLUME = 0x01,
+  SETTINGS_DIRTY_ORDER = 0x02,
+  SETTINGS_DIRTY_CONTINUOUS = 0x04,
+  SETTINGS_DIRTY_MODE = 0x08,
+  SETTINGS_DIRTY_TRACK = 0x10,
+  SETTINGS_DIRTY_BOOT = 0x20,
+  SETTINGS_DIRTY_POSITION = 0x40 // take a new resume position (pause, sleep)
+};
+
+uint8_t settingsDirty = 0;
+int settingsSaveTask = -1;
+uint8_t currentEq = DFPLAYER_EQ_NORMAL;
+
 // Favorites mapping: one clip per physical button when in MODE_FAVORITES.
-// Assumption: map to the first three tracks in the Music folder by default.
+// A button with nothing assigned (PlaylistHeader::favorites) plays one of the
+// first three tracks in the Music folder (taken from the media manifest,
+// since the folder does not start at 001).
 struct FavoriteMapping
 {
   uint8_t folder;
   uint8_t track;
 };
 
-const FavoriteMapping FAVORITES[3] = {
-    {Music, 1},
-    {Music, 2},
-    {Music, 3}};
+const FavoriteMapping DEFAULT_FAVORITES[FAVORITE_COUNT] = {
+    {Music, MEDIA_FOLDER_03_TRACKS[0].number},
+    {Music, MEDIA_FOLDER_03_TRACKS[1].number},
+    {Music, MEDIA_FOLDER_03_TRACKS[2].number}};
+
+// Cooperative scheduler: deferred actions and timers serviced from loop()
+// instead of blocking in delay(). Time comes from schedulerClock so the
+// scheduler can be driven by a fake halMillis() on a host build.
+#define MAX_SCHEDULED_TASKS Board::scheduledTasks
+
+typedef void (*TaskCallback)();
+
+struct ScheduledTask
+{
+  TaskCallback callback;    // NULL when the slot is free
+  unsigned long startedAt;  // clock value when the task was (re)armed
+  unsigned long delayMs;    // time until the next run
+  unsigned long intervalMs; // 0 for one-shot tasks
+};
+
+ScheduledTask scheduledTasks[MAX_SCHEDULED_TASKS];
+unsigned long (*schedulerClock)() = halMillis;
+
+// Button input is matched against the current mode's gesture table (MODES)
+// instead of per-button handlers. Every gesture is decided from the events
+// of halButtonOnEvent() the moment it is complete, without waiting to see
+// whether more is coming: a click runs on its release even if it turns out
+// to be the first of a double click, so multi-click bindings are chosen to
+// supersede what the single click started. A later click of a sequence with
+// no multi-click binding on its button runs as another single click, so
+// quick taps (volume steps, say) are never lost.
+enum Gesture
+{
+  GESTURE_CLICK,        // released before the long-press time
+  GESTURE_DOUBLE_CLICK, // second click within BUTTON_MULTI_CLICK_MS
+  GESTURE_TRIPLE_CLICK,
+  GESTURE_LONG_PRESS,   // held for BUTTON_LONG_PRESS_MS
+  GESTURE_HOLD_REPEAT,  // held: repeats every GESTURE_REPEAT_MS after GESTURE_REPEAT_DELAY_MS
+  GESTURE_CHORD         // second button pressed while the first is held
+};
+
+#ifndef GESTURE_REPEAT_DELAY_MS
+#define GESTURE_REPEAT_DELAY_MS 400 // hold before the first repeat
+#endif
+#ifndef GESTURE_REPEAT_MS
+#define GESTURE_REPEAT_MS 150 // between repeats, about 7 volume steps a second
+#endif
+
+#define GESTURE_BUTTON(b) (1 << (b))
+
+struct GestureBinding
+{
+  uint8_t gesture;
+  uint8_t buttons; // GESTURE_BUTTON() bits; two for a chord
+  TaskCallback action;
+};
+
+uint8_t gestureHeld = 0;     // GESTURE_BUTTON() bits of the buttons down
+uint8_t gestureConsumed = 0; // presses already used by a chord or hold-repeat; no click or long press follows
+unsigned long gestureDownAt[HAL_BUTTON_COUNT];
+uint16_t gestureRepeats[HAL_BUTTON_COUNT]; // repeats run in the current hold
+
+// DFPlayer command queue. Commands are framed and written by us rather than
+// through the library's blocking calls: one frame is in flight at a time and
+// its ACK is matched asynchronously while loop() keeps running.
+#define PLAYER_QUEUE_SIZE Board::playerQueueSize
+#define PLAYER_ACK_TIMEOUT 200   // ms to wait for an ACK before moving on
+#define PLAYER_PROBE_TIMEOUT 300 // ms to wait at boot for an already-running module
+
+// The module reports play-finished twice; a repeat of the same file index
+// within this window is ignored
+#define PLAY_FINISHED_DEDUP_WINDOW 1000
+
+// Optional BUSY pin (low while audio plays), e.g. -D DFPLAYER_BUSY_PIN=1
+#define BUSY_IDLE_DEBOUNCE 50 // ms BUSY must stay high to count as finished
+#define BUSY_START_GRACE 300  // ms after a play before BUSY is trusted
+
+// A track still "playing" this long after its manifest duration is treated
+// as finished, in case the module's play-finished frame was lost
+#define EXPECTED_END_GRACE 500
+
+struct PlayerCommand
+{
+  uint8_t command;
+  uint16_t param;
+};
+
+PlayerCommand playerQueue[PLAYER_QUEUE_SIZE];
+uint8_t playerQueueHead = 0;  // index of the oldest queued command
+uint8_t playerQueueCount = 0;
+bool playerAwaitingAck = false;
+PlayerCommand playerInFlight;
+unsigned long playerSentAt = 0;
+uint8_t playerRxFrame[DFPLAYER_FRAME_LENGTH];
+uint8_t playerRxIndex = 0;
+uint8_t lastSentFolder = 0; // last PLAY_FOLDER sent, for matching errors
+uint8_t lastSentTrack = 0;
+uint16_t lastFinishedFile = 0;
+unsigned long lastFinishedAt = 0;
+#ifdef DFPLAYER_BUSY_PIN
+bool busyPinIdle = true;
+unsigned long busyPinIdleSince = 0;
+#endif
+
+TrackIndex trackIndex;
+uint16_t scannedFileCounts[NUM_FOLDERS];
+uint8_t pendingFolderScans = 0;
+int trackIndexSaveTask = -1;
+
+ShuffleState shuffle;
+int shuffleSaveTask = -1;
+
+PlaylistHeader playlists;
+uint8_t currentPlaylist = 0;
+uint8_t playlistPosition = PLAYLIST_BEFORE_START; // entry playing in currentPlaylist
+uint8_t preparedPlaylistPosition = 0;
+bool playlistsDirty = false; // header edited since it was last written
+int playlistSaveTask = -1;
+
+SettingsJournal settingsJournal(halSettingsFlash);
+
+// Last browse (next/previous/random) request. If the module reports the
+// chosen track missing, the same action is repeated to pick the next one.
+TaskCallback browseAction = NULL;
+uint8_t browseFolder = 0;
+uint8_t browseTrack = 0;
+
+// Serial command line (or binary control frame payload) being received
+#define SERIAL_LINE_LENGTH CONTROL_MAX_PAYLOAD
+char serialLine[SERIAL_LINE_LENGTH];
+uint8_t serialLineLength = 0;
+bool serialLineOverflow = false; // current line too long, discard it
 
-DFRobotDFPlayerMini DFPlayer;
+enum SerialParseState
+{
+  SERIAL_TEXT,
+  SERIAL_FRAME_LENGTH,
+  SERIAL_FRAME_PAYLOAD,
+  SERIAL_FRAME_CRC_HIGH,
+  SERIAL_FRAME_CRC_LOW
+};
 
-EasyButton button1(BUTTON_1_PIN);
-EasyButton button2(BUTTON_2_PIN);
-EasyButton button3(BUTTON_3_PIN);
+SerialParseState serialParseState = SERIAL_TEXT;
+uint8_t serialFrameLength = 0;
+uint16_t serialFrameCrc = 0;
+unsigned long serialLastByteAt = 0;
+
+// Pending voice prompt (e.g. the second half of a two-part announcement).
+// Any new user input supersedes it.
+TaskCallback pendingPrompt = NULL;
+int pendingPromptTask = -1;
 
 void printDetail(uint8_t type, int value);
 void handleSerialCommands();
-int findSoundTrack(const char *name);
-int getTrackFromArray(const TrackMapping *array, int maxSize, int index);
-void playFolderTrack(uint8_t folder, uint8_t track);
-void playUISound(const char *name);
-void playRandomFromFolder(uint8_t folder, uint8_t maxTracks);
+bool playFolderTrack(uint8_t folder, uint8_t track);
+void playUISound(UISound sound);
+void playRandomFromFolder(uint8_t folder);
+void playBrowsedTrack(TaskCallback action, uint8_t folder, uint8_t track);
+void playUnbrowsedTrack();
+bool playUnknownTrack(uint8_t command, uint16_t param);
 void enterSettingsMode();
 void exitSettingsMode();
 void playRandomTrack();
+void playNextTrack();
+void playPreviousTrack();
 void changePlaybackMode();
 void replayLastTrack();
 void playFavorite(int idx);
@@ -163,136 +587,246 @@ void togglePlayPause();
 void toggleSettingsMode();
 void increaseVolume();
 void decreaseVolume();
-void button1ISR();
-void button1Pressed();
-void button1longPressed();
-void button2ISR();
-void button2Pressed();
-void button3ISR();
-void button3Pressed();
-void button3longPressed();
-void saveVolumeToEEPROM(uint8_t volume);
-void savePlaybackOrderModeToEEPROM(uint8_t playbackOrderMode);
+uint8_t modeFolder(Mode mode);
+void onButtonEvent(const ButtonEvent &event);
+void serviceGestures();
+void playFirstFavorite();
+void playSecondFavorite();
+void playThirdFavorite();
+void browseForward();
+void browseBack();
+void playFirstTrack();
+void togglePlaybackOrder();
+void settingUp();
+void settingDown();
+void repeatVolumeUp();
+void repeatVolumeDown();
+void nextSetting();
+int scheduleOnce(unsigned long delayMs, TaskCallback callback);
+int scheduleEvery(unsigned long intervalMs, TaskCallback callback);
+void cancelTask(int id);
+void runScheduler();
+void queuePrompt(unsigned long delayMs, TaskCallback prompt);
+void cancelPrompt();
+void runPendingPrompt();
+void announceCurrentMode();
+bool probePlayer();
+void resumeLastTrack();
+void markBootPhase(uint8_t phase);
+bool tasksPending();
+void noteActivity();
+void serviceIdle();
+void sleepUntilPressed();
+#ifdef LATENCY_BENCH
+void benchNextSample();
+void benchPress();
+void benchRelease();
+void benchTimedOut();
+void benchFrameSent();
+void benchReport();
+#endif
+#ifdef LOOP_PROFILER
+void profileLoopStart();
+void profileReset();
+#endif
+bool queuePlayerCommand(uint8_t command, uint16_t param);
+void servicePlayerQueue();
+void pumpPlayerSerial();
+void handlePlayerFrame(uint8_t command, uint16_t param);
+void onTrackFinished();
+void pollBusyPin();
+void prepareNextTrack();
+void checkExpectedTrackEnd();
+void pausePlayback();
+void resumePlayback();
+void loadTrackIndex();
+void saveTrackIndex();
+void scanTrackIndex();
+void onFolderFileCount(uint8_t folder, uint16_t count);
+void removeIndexedTrack(uint8_t folder, uint8_t track);
+uint8_t nextIndexedTrack(uint8_t folder, uint8_t after);
+uint8_t previousIndexedTrack(uint8_t folder, uint8_t before);
+void loadShuffle();
+void saveShuffle();
+void loadPlaylists();
+void markPlaylistsDirty();
+void flushPlaylists();
+uint8_t playlistEntry(uint8_t list, uint8_t position);
+bool addPlaylistEntry(uint8_t list, uint8_t folder, uint8_t track);
+bool removePlaylistEntry(uint8_t list, uint8_t position);
+bool clearPlaylist(uint8_t list);
+bool setFavorite(uint8_t slot, uint8_t folder, uint8_t track);
+void favoriteCurrentTrack();
+void playPlaylistEntry(uint8_t position);
+void playlistForward();
+void playlistBack();
+void playlistStart();
+void nextPlaylist();
+void skipPlaylistEntry();
+void preparePlaylistEntry();
+uint8_t peekShuffledTrack(uint8_t folder);
+uint8_t takeShuffledTrack(uint8_t folder);
+const MediaTrack *findMediaTrack(uint8_t folder, uint8_t track);
+uint32_t mediaTrackDurationMs(uint8_t folder, uint8_t track);
+int8_t mediaTrackGainSteps(uint8_t folder, uint8_t track);
+bool queueVolume();
+void announceVolumeSetting();
+void markSettingsDirty(uint8_t fields);
+void flushSettings();
 void saveSettings();
 DeviceSettings loadSettings();
 
 void setup()
 {
-  // Initialize USB serial for debugging
-  // USBSerial.begin(USB_SERIAL_BAUD);
-  // USBSerial.println(F("Initializing..."));
-
-  FPSerial.begin(FP_SERIAL_BAUD); // Hardware serial for DFPlayer
-
-  // USBSerial.println(F("Serial ports initialized"));
-  // Serial.println(F("DFRobot DFPlayer Mini Demo"));
-  // Serial.println(F("Initializing DFPlayer ... (May take 3~5 seconds)"));
-
-  if (!DFPlayer.begin(FPSerial, /*isACK = */ true, /*doReset = */ true))
+  // Initialize USB serial for debugging and the DFPlayer port
+  halBegin();
+  // Console.println(F("Initializing..."));
+
+  // Console.println(F("Serial ports initialized"));
+  // Console.println(F("DFRobot DFPlayer Mini Demo"));
+  // Console.println(F("Initializing DFPlayer ... (May take 3~5 seconds)"));
+
+  // Runtime commands go through the non-blocking command queue; the HAL only
+  // brings the module online. A module that kept its power across an MCU
+  // reset answers the probe and needs no reset.
+  bootWasFast = probePlayer();
+  if (!halPlayerBegin(/*reset = */ !bootWasFast))
   { // Use serial to communicate with mp3.
-    // USBSerial.println(F("Unable to begin:"));
+    // Console.println(F("Unable to begin:"));
     while (true)
       ;
   }
-  // USBSerial.println(F("DFPlayer Mini online."));
+  markBootPhase(BOOT_PLAYER_READY);
+  // Console.println(F("DFPlayer Mini online."));
 
-  DFPlayer.setTimeOut(1000); // Set serial communictaion time out 500ms
+  // The module reset above takes a variable time, which adds to the jitter
+  randomSeed(halEntropy());
 
   //----Set volume from EEPROM----
   DeviceSettings storedSettings = loadSettings();
 
   currentVolume = storedSettings.volume;
   currentPlaybackOrderMode = storedSettings.playbackOrderMode;
+  currentContinuousMode = storedSettings.continuousMode;
+  currentMode = (Mode)storedSettings.lastMode;
+  resumeFolder = storedSettings.lastFolder;
+  resumeTrack = storedSettings.lastTrack;
+  resumePositionMs = storedSettings.resumePositionMs;
+  bootOptions = storedSettings.bootOptions;
+  loadTrackIndex();
+  loadShuffle();
+  loadPlaylists();
+  markBootPhase(BOOT_SETTINGS_LOADED);
+
+  queueVolume(); // Set volume value (0~30)
+
+  queuePlayerCommand(PLAYER_CMD_EQ, currentEq);
+
+  queuePlayerCommand(PLAYER_CMD_OUTPUT_DEVICE, DFPLAYER_DEVICE_SD);
+
+  // Initialize the buttons; what they do comes from the gesture tables
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+    halButtonBegin(i, NULL, BUTTON_LONG_PRESS_MS, NULL);
+  halButtonOnEvent(onButtonEvent);
+
+  // Play startup sound from UI folder, then carry on with the last track (or
+  // announce the restored mode if there is none) once it has finished
+  TaskCallback afterStartup = resumeTrack > 0 ? resumeLastTrack : announceCurrentMode;
+  if (bootOptions & BOOT_SKIP_JINGLE)
+  {
+    afterStartup();
+  }
+  else
+  {
+    playUISound(UI_SOUND_STARTUP);
+    queuePrompt(5000, afterStartup);
+  }
 
-  DFPlayer.volume(currentVolume); // Set volume value (0~30)
-
-  DFPlayer.EQ(DFPLAYER_EQ_NORMAL);
-
-  DFPlayer.outputDevice(DFPLAYER_DEVICE_SD);
-
-  // Initialize the buttons
-  button1.begin();
-  button1.onPressed(button1Pressed);
-  button1.onPressedFor(1000, button1longPressed);
-  // button1.onSequence(2, 500, playRandomTrack); // Double click with 500ms timeout
-
-  button2.begin();
-  button2.onPressed(button2Pressed);
-  // button2.onPressedFor(1000, playRandomTrack);
-  // button2.onSequence(2, 500, replayLastTrack); // Double click with 500ms timeout
-
-  button3.begin();
-  button3.onPressed(button3Pressed);
-  button3.onPressedFor(1000, button3longPressed);
-
-  // Play startup sound from UI folder
-  playUISound("startup");
-  delay(5000);
-  playUISound("favorites_mode");
-  delay(100);
+  // Check the cached track index against the card that is inserted
+  scanTrackIndex();
+  markBootPhase(BOOT_SETUP_DONE);
 }
 
 void loop()
 {
-  button1.read();
-  button2.read();
-  button3.read();
+#ifdef LOOP_PROFILER
+  profileLoopStart();
+#endif
+  runScheduler();
+  servicePlayerQueue();
+  pollBusyPin();
+  checkExpectedTrackEnd();
+  handleSerialCommands();
+  {
+    PROFILE_SCOPE(PROFILE_BUTTONS);
+    halButtonsRead();
+    serviceGestures();
+  }
+  serviceIdle();
 }
 
+// Module events as text lines, with -D LOG_PLAYER_EVENTS for a serial
+// monitor. Off otherwise: the console also carries the binary control
+// protocol, and unsolicited text would land among its reply frames.
 void printDetail(uint8_t type, int value)
 {
+#ifndef LOG_PLAYER_EVENTS
+  (void)type;
+  (void)value;
+#else
   switch (type)
   {
   case TimeOut:
-    // Serial.println(F("Time Out!"));
+    // Console.println(F("Time Out!"));
     break;
   case WrongStack:
-    // Serial.println(F("Stack Wrong!"));
+    // Console.println(F("Stack Wrong!"));
     break;
   case DFPlayerCardInserted:
-    // Serial.println(F("Card Inserted!"));
+    // Console.println(F("Card Inserted!"));
     break;
   case DFPlayerCardRemoved:
-    // Serial.println(F("Card Removed!"));
+    // Console.println(F("Card Removed!"));
     break;
   case DFPlayerCardOnline:
-    // Serial.println(F("Card Online!"));
+    // Console.println(F("Card Online!"));
     break;
   case DFPlayerUSBInserted:
-    // Serial.println("USB Inserted!");
+    // Console.println("USB Inserted!");
     break;
   case DFPlayerUSBRemoved:
-    // Serial.println("USB Removed!");
+    // Console.println("USB Removed!");
     break;
   case DFPlayerPlayFinished:
-    Serial.print(F("Number:"));
-    Serial.print(value);
-    // Serial.println(F(" Play Finished!"));
+    Console.print(F("Number:"));
+    Console.println(value);
+    // Console.println(F(" Play Finished!"));
     break;
   case DFPlayerError:
-    Serial.print(F("DFPlayerError:"));
+    Console.print(F("DFPlayerError:"));
+    Console.println(value);
     switch (value)
     {
     case Busy:
-      // Serial.println(F("Card not found"));
+      // Console.println(F("Card not found"));
       break;
     case Sleeping:
-      // Serial.println(F("Sleeping"));
+      // Console.println(F("Sleeping"));
       break;
     case SerialWrongStack:
-      // Serial.println(F("Get Wrong Stack"));
+      // Console.println(F("Get Wrong Stack"));
       break;
     case CheckSumNotMatch:
-      // Serial.println(F("Check Sum Not Match"));
+      // Console.println(F("Check Sum Not Match"));
       break;
     case FileIndexOut:
-      // Serial.println(F("File Index Out of Bound"));
+      // Console.println(F("File Index Out of Bound"));
       break;
     case FileMismatch:
-      // Serial.println(F("Cannot Find File"));
+      // Console.println(F("Cannot Find File"));
       break;
     case Advertise:
-      // Serial.println(F("In Advertise"));
+      // Console.println(F("In Advertise"));
       break;
     default:
       break;
@@ -301,663 +835,2635 @@ void printDetail(uint8_t type, int value)
   default:
     break;
   }
+#endif
 }
 
-// -- Function implementations moved here --
+// -- Cooperative scheduler --
 
-int findSoundTrack(const char *name)
+// Arm a task in a free slot. Returns the slot id, or -1 if the table is full.
+int scheduleTask(unsigned long delayMs, unsigned long intervalMs, TaskCallback callback)
 {
-  for (int i = 0; i < NUM_UI_FILES; i++)
+  if (!callback)
+    return -1;
+  for (int i = 0; i < MAX_SCHEDULED_TASKS; i++)
   {
-    if (SOUNDS[i].name && strcmp(SOUNDS[i].name, name) == 0)
+    if (scheduledTasks[i].callback == NULL)
     {
-      return SOUNDS[i].track;
+      scheduledTasks[i].callback = callback;
+      scheduledTasks[i].startedAt = schedulerClock();
+      scheduledTasks[i].delayMs = delayMs;
+      scheduledTasks[i].intervalMs = intervalMs;
+      return i;
     }
   }
   return -1;
 }
 
-int getTrackFromArray(const TrackMapping *array, int maxSize, int index)
+int scheduleOnce(unsigned long delayMs, TaskCallback callback)
 {
-  if (index >= 0 && index < maxSize)
-  {
-    return array[index].track;
-  }
-  return -1;
+  return scheduleTask(delayMs, 0, callback);
 }
 
-// Play the favorite indexed by button (0..2). Safe no-op if mapping invalid.
-void playFavorite(int idx)
+int scheduleEvery(unsigned long intervalMs, TaskCallback callback)
 {
-  if (idx < 0 || idx >= 3)
-    return;
-  uint8_t folder = FAVORITES[idx].folder;
-  uint8_t track = FAVORITES[idx].track;
-  if (folder > 0 && track > 0)
-  {
-    playFolderTrack(folder, track);
-  }
+  if (intervalMs == 0)
+    return -1;
+  return scheduleTask(intervalMs, intervalMs, callback);
 }
 
-// Play a track from a specific folder
-void playFolderTrack(uint8_t folder, uint8_t track)
+void cancelTask(int id)
 {
-  if (folder <= 0 || track <= 0)
+  if (id < 0 || id >= MAX_SCHEDULED_TASKS)
     return;
-  DFPlayer.playFolder(folder, track);
-  lastPlayedTrack = track;
-  isPlaying = true;
-  // USBSerial.print(F("Playing folder "));
-  // USBSerial.print(folder);
-  // USBSerial.print(F(" track "));
-  // USBSerial.println(track);
+  scheduledTasks[id].callback = NULL;
 }
 
-// Helper: play a track from UI sounds folder
-void playUISound(const char *name)
+// Run every task that is due. Elapsed time is computed with unsigned
+// subtraction so halMillis() rollover is harmless. Callbacks may schedule or
+// cancel tasks themselves.
+void runScheduler()
 {
-  if (!name)
-    return;
-  for (int i = 0; i < NUM_UI_FILES; i++)
+  for (int i = 0; i < MAX_SCHEDULED_TASKS; i++)
   {
-    if (SOUNDS[i].name && strcmp(SOUNDS[i].name, name) == 0)
+    ScheduledTask &task = scheduledTasks[i];
+    if (task.callback == NULL)
+      continue;
+    unsigned long now = schedulerClock();
+    if (now - task.startedAt < task.delayMs)
+      continue;
+
+    TaskCallback callback = task.callback;
+    if (task.intervalMs > 0)
     {
-      playFolderTrack(UI, SOUNDS[i].track);
-      return;
+      // Advance by whole periods to keep a periodic timer phase-locked
+      task.startedAt += task.delayMs;
+      task.delayMs = task.intervalMs;
     }
+    else
+    {
+      task.callback = NULL; // free the slot before running
+    }
+    callback();
   }
 }
 
-// Helper: play random track from a folder
-void playRandomFromFolder(uint8_t folder, uint8_t maxTracks)
+bool tasksPending()
 {
-  if (folder <= 0 || maxTracks <= 0)
-    return;
-  uint8_t track = random(1, maxTracks + 1);
-  playFolderTrack(folder, track);
+  for (int i = 0; i < MAX_SCHEDULED_TASKS; i++)
+    if (scheduledTasks[i].callback != NULL)
+      return true;
+  return false;
 }
 
-void enterSettingsMode()
+// Play `prompt` after delayMs, replacing any prompt still waiting
+void queuePrompt(unsigned long delayMs, TaskCallback prompt)
 {
-  previousMode = currentMode;
-  currentMode = MODE_SETTINGS;
-  // Initialize settings submenu state and provide feedback
-  currentSetting = SET_VOLUME;
-  playUISound("settings_mode");
-  delay(1000);
-  playUISound("settings_volume_mode");
+  cancelPrompt();
+  pendingPrompt = prompt;
+  pendingPromptTask = scheduleOnce(delayMs, runPendingPrompt);
 }
 
-void exitSettingsMode()
+void cancelPrompt()
 {
-  // Apply any changed settings (playback mode selection)
-  saveSettings();
-  currentMode = previousMode;
-  // Serial.println(F("Exited SETTINGS mode"));
-  // play menu close sound if defined
-  switch (currentMode)
-  {
-  case MODE_FAVORITES:
-    playUISound("favorites_mode");
-    break;
-  case MODE_VOICE:
-    playUISound("voice_mode");
-    break;
-  case MODE_MUSIC:
-    playUISound("music_mode");
-    break;
-  case MODE_CANDIDS:
-    playUISound("candids_mode");
-  default:
-    break;
-  }
-  lastPlayedTrack = 0;
+  cancelTask(pendingPromptTask);
+  pendingPromptTask = -1;
+  pendingPrompt = NULL;
 }
 
-void playRandomTrack()
+void runPendingPrompt()
 {
-  switch (currentMode)
-  {
-  case MODE_VOICE:
-    playRandomFromFolder(Voice, NUM_VOICE_FILES);
-    break;
-  case MODE_MUSIC:
-    playRandomFromFolder(Music, NUM_MUSIC_FILES);
-    break;
-  case MODE_CANDIDS:
-    playRandomFromFolder(Candids, NUM_CANDIDS_FILES);
-    break;
-  default:
-    break;
-  }
+  TaskCallback prompt = pendingPrompt;
+  pendingPromptTask = -1;
+  pendingPrompt = NULL;
+  if (prompt)
+    prompt();
 }
 
-void playNextTrack()
+void announceVolumeSetting()
+{
+  playUISound(UI_SOUND_SETTINGS_VOLUME_MODE);
+}
+
+// -- DFPlayer command queue --
+
+// True if a newly queued `command` makes an already queued `pending` one
+// pointless. Only absolute commands coalesce; next/previous are relative.
+bool playerCommandSupersedes(uint8_t command, uint8_t pending)
 {
-  switch (currentMode)
+  switch (command)
   {
-  case MODE_VOICE:
-    if (lastPlayedTrack >= NUM_VOICE_FILES)
-      lastPlayedTrack = 0;
-    playFolderTrack(Voice, lastPlayedTrack + 1);
-    break;
-  case MODE_MUSIC:
-    if (lastPlayedTrack >= NUM_MUSIC_FILES)
-      lastPlayedTrack = 0;
-    playFolderTrack(Music, lastPlayedTrack + 1);
-    break;
-  case MODE_CANDIDS:
-    if (lastPlayedTrack >= NUM_CANDIDS_FILES)
-      lastPlayedTrack = 0;
-    playFolderTrack(Candids, lastPlayedTrack + 1);
-    break;
+  case PLAYER_CMD_VOLUME:
+  case PLAYER_CMD_EQ:
+    return pending == command;
+  case PLAYER_CMD_PLAY:
+  case PLAYER_CMD_PLAY_FOLDER:
+  case PLAYER_CMD_LOOP_FOLDER:
+  case PLAYER_CMD_STOP:
+    return pending == PLAYER_CMD_PLAY || pending == PLAYER_CMD_PLAY_FOLDER ||
+           pending == PLAYER_CMD_LOOP_FOLDER || pending == PLAYER_CMD_STOP ||
+           pending == PLAYER_CMD_START || pending == PLAYER_CMD_PAUSE;
+  case PLAYER_CMD_START:
+  case PLAYER_CMD_PAUSE:
+    return pending == PLAYER_CMD_START || pending == PLAYER_CMD_PAUSE;
   default:
-    break;
+    return false;
   }
 }
 
-void playPreviousTrack()
+// Queue a command without blocking. A command that supersedes queued ones
+// takes the place of the first of them so ordering relative to unrelated
+// commands (e.g. volume before its feedback tone) is kept. Returns false if
+// the queue is full.
+bool queuePlayerCommand(uint8_t command, uint16_t param)
 {
-  switch (currentMode)
+  int insertAt = -1;
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < playerQueueCount; i++)
   {
-  case MODE_VOICE:
-    if (lastPlayedTrack <= 1)
-      lastPlayedTrack = NUM_VOICE_FILES + 1;
-    playFolderTrack(Voice, lastPlayedTrack - 1);
-    break;
-  case MODE_MUSIC:
-    if (lastPlayedTrack <= 1)
-      lastPlayedTrack = NUM_MUSIC_FILES + 1;
-    playFolderTrack(Music, lastPlayedTrack - 1);
-    break;
-  case MODE_CANDIDS:
-    if (lastPlayedTrack <= 1)
-      lastPlayedTrack = NUM_CANDIDS_FILES + 1;
-    playFolderTrack(Candids, lastPlayedTrack - 1);
-    break;
-  default:
-    break;
+    PlayerCommand pending = playerQueue[(playerQueueHead + i) % PLAYER_QUEUE_SIZE];
+    if (playerCommandSupersedes(command, pending.command))
+    {
+      if (insertAt < 0)
+        insertAt = kept++;
+      continue;
+    }
+    playerQueue[(playerQueueHead + kept) % PLAYER_QUEUE_SIZE] = pending;
+    kept++;
+  }
+  playerQueueCount = kept;
+
+  if (insertAt < 0)
+  {
+    if (playerQueueCount >= PLAYER_QUEUE_SIZE)
+      return false;
+    insertAt = playerQueueCount++;
   }
+  PlayerCommand &slot = playerQueue[(playerQueueHead + insertAt) % PLAYER_QUEUE_SIZE];
+  slot.command = command;
+  slot.param = param;
+  return true;
 }
 
-void changePlaybackMode()
+void sendPlayerFrame(uint8_t command, uint16_t param)
+{
+  uint8_t frame[DFPLAYER_FRAME_LENGTH];
+  dfplayerEncodeFrame(frame, command, /*feedback = */ true, param);
+  PlayerSerial.write(frame, DFPLAYER_FRAME_LENGTH);
+#ifdef LATENCY_BENCH
+  benchFrameSent();
+#endif
+}
+
+// Ask the module for its status and wait briefly for any valid frame back.
+// Only used from setup(), before the command queue is running.
+bool probePlayer()
 {
-  // USBSerial.println("Button 1 long pressed");
-  // Toggle between modes on long press
-  switch (currentMode)
+  while (PlayerSerial.available())
+    PlayerSerial.read();
+  sendPlayerFrame(PLAYER_CMD_QUERY_STATUS, 0);
+
+  uint8_t frame[DFPLAYER_FRAME_LENGTH];
+  uint8_t length = 0;
+  unsigned long startedAt = halMillis();
+  while (halMillis() - startedAt < PLAYER_PROBE_TIMEOUT)
   {
-  case MODE_FAVORITES:
-    currentMode = MODE_VOICE;
-    // Serial.println(F("Switched to VOICE mode"));
-    playUISound("voice_mode");
-    break;
-  case MODE_VOICE:
-    currentMode = MODE_MUSIC;
-    // Serial.println(F("Switched to MUSIC mode"));
-    playUISound("music_mode");
-    break;
-  case MODE_MUSIC:
-    currentMode = MODE_CANDIDS;
-    // Serial.println(F("Switched to CANDIDS mode"));
-    playUISound("candids_mode");
-    break;
-  case MODE_CANDIDS:
-    currentMode = MODE_FAVORITES;
-    // Serial.println(F("Switched to FAVORITES mode"));
-    playUISound("favorites_mode");
-    break;
-  default:
-    break;
+    if (!PlayerSerial.available())
+      continue;
+    uint8_t b = PlayerSerial.read();
+    if (length == 0 && b != DFPLAYER_FRAME_START)
+      continue;
+    frame[length++] = b;
+    if (length < DFPLAYER_FRAME_LENGTH)
+      continue;
+    length = 0;
+    if (dfplayerFrameValid(frame) && frame[3] == PLAYER_CMD_QUERY_STATUS)
+      return true;
   }
-  lastPlayedTrack = 0;
+  return false;
 }
 
-void replayLastTrack()
+// Called every loop(): drain received frames, expire a lost ACK and send the
+// next queued command once the previous one has been acknowledged.
+void servicePlayerQueue()
 {
-  if (currentMode != MODE_SETTINGS)
+  PROFILE_SCOPE(PROFILE_PLAYER);
+  pumpPlayerSerial();
+
+  if (playerAwaitingAck && halMillis() - playerSentAt >= PLAYER_ACK_TIMEOUT)
+  {
+    playerAwaitingAck = false;
+  }
+
+  if (!playerAwaitingAck && playerQueueCount > 0)
   {
-    if (lastPlayedTrack > 0)
+    playerInFlight = playerQueue[playerQueueHead];
+    playerQueueHead = (playerQueueHead + 1) % PLAYER_QUEUE_SIZE;
+    playerQueueCount--;
+    sendPlayerFrame(playerInFlight.command, playerInFlight.param);
+    bool isPlay = playerInFlight.command == PLAYER_CMD_PLAY_FOLDER;
+    lastSentFolder = isPlay ? playerInFlight.param >> 8 : 0;
+    lastSentTrack = isPlay ? playerInFlight.param : 0;
+    if (isPlay && bootPhaseAt[BOOT_FIRST_AUDIO] == 0)
+      markBootPhase(BOOT_FIRST_AUDIO);
+    if (isPlay && wakeAudioPending)
     {
-      uint8_t currentFolder = Voice; // default to voice folder
-      switch (currentMode)
-      {
-      case MODE_MUSIC:
-        currentFolder = Music;
-        break;
-      case MODE_CANDIDS:
-        currentFolder = Candids;
-        break;
-      default:
-        currentFolder = Voice;
-        break;
-      }
-      playFolderTrack(currentFolder, lastPlayedTrack);
+      wakeAudioPending = false;
+      lastWakeLatencyMs = halMillis() - wakePressAt;
+      if (lastWakeLatencyMs > maxWakeLatencyMs)
+        maxWakeLatencyMs = lastWakeLatencyMs;
+      totalWakeLatencyMs += lastWakeLatencyMs;
+      wakeLatencyCount++;
     }
-    else
+    if (isPlay && trackGapPending)
     {
-      // USBSerial.println(F("No last track to replay"));
+      trackGapPending = false;
+      lastTrackGapMs = halMillis() - trackEndedAt;
+      if (lastTrackGapMs > maxTrackGapMs)
+        maxTrackGapMs = lastTrackGapMs;
     }
+    playerSentAt = halMillis();
+    playerAwaitingAck = true;
   }
 }
 
-void togglePlayPause()
+// Assemble frames from whatever bytes are already buffered; never waits.
+void pumpPlayerSerial()
 {
-  if (currentMode == MODE_SETTINGS)
-    return;
-
-  if (isPlaying)
+  while (PlayerSerial.available())
   {
-    DFPlayer.pause();
-    isPlaying = false;
-    // USBSerial.println(F("Paused"));
+    uint8_t b = PlayerSerial.read();
+    if (playerRxIndex == 0 && b != DFPLAYER_FRAME_START)
+      continue; // resynchronise on the start byte
+    playerRxFrame[playerRxIndex++] = b;
+    if (playerRxIndex < DFPLAYER_FRAME_LENGTH)
+      continue;
+    playerRxIndex = 0;
+    if (!dfplayerFrameValid(playerRxFrame))
+      continue;
+
+    handlePlayerFrame(playerRxFrame[3], (playerRxFrame[5] << 8) | playerRxFrame[6]);
   }
-  else
+}
+
+void handlePlayerFrame(uint8_t command, uint16_t param)
+{
+  switch (command)
   {
-    if (lastPlayedTrack > 0)
+  case PLAYER_FB_ACK:
+    // Queries stay in flight until their reply frame arrives
+    if (playerInFlight.command != PLAYER_CMD_QUERY_FOLDER_FILES)
+      playerAwaitingAck = false;
+    break;
+  case PLAYER_CMD_QUERY_FOLDER_FILES:
+    if (playerAwaitingAck && playerInFlight.command == command)
     {
-      DFPlayer.start();
-      isPlaying = true;
-      // USBSerial.println(F("Resumed"));
+      playerAwaitingAck = false;
+      onFolderFileCount(playerInFlight.param, param);
     }
-    else
+    break;
+  case PLAYER_FB_ERROR:
+    // The module reports a failed command instead of (or after) its ACK
+    printDetail(DFPlayerError, param);
+    if (playerInFlight.command == PLAYER_CMD_QUERY_FOLDER_FILES)
+    {
+      // A folder that does not exist is reported as an error, i.e. no files
+      if (playerAwaitingAck)
+        onFolderFileCount(playerInFlight.param, 0);
+    }
+    else if ((param == FileMismatch || param == FileIndexOut) && lastSentFolder > 0)
     {
-      // USBSerial.println(F("No track to resume"));
+      playbackState = PLAYBACK_STOPPED;
+      removeIndexedTrack(lastSentFolder, lastSentTrack);
+      if (browseAction && browseFolder == lastSentFolder && browseTrack == lastSentTrack)
+        browseAction();
     }
+    playerAwaitingAck = false;
+    break;
+  case PLAYER_FB_PLAY_FINISHED:
+    printDetail(DFPlayerPlayFinished, param);
+    if (param == lastFinishedFile && halMillis() - lastFinishedAt < PLAY_FINISHED_DEDUP_WINDOW)
+      break;
+    lastFinishedFile = param;
+    lastFinishedAt = halMillis();
+    onTrackFinished();
+    break;
+  case PLAYER_FB_CARD_INSERTED:
+    printDetail(DFPlayerCardInserted, param);
+    scanTrackIndex();
+    break;
+  case PLAYER_FB_CARD_REMOVED:
+    printDetail(DFPlayerCardRemoved, param);
+    playbackState = PLAYBACK_STOPPED;
+    break;
+  case PLAYER_FB_CARD_ONLINE:
+    printDetail(DFPlayerCardOnline, param);
+    break;
+  default:
+    break;
   }
 }
 
-void toggleSettingsMode()
+// -- Playback state --
+
+// Work out which track follows the current browsed track, so it can be
+// sent without any lookup when the current one ends
+void prepareNextTrack()
 {
-  // Toggle configuration mode
-  if (currentMode != MODE_SETTINGS)
+  preparedFolder = 0;
+  preparedTrack = 0;
+  preparedMode = currentMode;
+  if (currentMode == MODE_PLAYLISTS)
   {
-    enterSettingsMode();
+    preparePlaylistEntry();
+    return;
+  }
+  uint8_t folder = modeFolder(currentMode);
+  if (folder == 0 || lastPlayedFolder != folder || currentContinuousMode == CONTINUOUS_OFF)
+    return;
+
+  uint8_t track;
+  if (currentContinuousMode == CONTINUOUS_REPEAT_ONE)
+    track = lastPlayedTrack;
+  else if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM)
+  {
+    // Playing through the folder stops once the shuffle has been played out
+    bool playedOut = shuffle.position[folder - 2] >= shuffle.length[folder - 2];
+    track = currentContinuousMode == CONTINUOUS_FOLDER && playedOut ? 0 : peekShuffledTrack(folder);
   }
   else
   {
-    // Save configuration (placeholder) and exit
-    // If persistent storage needed, write to EEPROM here.
-    // Serial.println(F("Saving configuration and exiting settings mode"));
-    exitSettingsMode();
+    track = nextIndexedTrack(folder, lastPlayedTrack);
+    // Playing through the folder stops instead of wrapping to the start
+    if (currentContinuousMode == CONTINUOUS_FOLDER && track <= lastPlayedTrack)
+      track = 0;
   }
+  preparedFolder = folder;
+  preparedTrack = track;
 }
 
-void increaseVolume()
+// The current track ended (reported by the module, seen on the BUSY pin or
+// past its expected length). In continuous modes the prepared track starts
+// right away.
+void onTrackFinished()
 {
-  if (currentVolume < 30)
+  if (playbackState != PLAYBACK_PLAYING)
+    return;
+  playbackState = PLAYBACK_STOPPED;
+
+  // Only a browsed track carries on; prompts and tones just stop
+  if (preparedTrack == 0 || preparedMode != currentMode || lastPlayedFolder != browseFolder ||
+      lastPlayedTrack != browseTrack)
+    return;
+  trackEndedAt = halMillis();
+  trackGapPending = true;
+  if (currentMode == MODE_PLAYLISTS)
+    playPlaylistEntry(preparedPlaylistPosition);
+  else if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM && currentContinuousMode != CONTINUOUS_REPEAT_ONE)
+    playRandomFromFolder(preparedFolder); // takes the prepared track from the shuffle
+  else
+    playBrowsedTrack(currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM ? playRandomTrack : playNextTrack, preparedFolder, preparedTrack);
+}
+
+// Fallback end-of-track detection from the manifest duration
+void checkExpectedTrackEnd()
+{
+  if (playbackState == PLAYBACK_PLAYING && playbackDurationMs > 0 &&
+      halMillis() - playbackStartedAt >= playbackDurationMs + EXPECTED_END_GRACE)
   {
-    currentVolume++;
-    DFPlayer.volume(currentVolume);
-    playFolderTrack(UI, 8); // Play tone1 as feedback
+    onTrackFinished();
   }
 }
 
-void decreaseVolume()
+void pausePlayback()
 {
-  if (currentVolume > 0)
+  queuePlayerCommand(PLAYER_CMD_PAUSE, 0);
+  if (playbackState == PLAYBACK_PLAYING)
   {
-    currentVolume--;
-    DFPlayer.volume(currentVolume);
-    playFolderTrack(UI, 8); // Play tone2 as feedback
+    playbackState = PLAYBACK_PAUSED;
+    playbackPausedAt = halMillis();
+    markSettingsDirty(SETTINGS_DIRTY_POSITION); // keep the paused position
   }
 }
 
-void button1ISR()
+void resumePlayback()
 {
-  button1.read();
+  queuePlayerCommand(PLAYER_CMD_START, 0);
+  if (playbackState == PLAYBACK_PAUSED)
+  {
+    playbackState = PLAYBACK_PLAYING;
+    // Time spent paused does not count towards the expected end
+    playbackStartedAt += halMillis() - playbackPausedAt;
+  }
 }
 
-void button1Pressed()
+// Start the track that was playing before the last power-off. The module
+// cannot seek, so it restarts from the beginning.
+void resumeLastTrack()
 {
-  if (currentMode == MODE_SETTINGS)
+  if (resumeFolder == modeFolder(currentMode) && nextIndexedTrack(resumeFolder, resumeTrack - 1) == resumeTrack)
   {
-    // Behavior depends on which setting is currently selected
-    if (currentSetting == SET_VOLUME)
+    TaskCallback action = currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM ? playRandomTrack : playNextTrack;
+    playBrowsedTrack(action, resumeFolder, resumeTrack);
+  }
+  else if (currentMode == MODE_FAVORITES && resumeFolder > 0)
+  {
+    playFolderTrack(resumeFolder, resumeTrack);
+  }
+  else
+  {
+    announceCurrentMode();
+  }
+}
+
+void markBootPhase(uint8_t phase)
+{
+  bootPhaseAt[phase] = halMillis();
+}
+
+// Edge detection on the BUSY pin, for modules whose play-finished frames are
+// unreliable. Called every loop(); a no-op unless DFPLAYER_BUSY_PIN is set.
+void pollBusyPin()
+{
+#ifdef DFPLAYER_BUSY_PIN
+  bool idle = !halPlayerBusy();
+  unsigned long now = halMillis();
+  if (idle != busyPinIdle)
+  {
+    busyPinIdle = idle;
+    busyPinIdleSince = now;
+    return;
+  }
+  // BUSY drops briefly between commands, so require it to stay high, ignore
+  // it right after a play while the module is still starting up, and only
+  // count a busy-to-idle edge that came after the play started
+  if (idle && playbackState == PLAYBACK_PLAYING &&
+      now - busyPinIdleSince >= BUSY_IDLE_DEBOUNCE &&
+      now - playbackStartedAt >= BUSY_START_GRACE &&
+      busyPinIdleSince - playbackStartedAt < 0x80000000UL)
+  {
+    onTrackFinished();
+  }
+#endif
+}
+
+// -- SD-card track index --
+
+// Start a folder's index over. If the card reports the same file count as the
+// media manifest the manifest's track numbers are used as-is; otherwise every
+// track number is a candidate until the module says otherwise.
+void resetFolderIndex(uint8_t folder)
+{
+  const MediaFolder *manifest = &MEDIA_FOLDERS[folder - 1];
+  bool matchesManifest = trackIndex.fileCounts[folder - 1] == pgm_read_byte(&manifest->count);
+  for (int w = 0; w < MAX_TRACKS_PER_FOLDER / 32; w++)
+  {
+    if (matchesManifest)
+      trackIndex.present[folder - 1][w] = pgm_read_dword(&manifest->present[w]);
+    else
+      trackIndex.present[folder - 1][w] = trackIndex.fileCounts[folder - 1] > 0 ? 0xFFFFFFFFUL : 0;
+  }
+}
+
+void loadTrackIndex()
+{
+  halStoreRead(HAL_STORE_TRACK_INDEX, &trackIndex, sizeof(trackIndex));
+  if (trackIndex.magic != TRACK_INDEX_MAGIC)
+  {
+    // Nothing cached yet: assume the card matches the media manifest until
+    // the scan says otherwise
+    trackIndex.magic = TRACK_INDEX_MAGIC;
+    for (uint8_t folder = 1; folder <= NUM_FOLDERS; folder++)
+    {
+      trackIndex.fileCounts[folder - 1] = pgm_read_byte(&MEDIA_FOLDERS[folder - 1].count);
+      resetFolderIndex(folder);
+    }
+  }
+}
+
+void saveTrackIndex()
+{
+  PROFILE_SCOPE(PROFILE_FLASH);
+  trackIndexSaveTask = -1;
+  halStoreWrite(HAL_STORE_TRACK_INDEX, &trackIndex, sizeof(trackIndex));
+}
+
+// Coalesce index changes into one flash write after a quiet period, never
+// from inside a button or serial handler.
+void scheduleTrackIndexSave()
+{
+  cancelTask(trackIndexSaveTask);
+  trackIndexSaveTask = scheduleOnce(TRACK_INDEX_SAVE_DELAY, saveTrackIndex);
+}
+
+// Ask the module for every folder's file count; replies arrive through
+// onFolderFileCount().
+void scanTrackIndex()
+{
+  pendingFolderScans = 0;
+  for (uint8_t folder = 1; folder <= NUM_FOLDERS; folder++)
+  {
+    if (queuePlayerCommand(PLAYER_CMD_QUERY_FOLDER_FILES, folder))
+      pendingFolderScans++;
+  }
+}
+
+void onFolderFileCount(uint8_t folder, uint16_t count)
+{
+  if (folder < 1 || folder > NUM_FOLDERS)
+    return;
+  scannedFileCounts[folder - 1] = count;
+  if (pendingFolderScans == 0 || --pendingFolderScans > 0)
+    return;
+
+  // All folders answered: a different set of counts means a different card
+  bool changed = false;
+  for (uint8_t f = 1; f <= NUM_FOLDERS; f++)
+  {
+    if (trackIndex.fileCounts[f - 1] != scannedFileCounts[f - 1])
+    {
+      trackIndex.fileCounts[f - 1] = scannedFileCounts[f - 1];
+      resetFolderIndex(f);
+      changed = true;
+    }
+  }
+  if (changed)
+    scheduleTrackIndexSave();
+}
+
+void removeIndexedTrack(uint8_t folder, uint8_t track)
+{
+  if (folder < 1 || folder > NUM_FOLDERS || track < 1 || track > MAX_TRACKS_PER_FOLDER)
+    return;
+  uint32_t &word = trackIndex.present[folder - 1][(track - 1) / 32];
+  uint32_t bit = 1UL << ((track - 1) % 32);
+  if (word & bit)
+  {
+    word &= ~bit;
+    scheduleTrackIndexSave();
+  }
+}
+
+// Lowest indexed track number >= first, or 0 if there is none
+uint8_t firstIndexedTrackFrom(uint8_t folder, uint8_t first)
+{
+  for (uint8_t w = (first - 1) / 32; w < MAX_TRACKS_PER_FOLDER / 32; w++)
+  {
+    uint32_t bits = trackIndex.present[folder - 1][w];
+    if (w == (first - 1) / 32)
+      bits &= 0xFFFFFFFFUL << ((first - 1) % 32);
+    if (bits)
+      return w * 32 + __builtin_ctzl(bits) + 1;
+  }
+  return 0;
+}
+
+// Highest indexed track number <= last, or 0 if there is none
+uint8_t lastIndexedTrackUpTo(uint8_t folder, uint8_t last)
+{
+  for (int w = (last - 1) / 32; w >= 0; w--)
+  {
+    uint32_t bits = trackIndex.present[folder - 1][w];
+    if (w == (last - 1) / 32 && (last - 1) % 32 != 31)
+      bits &= (1UL << ((last - 1) % 32 + 1)) - 1;
+    if (bits)
+      return w * 32 + (sizeof(unsigned long) * 8 - 1 - __builtin_clzl(bits)) + 1;
+  }
+  return 0;
+}
+
+// Next present track after `after`, wrapping to the first one
+uint8_t nextIndexedTrack(uint8_t folder, uint8_t after)
+{
+  if (folder < 1 || folder > NUM_FOLDERS)
+    return 0;
+  uint8_t track = after < MAX_TRACKS_PER_FOLDER ? firstIndexedTrackFrom(folder, after + 1) : 0;
+  return track ? track : firstIndexedTrackFrom(folder, 1);
+}
+
+// Previous present track before `before`, wrapping to the last one
+uint8_t previousIndexedTrack(uint8_t folder, uint8_t before)
+{
+  if (folder < 1 || folder > NUM_FOLDERS)
+    return 0;
+  uint8_t track = before > 1 ? lastIndexedTrackUpTo(folder, before <= MAX_TRACKS_PER_FOLDER ? before - 1 : MAX_TRACKS_PER_FOLDER) : 0;
+  return track ? track : lastIndexedTrackUpTo(folder, MAX_TRACKS_PER_FOLDER);
+}
+
+// -- Shuffle --
+
+void loadShuffle()
+{
+  halStoreRead(HAL_STORE_SHUFFLE, &shuffle, sizeof(shuffle));
+  if (shuffle.magic != SHUFFLE_MAGIC)
+  {
+    // Empty permutations are rebuilt the first time a folder is shuffled
+    memset(&shuffle, 0, sizeof(shuffle));
+    shuffle.magic = SHUFFLE_MAGIC;
+  }
+}
+
+void saveShuffle()
+{
+  PROFILE_SCOPE(PROFILE_FLASH);
+  shuffleSaveTask = -1;
+  halStoreWrite(HAL_STORE_SHUFFLE, &shuffle, sizeof(shuffle));
+}
+
+// The position moves with every random track, so writes are coalesced the
+// same way as the track index
+void scheduleShuffleSave()
+{
+  cancelTask(shuffleSaveTask);
+  shuffleSaveTask = scheduleOnce(SHUFFLE_SAVE_DELAY, saveShuffle);
+}
+
+uint8_t shuffleEntry(uint8_t folder, uint8_t i)
+{
+  uint16_t bit = i * SHUFFLE_ENTRY_BITS;
+  const uint8_t *bytes = &shuffle.order[folder - 2][bit / 8];
+  uint16_t value = bytes[0];
+  if (bit % 8 + SHUFFLE_ENTRY_BITS > 8)
+    value |= bytes[1] << 8;
+  return ((value >> (bit % 8)) & SHUFFLE_ENTRY_MASK) + 1;
+}
+
+void setShuffleEntry(uint8_t folder, uint8_t i, uint8_t track)
+{
+  uint16_t bit = i * SHUFFLE_ENTRY_BITS;
+  uint8_t *bytes = &shuffle.order[folder - 2][bit / 8];
+  uint16_t mask = SHUFFLE_ENTRY_MASK << (bit % 8);
+  uint16_t value = (uint16_t)(track - 1) << (bit % 8);
+  bytes[0] = (bytes[0] & ~mask) | (value & mask);
+  if (bit % 8 + SHUFFLE_ENTRY_BITS > 8)
+    bytes[1] = (bytes[1] & ~(mask >> 8)) | ((value & mask) >> 8);
+}
+
+uint8_t indexedTrackCount(uint8_t folder)
+{
+  uint8_t total = 0;
+  for (int w = 0; w < MAX_TRACKS_PER_FOLDER / 32; w++)
+    total += __builtin_popcountl(trackIndex.present[folder - 1][w]);
+  return total;
+}
+
+// New permutation of the folder's indexed tracks. The track that just played
+// is kept away from the front so it never repeats across the reshuffle.
+void reshuffleFolder(uint8_t folder)
+{
+  uint8_t n = 0;
+  for (uint8_t track = firstIndexedTrackFrom(folder, 1); track; track = track < MAX_TRACKS_PER_FOLDER ? firstIndexedTrackFrom(folder, track + 1) : 0)
+    setShuffleEntry(folder, n++, track);
+  for (uint8_t i = n; i > 1; i--)
+  {
+    uint8_t j = random(i);
+    uint8_t swap = shuffleEntry(folder, i - 1);
+    setShuffleEntry(folder, i - 1, shuffleEntry(folder, j));
+    setShuffleEntry(folder, j, swap);
+  }
+  if (n > 1 && lastPlayedFolder == folder && shuffleEntry(folder, 0) == lastPlayedTrack)
+  {
+    uint8_t j = random(1, n);
+    setShuffleEntry(folder, 0, shuffleEntry(folder, j));
+    setShuffleEntry(folder, j, lastPlayedTrack);
+  }
+  shuffle.length[folder - 2] = n;
+  shuffle.position[folder - 2] = 0;
+  scheduleShuffleSave();
+}
+
+// Next track of the folder's permutation without consuming it, or 0 if the
+// folder is empty. Entries for tracks since dropped from the index are
+// skipped; a permutation that no longer matches the index is rebuilt.
+uint8_t peekShuffledTrack(uint8_t folder)
+{
+  if (folder < 2 || folder > NUM_FOLDERS)
+    return 0;
+  if (shuffle.length[folder - 2] < indexedTrackCount(folder))
+    reshuffleFolder(folder);
+  for (uint8_t attempt = 0; attempt < 2; attempt++)
+  {
+    uint8_t &position = shuffle.position[folder - 2];
+    while (position < shuffle.length[folder - 2])
+    {
+      uint8_t track = shuffleEntry(folder, position);
+      if (trackIndex.present[folder - 1][(track - 1) / 32] & (1UL << ((track - 1) % 32)))
+        return track;
+      position++;
+    }
+    reshuffleFolder(folder);
+  }
+  return 0;
+}
+
+// Next track of the folder's permutation, moving past it
+uint8_t takeShuffledTrack(uint8_t folder)
+{
+  uint8_t track = peekShuffledTrack(folder);
+  if (track)
+  {
+    shuffle.position[folder - 2]++;
+    scheduleShuffleSave();
+  }
+  return track;
+}
+
+// A track's entry in the media manifest (PROGMEM), NULL if it is not there
+const MediaTrack *findMediaTrack(uint8_t folder, uint8_t track)
+{
+  if (folder < 1 || folder > MEDIA_NUM_FOLDERS)
+    return NULL;
+  const MediaFolder *manifest = &MEDIA_FOLDERS[folder - 1];
+  const MediaTrack *tracks = (const MediaTrack *)pgm_read_ptr(&manifest->tracks);
+  int low = 0;
+  int high = pgm_read_byte(&manifest->count) - 1;
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+    uint8_t number = pgm_read_byte(&tracks[mid].number);
+    if (number == track)
+      return &tracks[mid];
+    if (number < track)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return NULL;
+}
+
+// Expected playback length of a track from the media manifest, 0 if the
+// track is not in the manifest
+uint32_t mediaTrackDurationMs(uint8_t folder, uint8_t track)
+{
+  const MediaTrack *entry = findMediaTrack(folder, track);
+  return entry ? pgm_read_dword(&entry->durationMs) : 0;
+}
+
+// Volume steps bringing a track to the card's median loudness
+// (scripts/analyse_loudness.py), 0 if it was never measured
+int8_t mediaTrackGainSteps(uint8_t folder, uint8_t track)
+{
+  const MediaTrack *entry = findMediaTrack(folder, track);
+  return entry ? (int8_t)pgm_read_byte(&entry->gainSteps) : 0;
+}
+
+// -- Playlists --
+
+void loadPlaylists()
+{
+  halStoreReadAt(HAL_STORE_PLAYLISTS, 0, &playlists, sizeof(playlists));
+  if (playlists.magic != PLAYLIST_MAGIC)
+  {
+    // Empty playlists, default favorites
+    memset(&playlists, 0, sizeof(playlists));
+    playlists.magic = PLAYLIST_MAGIC;
+  }
+}
+
+// Record a header edit and (re)start the quiet period before it is
+// written, as for the settings. Cheap enough to call from button handlers.
+void markPlaylistsDirty()
+{
+  playlistsDirty = true;
+  cancelTask(playlistSaveTask);
+  playlistSaveTask = scheduleOnce(PLAYLIST_SAVE_DELAY, flushPlaylists);
+}
+
+// Write a pending header edit now; runs from the scheduler, or straight
+// after an entry edit so the header and the entries it counts agree
+void flushPlaylists()
+{
+  cancelTask(playlistSaveTask);
+  playlistSaveTask = -1;
+  if (!playlistsDirty)
+    return;
+  PROFILE_SCOPE(PROFILE_FLASH);
+  playlistsDirty = false;
+  halStoreWriteAt(HAL_STORE_PLAYLISTS, 0, &playlists, sizeof(playlists));
+}
+
+uint8_t playlistEntry(uint8_t list, uint8_t position)
+{
+  uint8_t entry;
+  halStoreReadAt(HAL_STORE_PLAYLISTS, PLAYLIST_ENTRY_OFFSET(list, position), &entry, 1);
+  return entry;
+}
+
+bool isPlaylistTrack(uint8_t folder, uint8_t track)
+{
+  return folder > UI && folder <= NUM_FOLDERS && track >= 1 && track <= MAX_TRACKS_PER_FOLDER;
+}
+
+// Append a track. Entries have no RAM copy, so they go straight to the
+// store (only serial commands edit them), with the header's new length
+// written at once after. On EEPROM only the bytes given are written and the
+// entry lands before the length that makes it part of the list, so a power
+// cut in between loses nothing. On the XIAO every write erases and rewrites
+// the slot's whole row, header included, so a power cut during either write
+// can lose every playlist and favorite.
+bool addPlaylistEntry(uint8_t list, uint8_t folder, uint8_t track)
+{
+  if (list >= PLAYLIST_COUNT || playlists.length[list] >= PLAYLIST_MAX_ENTRIES || !isPlaylistTrack(folder, track))
+    return false;
+  uint8_t entry = PLAYLIST_ENTRY(folder, track);
+  halStoreWriteAt(HAL_STORE_PLAYLISTS, PLAYLIST_ENTRY_OFFSET(list, playlists.length[list]), &entry, 1);
+  playlists.length[list]++;
+  playlistsDirty = true;
+  flushPlaylists();
+  prepareNextTrack();
+  return true;
+}
+
+// Remove the entry at position, moving the ones after it down in a single
+// write, then write the shorter length. A power cut in between leaves the
+// last entry listed twice on EEPROM; on the XIAO, as for
+// addPlaylistEntry(), it can lose the whole slot.
+bool removePlaylistEntry(uint8_t list, uint8_t position)
+{
+  if (list >= PLAYLIST_COUNT || position >= playlists.length[list])
+    return false;
+  uint8_t tail[PLAYLIST_MAX_ENTRIES];
+  uint8_t count = playlists.length[list] - position - 1;
+  if (count > 0)
+  {
+    halStoreReadAt(HAL_STORE_PLAYLISTS, PLAYLIST_ENTRY_OFFSET(list, position + 1), tail, count);
+    halStoreWriteAt(HAL_STORE_PLAYLISTS, PLAYLIST_ENTRY_OFFSET(list, position), tail, count);
+  }
+  playlists.length[list]--;
+  playlistsDirty = true;
+  flushPlaylists();
+  if (list == currentPlaylist && playlistPosition != PLAYLIST_BEFORE_START && playlistPosition > position)
+    playlistPosition--;
+  prepareNextTrack();
+  return true;
+}
+
+bool clearPlaylist(uint8_t list)
+{
+  if (list >= PLAYLIST_COUNT)
+    return false;
+  playlists.length[list] = 0;
+  markPlaylistsDirty();
+  if (list == currentPlaylist)
+    playlistPosition = PLAYLIST_BEFORE_START;
+  prepareNextTrack();
+  return true;
+}
+
+// Assign a track to a favorite button; folder 0 restores the default
+bool setFavorite(uint8_t slot, uint8_t folder, uint8_t track)
+{
+  if (slot >= FAVORITE_COUNT || (folder != 0 && !isPlaylistTrack(folder, track)))
+    return false;
+  playlists.favorites[slot] = folder != 0 ? PLAYLIST_ENTRY(folder, track) : PLAYLIST_NO_ENTRY;
+  markPlaylistsDirty();
+  return true;
+}
+
+// Long press while a track plays: it becomes the first favorite and the
+// others move down a button (a track already there just moves up). No
+// tone, which would cut the track off.
+void favoriteCurrentTrack()
+{
+  if (playbackState != PLAYBACK_PLAYING || !isPlaylistTrack(lastPlayedFolder, lastPlayedTrack))
+    return;
+  uint8_t entry = PLAYLIST_ENTRY(lastPlayedFolder, lastPlayedTrack);
+  uint8_t slot = FAVORITE_COUNT - 1;
+  for (uint8_t i = 0; i < FAVORITE_COUNT - 1; i++)
+    if (playlists.favorites[i] == entry)
     {
-      increaseVolume();
+      slot = i;
+      break;
     }
-    else if (currentSetting == SET_PLAYBACK_ORDER_MODE)
+  memmove(&playlists.favorites[1], &playlists.favorites[0], slot);
+  playlists.favorites[0] = entry;
+  markPlaylistsDirty();
+}
+
+// Play the entry at position in the current playlist
+void playPlaylistEntry(uint8_t position)
+{
+  if (position >= playlists.length[currentPlaylist])
+  {
+    playUISound(UI_SOUND_TONE1); // empty playlist
+    return;
+  }
+  playlistPosition = position;
+  uint8_t entry = playlistEntry(currentPlaylist, position);
+  playBrowsedTrack(skipPlaylistEntry, PLAYLIST_ENTRY_FOLDER(entry), PLAYLIST_ENTRY_TRACK(entry));
+}
+
+void playlistForward()
+{
+  uint8_t length = playlists.length[currentPlaylist];
+  playPlaylistEntry(playlistPosition + 1 >= length ? 0 : playlistPosition + 1);
+}
+
+void playlistBack()
+{
+  uint8_t length = playlists.length[currentPlaylist];
+  playPlaylistEntry(playlistPosition == 0 || playlistPosition >= length ? length - 1 : playlistPosition - 1);
+}
+
+void playlistStart()
+{
+  playPlaylistEntry(0);
+}
+
+// Move on to the next playlist that has entries and start it
+void nextPlaylist()
+{
+  for (uint8_t i = 1; i <= PLAYLIST_COUNT; i++)
+  {
+    uint8_t list = (currentPlaylist + i) % PLAYLIST_COUNT;
+    if (playlists.length[list] > 0)
     {
-      currentPlaybackOrderMode = PLAYBACK_ORDER_MODE_SEQUENTIAL;
-      playUISound("sequential_playback");
+      currentPlaylist = list;
+      break;
     }
+  }
+  playlistPosition = PLAYLIST_BEFORE_START;
+  playlistStart();
+}
+
+// The module reported the entry's track missing: go on to the next entry,
+// without wrapping so a list of missing tracks cannot loop forever
+void skipPlaylistEntry()
+{
+  if (playlistPosition + 1 < playlists.length[currentPlaylist])
+    playPlaylistEntry(playlistPosition + 1);
+}
+
+// prepareNextTrack() for MODE_PLAYLISTS: the entry after the current one,
+// under the same continuous modes as a folder
+void preparePlaylistEntry()
+{
+  uint8_t length = playlists.length[currentPlaylist];
+  if (currentContinuousMode == CONTINUOUS_OFF || playlistPosition >= length)
+    return;
+  uint8_t position = playlistPosition;
+  if (currentContinuousMode != CONTINUOUS_REPEAT_ONE && ++position >= length)
+  {
+    if (currentContinuousMode == CONTINUOUS_FOLDER)
+      return;
+    position = 0;
+  }
+  uint8_t entry = playlistEntry(currentPlaylist, position);
+  preparedPlaylistPosition = position;
+  preparedFolder = PLAYLIST_ENTRY_FOLDER(entry);
+  preparedTrack = PLAYLIST_ENTRY_TRACK(entry);
+}
+
+// -- Function implementations moved here --
+
+// Play the favorite indexed by button (0..2). Safe no-op if mapping invalid.
+void playFavorite(int idx)
+{
+  if (idx < 0 || idx >= FAVORITE_COUNT)
+    return;
+  uint8_t entry = playlists.favorites[idx];
+  uint8_t folder = entry != PLAYLIST_NO_ENTRY ? PLAYLIST_ENTRY_FOLDER(entry) : DEFAULT_FAVORITES[idx].folder;
+  uint8_t track = entry != PLAYLIST_NO_ENTRY ? PLAYLIST_ENTRY_TRACK(entry) : DEFAULT_FAVORITES[idx].track;
+  if (folder > 0 && track > 0)
+  {
+    playFolderTrack(folder, track);
+  }
+}
+
+// Send the module the user's volume moved by the playing track's offset,
+// if that differs from what it has. A setting above 0 stays audible.
+bool queueVolume()
+{
+  int volume = currentVolume + playbackGainSteps;
+  if (volume > 30)
+    volume = 30;
+  else if (volume < 1)
+    volume = currentVolume > 0 ? 1 : 0;
+  if (volume == playerVolume)
+    return true;
+  if (!queuePlayerCommand(PLAYER_CMD_VOLUME, volume))
+    return false;
+  playerVolume = volume;
+  return true;
+}
+
+// Play a track from a specific folder, at the volume that evens out its
+// loudness; the volume frame goes out just ahead of the play frame. False if
+// the play frame could not be queued.
+bool playFolderTrack(uint8_t folder, uint8_t track)
+{
+  if (folder <= 0 || track <= 0)
+    return false;
+  playbackGainSteps = mediaTrackGainSteps(folder, track);
+  queueVolume();
+  bool queued = queuePlayerCommand(PLAYER_CMD_PLAY_FOLDER, (folder << 8) | track);
+  lastPlayedTrack = track;
+  lastPlayedFolder = folder;
+  playbackState = PLAYBACK_PLAYING;
+  playbackStartedAt = halMillis();
+  playbackDurationMs = mediaTrackDurationMs(folder, track);
+  if (folder != UI)
+  {
+    resumeFolder = folder;
+    resumeTrack = track;
+    resumePositionMs = 0; // from the top until it is paused
+    markSettingsDirty(SETTINGS_DIRTY_TRACK);
+  }
+  // Console.print(F("Playing folder "));
+  // Console.print(folder);
+  // Console.print(F(" track "));
+  // Console.println(track);
+  return queued;
+}
+
+// Helper: play a track from UI sounds folder
+void playUISound(UISound sound)
+{
+  playFolderTrack(UI, sound);
+}
+
+// Helper: play a track picked by a browse action, remembering the action so
+// it can be repeated if the module reports the track missing
+void playBrowsedTrack(TaskCallback action, uint8_t folder, uint8_t track)
+{
+  browseAction = action;
+  browseFolder = folder;
+  browseTrack = track;
+  playFolderTrack(folder, track);
+  prepareNextTrack();
+}
+
+// Playback started from the serial console is not part of a browse: nothing
+// is prepared to follow it, and a missing file is not skipped past
+void playUnbrowsedTrack()
+{
+  browseAction = NULL;
+  preparedFolder = 0;
+  preparedTrack = 0;
+}
+
+// Playback the module starts by its own file numbering (play by index,
+// next, previous): which track it is, and so its length and loudness, is
+// unknown, so it plays at the user's volume as it is. False if the play
+// frame could not be queued.
+bool playUnknownTrack(uint8_t command, uint16_t param)
+{
+  playbackGainSteps = 0;
+  queueVolume();
+  bool queued = queuePlayerCommand(command, param);
+  playUnbrowsedTrack();
+  lastPlayedFolder = 0;
+  lastPlayedTrack = 0;
+  playbackState = PLAYBACK_PLAYING;
+  playbackStartedAt = halMillis();
+  playbackDurationMs = 0;
+  return queued;
+}
+
+// Helper: play random track from a folder
+void playRandomFromFolder(uint8_t folder)
+{
+  if (folder <= 0)
+    return;
+  playBrowsedTrack(playRandomTrack, folder, takeShuffledTrack(folder));
+}
+
+void togglePlayPause()
+{
+  if (currentMode == MODE_SETTINGS)
+    return;
+
+  if (playbackState == PLAYBACK_PLAYING)
+  {
+    pausePlayback();
+    // Console.println(F("Paused"));
+  }
+  else if (playbackState == PLAYBACK_PAUSED)
+  {
+    resumePlayback();
+    // Console.println(F("Resumed"));
+  }
+  else if (lastPlayedTrack > 0 && lastPlayedFolder > 0)
+  {
+    // The track already finished, so there is nothing to resume; play it again
+    playFolderTrack(lastPlayedFolder, lastPlayedTrack);
+  }
+  else
+  {
+    // Console.println(F("No track to resume"));
+  }
+}
+
+void increaseVolume()
+{
+  if (currentVolume < 30)
+  {
+    currentVolume++;
+    queueVolume();
+    markSettingsDirty(SETTINGS_DIRTY_VOLUME);
+    playUISound(UI_SOUND_TONE3); // Play tone3 as feedback
+  }
+}
+
+void decreaseVolume()
+{
+  if (currentVolume > 0)
+  {
+    currentVolume--;
+    queueVolume();
+    markSettingsDirty(SETTINGS_DIRTY_VOLUME);
+    playUISound(UI_SOUND_TONE3); // Play tone3 as feedback
+  }
+}
+
+// -- Modes --
+
+// Everything that differs between the modes, as data: the generic handlers
+// below index MODES by the current mode instead of switching on it, so a new
+// mode is a Mode constant, a row here and its gesture table.
+
+const GestureBinding FAVORITES_GESTURES[] PROGMEM = {
+    {GESTURE_CLICK, GESTURE_BUTTON(TopRight), playFirstFavorite},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomRight), playSecondFavorite},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomLeft), playThirdFavorite},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(TopRight), changePlaybackMode},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomLeft), toggleSettingsMode},
+    {GESTURE_CHORD, GESTURE_BUTTON(BottomRight) | GESTURE_BUTTON(BottomLeft), announceCurrentMode}};
+
+// Voice, music and candids
+const GestureBinding BROWSE_GESTURES[] PROGMEM = {
+    {GESTURE_CLICK, GESTURE_BUTTON(TopRight), browseForward},
+    {GESTURE_DOUBLE_CLICK, GESTURE_BUTTON(TopRight), playRandomTrack},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomRight), browseBack},
+    {GESTURE_TRIPLE_CLICK, GESTURE_BUTTON(BottomRight), playFirstTrack},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomLeft), togglePlayPause},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(TopRight), changePlaybackMode},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomRight), favoriteCurrentTrack},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomLeft), toggleSettingsMode},
+    {GESTURE_CHORD, GESTURE_BUTTON(TopRight) | GESTURE_BUTTON(BottomRight), togglePlaybackOrder},
+    {GESTURE_CHORD, GESTURE_BUTTON(BottomRight) | GESTURE_BUTTON(BottomLeft), announceCurrentMode}};
+
+const GestureBinding PLAYLIST_GESTURES[] PROGMEM = {
+    {GESTURE_CLICK, GESTURE_BUTTON(TopRight), playlistForward},
+    {GESTURE_DOUBLE_CLICK, GESTURE_BUTTON(TopRight), nextPlaylist},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomRight), playlistBack},
+    {GESTURE_TRIPLE_CLICK, GESTURE_BUTTON(BottomRight), playlistStart},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomLeft), togglePlayPause},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(TopRight), changePlaybackMode},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomRight), favoriteCurrentTrack},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomLeft), toggleSettingsMode},
+    {GESTURE_CHORD, GESTURE_BUTTON(BottomRight) | GESTURE_BUTTON(BottomLeft), announceCurrentMode}};
+
+const GestureBinding SETTINGS_GESTURES[] PROGMEM = {
+    {GESTURE_CLICK, GESTURE_BUTTON(TopRight), settingUp},
+    {GESTURE_HOLD_REPEAT, GESTURE_BUTTON(TopRight), repeatVolumeUp},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomRight), settingDown},
+    {GESTURE_HOLD_REPEAT, GESTURE_BUTTON(BottomRight), repeatVolumeDown},
+    {GESTURE_CLICK, GESTURE_BUTTON(BottomLeft), nextSetting},
+    {GESTURE_LONG_PRESS, GESTURE_BUTTON(BottomLeft), toggleSettingsMode}};
+
+struct ModeDescriptor
+{
+  uint8_t folder;                 // content folder browsed in the mode, 0 for none
+  uint8_t announce;               // UISound played on entering the mode
+  uint8_t next;                   // Mode a long press on TopRight moves on to
+  const GestureBinding *gestures; // PROGMEM
+  uint8_t gestureCount;
+};
+
+#define MODE_GESTURES(table) table, sizeof(table) / sizeof(table[0])
+
+// Indexed by Mode
+constexpr ModeDescriptor MODES[] PROGMEM = {
+    {0, UI_SOUND_FAVORITES_MODE, MODE_VOICE, MODE_GESTURES(FAVORITES_GESTURES)},
+    {Voice, UI_SOUND_VOICE_MODE, MODE_MUSIC, MODE_GESTURES(BROWSE_GESTURES)},
+    {Music, UI_SOUND_MUSIC_MODE, MODE_CANDIDS, MODE_GESTURES(BROWSE_GESTURES)},
+    {Candids, UI_SOUND_CANDIDS_MODE, MODE_PLAYLISTS, MODE_GESTURES(BROWSE_GESTURES)},
+    {0, UI_SOUND_PLAYLISTS_MODE, MODE_FAVORITES, MODE_GESTURES(PLAYLIST_GESTURES)},
+    {0, UI_SOUND_SETTINGS_MODE, MODE_SETTINGS, MODE_GESTURES(SETTINGS_GESTURES)}};
+
+static_assert(sizeof(MODES) / sizeof(MODES[0]) == MODE_COUNT, "one MODES row per Mode");
+
+// Content folder browsed in a mode, 0 for modes without one
+uint8_t modeFolder(Mode mode)
+{
+  return pgm_read_byte(&MODES[mode].folder);
+}
+
+void announceCurrentMode()
+{
+  playUISound((UISound)pgm_read_byte(&MODES[currentMode].announce));
+}
+
+// Move on to the next mode in the cycle
+void changePlaybackMode()
+{
+  Mode next = (Mode)pgm_read_byte(&MODES[currentMode].next);
+  if (next == currentMode)
+    return;
+  currentMode = next;
+  announceCurrentMode();
+  lastPlayedTrack = 0;
+  markSettingsDirty(SETTINGS_DIRTY_MODE);
+}
+
+void enterSettingsMode()
+{
+  previousMode = currentMode;
+  currentMode = MODE_SETTINGS;
+  // Initialize settings submenu state and provide feedback
+  currentSetting = SET_VOLUME;
+  announceCurrentMode();
+  queuePrompt(1000, announceVolumeSetting);
+}
+
+void exitSettingsMode()
+{
+  currentMode = previousMode;
+  announceCurrentMode();
+  lastPlayedTrack = 0;
+}
+
+void toggleSettingsMode()
+{
+  if (currentMode != MODE_SETTINGS)
+    enterSettingsMode();
+  else
+    exitSettingsMode();
+}
+
+void playRandomTrack()
+{
+  playRandomFromFolder(modeFolder(currentMode));
+}
+
+void playNextTrack()
+{
+  uint8_t folder = modeFolder(currentMode);
+  if (folder > 0)
+    playBrowsedTrack(playNextTrack, folder, nextIndexedTrack(folder, lastPlayedTrack));
+}
+
+void playPreviousTrack()
+{
+  uint8_t folder = modeFolder(currentMode);
+  if (folder > 0)
+    playBrowsedTrack(playPreviousTrack, folder, previousIndexedTrack(folder, lastPlayedTrack));
+}
+
+void replayLastTrack()
+{
+  uint8_t folder = modeFolder(currentMode);
+  if (folder > 0 && lastPlayedTrack > 0)
+    playFolderTrack(folder, lastPlayedTrack);
+}
+
+// -- Gestures --
+
+// The action bound to a gesture in the current mode, or NULL
+TaskCallback findGesture(uint8_t gesture, uint8_t buttons)
+{
+  const GestureBinding *bindings = (const GestureBinding *)pgm_read_ptr(&MODES[currentMode].gestures);
+  uint8_t count = pgm_read_byte(&MODES[currentMode].gestureCount);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    const GestureBinding *binding = &bindings[i];
+    if (pgm_read_byte(&binding->gesture) == gesture && pgm_read_byte(&binding->buttons) == buttons)
+      return (TaskCallback)pgm_read_ptr(&binding->action);
+  }
+  return NULL;
+}
+
+bool runGesture(uint8_t gesture, uint8_t buttons)
+{
+  TaskCallback action = findGesture(gesture, buttons);
+  if (!action)
+    return false;
+  cancelPrompt(); // user input supersedes a queued announcement
+  action();
+  return true;
+}
+
+// Run the hold-repeats of a held button that are due by `until`. Counting
+// them from the press time keeps the rate steady however late loop() is.
+void runHoldRepeats(uint8_t button, unsigned long until)
+{
+  unsigned long heldMs = until - gestureDownAt[button];
+  if (heldMs < GESTURE_REPEAT_DELAY_MS || !findGesture(GESTURE_HOLD_REPEAT, GESTURE_BUTTON(button)))
+    return;
+  unsigned long due = 1 + (heldMs - GESTURE_REPEAT_DELAY_MS) / GESTURE_REPEAT_MS;
+  while (gestureRepeats[button] < due && gestureRepeats[button] < 0xFFFF)
+  {
+    gestureRepeats[button]++;
+    gestureConsumed |= GESTURE_BUTTON(button);
+    runGesture(GESTURE_HOLD_REPEAT, GESTURE_BUTTON(button));
+  }
+}
+
+void onButtonEvent(const ButtonEvent &event)
+{
+  noteActivity();
+  if (event.type == BUTTON_DOWN)
+  {
+    // Only the waking press counts towards the wake latency
+    wakeAudioPending = wakePressPending;
+    wakePressPending = false;
+    wakePressAt = event.atMs;
+  }
+  uint8_t bit = GESTURE_BUTTON(event.button);
+  switch (event.type)
+  {
+  case BUTTON_DOWN:
+    gestureConsumed &= ~bit;
+    gestureDownAt[event.button] = event.atMs;
+    gestureRepeats[event.button] = 0;
+    // A chord runs as soon as its second button goes down
+    if (gestureHeld && !(gestureHeld & gestureConsumed) && runGesture(GESTURE_CHORD, gestureHeld | bit))
+      gestureConsumed |= gestureHeld | bit;
+    gestureHeld |= bit;
+    break;
+  case BUTTON_UP:
+    runHoldRepeats(event.button, event.atMs);
+    gestureHeld &= ~bit;
+    break;
+  case BUTTON_CLICK:
+    if (gestureConsumed & bit)
+      break;
+    if (event.clicks == 2 && runGesture(GESTURE_DOUBLE_CLICK, bit))
+      break;
+    if (event.clicks == 3 && runGesture(GESTURE_TRIPLE_CLICK, bit))
+      break;
+    runGesture(GESTURE_CLICK, bit);
+    break;
+  case BUTTON_LONG_PRESS:
+    if (!(gestureConsumed & bit))
+      runGesture(GESTURE_LONG_PRESS, bit);
+    break;
+  default:
+    break;
+  }
+}
+
+// Hold-repeats of the buttons still down; called every loop()
+void serviceGestures()
+{
+  unsigned long now = halMillis();
+  for (uint8_t i = 0; i < HAL_BUTTON_COUNT; i++)
+    if (gestureHeld & GESTURE_BUTTON(i))
+      runHoldRepeats(i, now);
+}
+
+void playFirstFavorite()
+{
+  playFavorite(0);
+}
+
+void playSecondFavorite()
+{
+  playFavorite(1);
+}
+
+void playThirdFavorite()
+{
+  playFavorite(2);
+}
+
+void browseForward()
+{
+  if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_SEQUENTIAL)
+    playNextTrack();
+  else
+    playRandomTrack();
+}
+
+void browseBack()
+{
+  if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_SEQUENTIAL)
+    playPreviousTrack();
+  else
+    replayLastTrack();
+}
+
+// Back to the start of the mode's folder
+void playFirstTrack()
+{
+  lastPlayedTrack = 0;
+  playNextTrack();
+}
+
+void setPlaybackOrder(int order)
+{
+  currentPlaybackOrderMode = order;
+  markSettingsDirty(SETTINGS_DIRTY_ORDER);
+  playUISound(order == PLAYBACK_ORDER_MODE_SEQUENTIAL ? UI_SOUND_SEQUENTIAL_PLAYBACK : UI_SOUND_RANDOM_PLAYBACK);
+}
+
+void togglePlaybackOrder()
+{
+  setPlaybackOrder(currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_SEQUENTIAL ? PLAYBACK_ORDER_MODE_RANDOM
+                                                                              : PLAYBACK_ORDER_MODE_SEQUENTIAL);
+}
+
+// Settings: TopRight and BottomRight change the selected setting
+void settingUp()
+{
+  if (currentSetting == SET_VOLUME)
+    increaseVolume();
+  else if (currentSetting == SET_PLAYBACK_ORDER_MODE)
+    setPlaybackOrder(PLAYBACK_ORDER_MODE_SEQUENTIAL);
+}
+
+void settingDown()
+{
+  if (currentSetting == SET_VOLUME)
+    decreaseVolume();
+  else if (currentSetting == SET_PLAYBACK_ORDER_MODE)
+    setPlaybackOrder(PLAYBACK_ORDER_MODE_RANDOM);
+}
+
+void repeatVolumeUp()
+{
+  if (currentSetting == SET_VOLUME)
+    increaseVolume();
+}
+
+void repeatVolumeDown()
+{
+  if (currentSetting == SET_VOLUME)
+    decreaseVolume();
+}
+
+// Settings: BottomLeft cycles through the options
+void nextSetting()
+{
+  currentSetting = (SettingsOption)((currentSetting + 1) % SETTING_COUNT);
+  // Provide audio feedback for the newly selected setting
+  switch (currentSetting)
+  {
+  case SET_VOLUME:
+    playUISound(UI_SOUND_SETTINGS_VOLUME_MODE);
+    break;
+  case SET_PLAYBACK_ORDER_MODE:
+    playUISound(UI_SOUND_SETTINGS_PLAYBACK_ORDER_MODE);
+    break;
+  default:
+    playUISound(UI_SOUND_SETTINGS_MODE);
+    break;
+  }
+}
+
+// Position within the resume track, as far as it is known
+uint32_t resumePosition()
+{
+  if (lastPlayedFolder != resumeFolder || lastPlayedTrack != resumeTrack)
+    return 0;
+  if (playbackState == PLAYBACK_PLAYING)
+    return halMillis() - playbackStartedAt;
+  if (playbackState == PLAYBACK_PAUSED)
+    return playbackPausedAt - playbackStartedAt;
+  return 0;
+}
+
+// Record which settings changed and (re)start the quiet period before they
+// are written. Cheap enough to call from button handlers.
+void markSettingsDirty(uint8_t fields)
+{
+  settingsDirty |= fields;
+  cancelTask(settingsSaveTask);
+  settingsSaveTask = scheduleOnce(SETTINGS_SAVE_DELAY, flushSettings);
+}
+
+// Write pending changes now; runs from the scheduler or before sleep
+void flushSettings()
+{
+  cancelTask(settingsSaveTask);
+  settingsSaveTask = -1;
+  if (settingsDirty == 0)
+    return;
+  if (settingsDirty & SETTINGS_DIRTY_POSITION)
+    resumePositionMs = resumePosition() / RESUME_POSITION_STEP * RESUME_POSITION_STEP;
+  settingsDirty = 0;
+  saveSettings();
+}
+
+void saveSettings()
+{
+  PROFILE_SCOPE(PROFILE_FLASH);
+  DeviceSettings s;
+  s.volume = currentVolume;
+  s.playbackOrderMode = currentPlaybackOrderMode;
+  s.version = SETTINGS_VERSION;
+  s.continuousMode = currentContinuousMode;
+  s.lastMode = currentMode == MODE_SETTINGS ? previousMode : currentMode;
+  s.lastFolder = resumeFolder;
+  s.lastTrack = resumeTrack;
+  s.bootOptions = bootOptions;
+  s.resumePositionMs = resumePositionMs;
+  // The journal skips the write if nothing changed
+  settingsJournal.write(&s, sizeof(s), SETTINGS_VERSION);
+}
+
+DeviceSettings loadSettings()
+{
+  DeviceSettings s;
+  uint8_t version = 0;
+  settingsJournal.begin();
+  // Fields missing from an older record stay erased (0xFF) and get their
+  // defaults below; a record from a newer layout is not trusted at all
+  memset(&s, 0xFF, sizeof(s));
+  if (settingsJournal.read(&s, sizeof(s), &version) == 0 || version > SETTINGS_VERSION)
+    memset(&s, 0xFF, sizeof(s));
+  // Validate and provide sensible defaults if uninitialized
+  if (s.volume < 1 || s.volume > 30)
+  {
+    s.volume = DEFAULT_VOLUME;
+  }
+  if (s.playbackOrderMode > PLAYBACK_ORDER_MODE_RANDOM)
+  {
+    s.playbackOrderMode = PLAYBACK_ORDER_MODE_SEQUENTIAL;
+  }
+  if (s.continuousMode > CONTINUOUS_REPEAT_ALL)
+  {
+    s.continuousMode = DEFAULT_CONTINUOUS_MODE;
+  }
+  if (s.lastMode >= MODE_SETTINGS)
+  {
+    s.lastMode = MODE_FAVORITES;
+  }
+  if (s.lastFolder > NUM_FOLDERS || s.lastFolder == UI || s.lastTrack > MAX_TRACKS_PER_FOLDER)
+  {
+    s.lastFolder = 0;
+    s.lastTrack = 0;
+  }
+  if (s.lastFolder == 0 || s.resumePositionMs == 0xFFFFFFFFUL)
+  {
+    s.resumePositionMs = 0;
+  }
+  if (s.bootOptions & ~BOOT_SKIP_JINGLE)
+  {
+    s.bootOptions = 0;
+  }
+  s.version = SETTINGS_VERSION;
+  return s;
+}
+
+// -- Idle sleep --
+
+// Input arrived: restart the idle time, and if the module is being put to
+// sleep, wake it before the input's own commands go out
+void noteActivity()
+{
+  idleSince = halMillis();
+  if (idleState == IDLE_PLAYER_SLEEPING)
+  {
+    idleState = IDLE_AWAKE;
+    queuePlayerCommand(PLAYER_CMD_OUTPUT_DEVICE, DFPLAYER_DEVICE_SD);
+  }
+}
+
+// Called at the end of loop(). Anything playing, queued for the module,
+// scheduled or held keeps the board awake; pending saves are scheduled
+// tasks, so they are written before it sleeps.
+void serviceIdle()
+{
+  unsigned long now = halMillis();
+  bool playerBusy = playerQueueCount > 0 || playerAwaitingAck;
+  if (idleSleepMs == 0 || playbackState == PLAYBACK_PLAYING || gestureHeld != 0 || tasksPending() ||
+      (idleState == IDLE_AWAKE && playerBusy))
+  {
+    idleSince = now;
+    return;
+  }
+  if (now - idleSince < idleSleepMs)
+    return;
+
+  if (idleState == IDLE_AWAKE)
+  {
+    queuePlayerCommand(PLAYER_CMD_SLEEP, 0);
+    idleState = IDLE_PLAYER_SLEEPING;
+  }
+  else if (!playerBusy)
+    sleepUntilPressed();
+}
+
+// The module has taken its sleep command: stop the MCU until a button wakes
+// it. The module is woken straight away, so it is ready by the time the
+// waking press has been classified (a click only completes on release).
+void sleepUntilPressed()
+{
+  playbackState = PLAYBACK_STOPPED; // a paused track does not survive the module sleeping
+  idleSleeps++;
+  wakeAudioPending = false;
+  halSleep();
+  wakePressPending = true;
+  idleState = IDLE_AWAKE;
+  idleSince = halMillis();
+  queuePlayerCommand(PLAYER_CMD_OUTPUT_DEVICE, DFPLAYER_DEVICE_SD);
+}
+
+#ifdef LATENCY_BENCH
+// -- Latency benchmark --
+
+// Put the player in the scenario's mode and schedule the next press, or
+// report the scenario once it has all its samples
+void benchNextSample()
+{
+  if (benchSampleCount + benchMisses >= benchSamplesWanted)
+  {
+    benchReport();
+    benchScenario++;
+    benchSampleCount = 0;
+    benchMisses = 0;
+    if (benchScenario >= BENCH_SCENARIO_COUNT)
+    {
+      benchScenario = BENCH_IDLE;
+      currentMode = benchSavedMode;
+      currentVolume = benchSavedVolume;
+      queueVolume();
+      return;
+    }
+  }
+
+  Mode mode = (Mode)pgm_read_byte(&BENCH_SCENARIOS[benchScenario].mode);
+  if (mode == MODE_SETTINGS)
+  {
+    previousMode = MODE_MUSIC;
+    currentSetting = SET_VOLUME;
+  }
+  currentMode = mode;
+  currentVolume = benchSavedVolume; // the settings scenarios step it
+  cancelPrompt();
+  scheduleOnce(BENCH_SETTLE_MS, benchPress);
+}
+
+void benchPress()
+{
+  uint8_t button = pgm_read_byte(&BENCH_SCENARIOS[benchScenario].button);
+  uint16_t holdMs = pgm_read_word(&BENCH_SCENARIOS[benchScenario].holdMs);
+  halButtonInject(button, true);
+  benchReleased = false;
+  if (holdMs > BUTTON_LONG_PRESS_MS)
+  {
+    // The long-press handler runs once the hold threshold has passed
+    benchStartCycles = halCycles() + (uint32_t)BUTTON_LONG_PRESS_MS * 1000 * HAL_CYCLES_PER_US;
+    benchArmed = true;
+    halProbe(true);
+  }
+  scheduleOnce(holdMs, benchRelease);
+}
+
+void benchRelease()
+{
+  uint8_t button = pgm_read_byte(&BENCH_SCENARIOS[benchScenario].button);
+  halButtonInject(button, false);
+  benchReleased = true;
+  if (pgm_read_word(&BENCH_SCENARIOS[benchScenario].holdMs) <= BUTTON_LONG_PRESS_MS)
+  {
+    benchStartCycles = halCycles();
+    benchArmed = true;
+    halProbe(true);
+  }
+  if (benchArmed)
+    benchTimeoutTask = scheduleOnce(BENCH_TIMEOUT_MS, benchTimedOut);
+  else
+    scheduleOnce(0, benchNextSample); // long press already answered
+}
+
+void benchTimedOut()
+{
+  benchTimeoutTask = -1;
+  benchArmed = false;
+  benchMisses++;
+  halProbe(false);
+  benchNextSample();
+}
+
+// Called for every frame written to the module
+void benchFrameSent()
+{
+  uint32_t elapsed = halCycles() - benchStartCycles;
+  if (!benchArmed || (int32_t)elapsed < 0)
+    return;
+  halProbe(false);
+  benchArmed = false;
+  benchLatencyUs[benchSampleCount++] = elapsed / HAL_CYCLES_PER_US;
+  if (benchReleased)
+  {
+    cancelTask(benchTimeoutTask);
+    benchTimeoutTask = -1;
+    scheduleOnce(0, benchNextSample);
+  }
+}
+
+// Nearest-rank percentiles of the scenario's samples, as a CSV row
+void benchReport()
+{
+  for (uint8_t i = 1; i < benchSampleCount; i++)
+  {
+    uint32_t value = benchLatencyUs[i];
+    uint8_t j = i;
+    for (; j > 0 && benchLatencyUs[j - 1] > value; j--)
+      benchLatencyUs[j] = benchLatencyUs[j - 1];
+    benchLatencyUs[j] = value;
+  }
+
+  Console.print(F(BENCH_STRING(BENCH_BUILD_ID)));
+  Console.print(',');
+  Console.print((const __FlashStringHelper *)BENCH_SCENARIOS[benchScenario].name);
+  Console.print(',');
+  Console.print(benchSampleCount);
+  Console.print(',');
+  Console.print(benchMisses);
+  if (benchSampleCount == 0)
+  {
+    Console.println(F(",,,"));
     return;
   }
+  Console.print(',');
+  Console.print(benchLatencyUs[(benchSampleCount * 50 + 99) / 100 - 1]);
+  Console.print(',');
+  Console.print(benchLatencyUs[(benchSampleCount * 99 + 99) / 100 - 1]);
+  Console.print(',');
+  Console.println(benchLatencyUs[benchSampleCount - 1]);
+}
+
+void cmdBench(const char *arg1, const char *arg2)
+{
+  if (benchScenario != BENCH_IDLE)
+    return;
+  int samples = arg1 ? atoi(arg1) : BENCH_DEFAULT_SAMPLES;
+  if (samples < 1)
+    samples = 1;
+  if (samples > BENCH_MAX_SAMPLES)
+    samples = BENCH_MAX_SAMPLES;
+  benchSamplesWanted = samples;
+  benchSavedMode = currentMode;
+  benchSavedVolume = currentVolume;
+  benchScenario = 0;
+  benchSampleCount = 0;
+  benchMisses = 0;
+  Console.println(F("build,scenario,samples,misses,p50_us,p99_us,max_us"));
+  benchNextSample();
+}
+#endif
+
+#ifdef LOOP_PROFILER
+// -- Loop profiler --
+
+void profileRecord(uint8_t probe, uint32_t cycles)
+{
+  ProfileStats &stats = profileStats[probe];
+  if (stats.count == UINT32_MAX)
+    return;
+  uint32_t us = cycles / HAL_CYCLES_PER_US;
+  uint8_t bucket = us < 2 ? 0 : sizeof(unsigned long) * 8 - 1 - __builtin_clzl(us);
+  if (bucket >= PROFILE_BUCKETS)
+    bucket = PROFILE_BUCKETS - 1;
+  stats.count++;
+  stats.totalUs += us;
+  if (us > stats.maxUs)
+    stats.maxUs = us;
+  stats.buckets[bucket]++;
+}
+
+// Called at the top of loop(): the time since the previous call is one
+// iteration, including anything the core runs between iterations
+void profileLoopStart()
+{
+  uint32_t now = halCycles();
+  if (profileLoopStarted)
+    profileRecord(PROFILE_LOOP, now - profileLoopStartedAt);
+  profileLoopStartedAt = now;
+  profileLoopStarted = true;
+}
+
+void profileReset()
+{
+  memset(profileStats, 0, sizeof(profileStats));
+  profileLoopStarted = false;
+}
 
-  if (currentMode == MODE_FAVORITES)
+void cmdStats(const char *arg1, const char *arg2)
+{
+  if (arg1 && strcmp_P(arg1, PSTR("reset")) == 0)
   {
-    playFavorite(0);
+    profileReset();
+    Console.println(F("Stats reset"));
     return;
   }
 
-  // Default behavior for other non-settings modes
-  if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_SEQUENTIAL)
+  for (uint8_t i = 0; i < PROFILE_PROBE_COUNT; i++)
   {
-    playNextTrack();
+    const ProfileStats &stats = profileStats[i];
+    Console.print((const __FlashStringHelper *)PROFILE_PROBE_NAMES[i]);
+    Console.print(F(": "));
+    Console.print(stats.count);
+    if (stats.count == 0)
+    {
+      Console.println();
+      continue;
+    }
+    Console.print(F(", mean "));
+    Console.print((unsigned long)(stats.totalUs / stats.count));
+    Console.print(F(" us, max "));
+    Console.print(stats.maxUs);
+    Console.print(F(" us"));
+    if (i == PROFILE_LOOP && stats.totalUs > 0)
+    {
+      Console.print(F(", "));
+      Console.print((unsigned long)(stats.count * 1000000ULL / stats.totalUs));
+      Console.print(F("/s"));
+    }
+    Console.println();
+
+    // Non-empty buckets, labelled by their upper bound
+    Console.print(' ');
+    for (uint8_t b = 0; b < PROFILE_BUCKETS; b++)
+    {
+      if (stats.buckets[b] == 0)
+        continue;
+      Console.print(b == PROFILE_BUCKETS - 1 ? F(" >=") : F(" <"));
+      Console.print(1UL << (b == PROFILE_BUCKETS - 1 ? b : b + 1));
+      Console.print(':');
+      Console.print(stats.buckets[b]);
+    }
+    Console.println();
   }
-  else if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM)
+  profileLoopStarted = false; // printing is not a loop iteration
+}
+#endif
+
+// -- Serial commands --
+
+// Each command's handler receives up to two whitespace-separated arguments
+// (NULL when absent); minArgs are checked before it is called.
+typedef void (*SerialCommandHandler)(const char *arg1, const char *arg2);
+
+struct SerialCommand
+{
+  char name[11];
+  uint8_t minArgs;
+  const char *usage; // PROGMEM, shown by help
+  SerialCommandHandler handler;
+};
+
+// Run one control command for either protocol. Returns a ControlResult.
+uint8_t runControlCommand(uint8_t id, uint16_t arg1, uint16_t arg2)
+{
+  bool queued = true;
+  switch (id)
   {
-    playRandomTrack();
+  case CONTROL_PLAY:
+    queued = playUnknownTrack(PLAYER_CMD_PLAY, arg1);
+    break;
+  case CONTROL_PLAY_FOLDER:
+    if (arg1 == 0 || arg1 > 0xFF || arg2 == 0 || arg2 > 0xFF)
+      return CONTROL_ERR_ARGS;
+    playUnbrowsedTrack();
+    queued = playFolderTrack(arg1, arg2);
+    break;
+  case CONTROL_NEXT:
+    queued = playUnknownTrack(PLAYER_CMD_NEXT, 0);
+    break;
+  case CONTROL_PREVIOUS:
+    queued = playUnknownTrack(PLAYER_CMD_PREVIOUS, 0);
+    break;
+  case CONTROL_PAUSE:
+    pausePlayback();
+    break;
+  case CONTROL_RESUME:
+    resumePlayback();
+    break;
+  case CONTROL_STOP:
+    queued = queuePlayerCommand(PLAYER_CMD_STOP, 0);
+    playbackState = PLAYBACK_STOPPED;
+    break;
+  case CONTROL_VOLUME:
+    if (arg1 > 30)
+      return CONTROL_ERR_ARGS;
+    currentVolume = arg1;
+    queued = queueVolume();
+    markSettingsDirty(SETTINGS_DIRTY_VOLUME);
+    break;
+  case CONTROL_VOLUME_UP:
+    increaseVolume();
+    break;
+  case CONTROL_VOLUME_DOWN:
+    decreaseVolume();
+    break;
+  case CONTROL_EQ:
+    if (arg1 > DFPLAYER_EQ_BASS)
+      return CONTROL_ERR_ARGS;
+    currentEq = arg1;
+    queued = queuePlayerCommand(PLAYER_CMD_EQ, arg1);
+    break;
+  case CONTROL_LOOP_FOLDER:
+    queued = queuePlayerCommand(PLAYER_CMD_LOOP_FOLDER, arg1);
+    break;
+  case CONTROL_SLEEP:
+    settingsDirty |= SETTINGS_DIRTY_POSITION;
+    flushSettings(); // while the resume position is still known
+    queued = queuePlayerCommand(PLAYER_CMD_SLEEP, 0);
+    playbackState = PLAYBACK_STOPPED;
+    break;
+  case CONTROL_RESET:
+    queued = queuePlayerCommand(PLAYER_CMD_RESET, 0);
+    playerVolume = PLAYER_VOLUME_UNKNOWN; // back to the module's default
+    playbackState = PLAYBACK_STOPPED;
+    break;
+  case CONTROL_REPEAT:
+    if (arg1 > CONTINUOUS_REPEAT_ALL)
+      return CONTROL_ERR_ARGS;
+    currentContinuousMode = arg1;
+    prepareNextTrack();
+    markSettingsDirty(SETTINGS_DIRTY_CONTINUOUS);
+    break;
+  case CONTROL_PLAYLIST_ADD:
+    if (!addPlaylistEntry(arg1 - 1, arg2 >> 8, arg2 & 0xFF))
+      return CONTROL_ERR_ARGS;
+    break;
+  case CONTROL_PLAYLIST_REMOVE:
+    if (!removePlaylistEntry(arg1 - 1, arg2 - 1))
+      return CONTROL_ERR_ARGS;
+    break;
+  case CONTROL_PLAYLIST_CLEAR:
+    if (!clearPlaylist(arg1 - 1))
+      return CONTROL_ERR_ARGS;
+    break;
+  case CONTROL_FAVORITE:
+    if (!setFavorite(arg1 - 1, arg2 >> 8, arg2 & 0xFF))
+      return CONTROL_ERR_ARGS;
+    break;
+  case CONTROL_STATUS:
+    break;
+  default:
+    return CONTROL_ERR_UNKNOWN;
   }
+  return queued ? CONTROL_OK : CONTROL_ERR_BUSY;
 }
 
-void button1longPressed()
+void cmdPlay(const char *arg1, const char *arg2)
 {
-  changePlaybackMode();
+  int track = atoi(arg1);
+  runControlCommand(CONTROL_PLAY, track, 0);
+  Console.print(F("CMD: play "));
+  Console.println(track);
 }
 
-void button2ISR()
+void cmdPlayFolder(const char *arg1, const char *arg2)
 {
-  button2.read();
+  int folder = atoi(arg1);
+  int file = atoi(arg2);
+  runControlCommand(CONTROL_PLAY_FOLDER, folder, file);
+  Console.print(F("CMD: playfolder "));
+  Console.print(folder);
+  Console.print(' ');
+  Console.println(file);
 }
 
-void button2Pressed()
+void cmdNext(const char *arg1, const char *arg2)
 {
-  if (currentMode == MODE_SETTINGS)
+  runControlCommand(CONTROL_NEXT, 0, 0);
+  Console.println(F("CMD: next"));
+}
+
+void cmdPrevious(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_PREVIOUS, 0, 0);
+  Console.println(F("CMD: previous"));
+}
+
+void cmdPause(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_PAUSE, 0, 0);
+  Console.println(F("CMD: pause"));
+}
+
+void cmdResume(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_RESUME, 0, 0);
+  Console.println(F("CMD: start/resume"));
+}
+
+void cmdStop(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_STOP, 0, 0);
+  Console.println(F("CMD: stop"));
+}
+
+void cmdVolume(const char *arg1, const char *arg2)
+{
+  int v = atoi(arg1);
+  if (v < 0)
+    v = 0;
+  if (v > 30)
+    v = 30;
+  runControlCommand(CONTROL_VOLUME, v, 0);
+  Console.print(F("CMD: volume "));
+  Console.println(v);
+}
+
+void cmdVolumeUp(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_VOLUME_UP, 0, 0);
+  Console.println(F("CMD: volumeUp"));
+}
+
+void cmdVolumeDown(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_VOLUME_DOWN, 0, 0);
+  Console.println(F("CMD: volumeDown"));
+}
+
+struct EqPreset
+{
+  char name[8];
+  uint8_t value;
+};
+
+const EqPreset EQ_PRESETS[] PROGMEM = {
+    {"normal", DFPLAYER_EQ_NORMAL},
+    {"pop", DFPLAYER_EQ_POP},
+    {"rock", DFPLAYER_EQ_ROCK},
+    {"jazz", DFPLAYER_EQ_JAZZ},
+    {"classic", DFPLAYER_EQ_CLASSIC},
+    {"bass", DFPLAYER_EQ_BASS}};
+
+void cmdEq(const char *arg1, const char *arg2)
+{
+  for (uint8_t i = 0; i < sizeof(EQ_PRESETS) / sizeof(EQ_PRESETS[0]); i++)
   {
-    // Behavior depends on which setting is currently selected
-    if (currentSetting == SET_VOLUME)
+    if (strcmp_P(arg1, EQ_PRESETS[i].name) == 0)
     {
-      decreaseVolume();
+      runControlCommand(CONTROL_EQ, pgm_read_byte(&EQ_PRESETS[i].value), 0);
+      Console.print(F("CMD: eq "));
+      Console.println(arg1);
+      return;
     }
-    else if (currentSetting == SET_PLAYBACK_ORDER_MODE)
+  }
+  Console.println(F("ERR: unknown eq value"));
+}
+
+void cmdLoopFolder(const char *arg1, const char *arg2)
+{
+  int f = atoi(arg1);
+  runControlCommand(CONTROL_LOOP_FOLDER, f, 0);
+  Console.print(F("CMD: loopFolder "));
+  Console.println(f);
+}
+
+void cmdSleep(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_SLEEP, 0, 0);
+  Console.println(F("CMD: sleep"));
+}
+
+void cmdReset(const char *arg1, const char *arg2)
+{
+  runControlCommand(CONTROL_RESET, 0, 0);
+  Console.println(F("CMD: reset"));
+}
+
+// Report the state the firmware tracks; querying the module would block
+const char CONTINUOUS_MODE_NAMES[][7] PROGMEM = {"off", "folder", "one", "all"};
+
+void cmdRepeat(const char *arg1, const char *arg2)
+{
+  for (uint8_t i = 0; i <= CONTINUOUS_REPEAT_ALL; i++)
+  {
+    if (strcmp_P(arg1, CONTINUOUS_MODE_NAMES[i]) == 0)
     {
-      currentPlaybackOrderMode = PLAYBACK_ORDER_MODE_RANDOM;
-      playUISound("random_playback");
+      runControlCommand(CONTROL_REPEAT, i, 0);
+      Console.print(F("CMD: repeat "));
+      Console.println(arg1);
+      return;
     }
-    return;
   }
+  Console.println(F("ERR: unknown repeat mode"));
+}
 
-  if (currentMode == MODE_FAVORITES)
+void cmdJingle(const char *arg1, const char *arg2)
+{
+  if (strcmp_P(arg1, PSTR("on")) == 0)
+    bootOptions &= ~BOOT_SKIP_JINGLE;
+  else if (strcmp_P(arg1, PSTR("off")) == 0)
+    bootOptions |= BOOT_SKIP_JINGLE;
+  else
   {
-    playFavorite(1);
+    Console.println(F("ERR: expected on or off"));
     return;
   }
+  markSettingsDirty(SETTINGS_DIRTY_BOOT);
+  Console.print(F("CMD: jingle "));
+  Console.println(arg1);
+}
 
-  // Default behavior for other non-settings modes
-  if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_SEQUENTIAL)
+// Boot phase timestamps, ms since reset
+void cmdBoot(const char *arg1, const char *arg2)
+{
+  Console.print(F("Boot: "));
+  Console.println(bootWasFast ? F("fast (module reset skipped)") : F("full"));
+  for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++)
   {
-    playPreviousTrack();
+    Console.print((const __FlashStringHelper *)BOOT_PHASE_NAMES[i]);
+    Console.print(F(": "));
+    if (i == BOOT_FIRST_AUDIO && bootPhaseAt[i] == 0)
+      Console.println(F("-"));
+    else
+    {
+      Console.print(bootPhaseAt[i]);
+      Console.println(F(" ms"));
+    }
   }
-  else if (currentPlaybackOrderMode == PLAYBACK_ORDER_MODE_RANDOM)
+}
+
+// Idle sleep settings and figures; `idle <ms>` changes the timeout until
+// the next reset, 0 turns sleeping off
+void cmdIdle(const char *arg1, const char *arg2)
+{
+  if (arg1)
   {
-    replayLastTrack();
+    idleSleepMs = strtoul(arg1, NULL, 10);
+    idleSince = halMillis();
+  }
+  Console.print(F("Idle: sleep after "));
+  if (idleSleepMs == 0)
+    Console.print(F("never"));
+  else
+  {
+    Console.print(idleSleepMs);
+    Console.print(F(" ms"));
+  }
+  Console.print(F(", "));
+  Console.print(idleSleeps);
+  Console.println(F(" sleeps"));
+
+  Console.print(F("WakeToAudio: "));
+  if (wakeLatencyCount == 0)
+    Console.println(F("-"));
+  else
+  {
+    Console.print(lastWakeLatencyMs);
+    Console.print(F(" ms (mean "));
+    Console.print(totalWakeLatencyMs / wakeLatencyCount);
+    Console.print(F(" ms, max "));
+    Console.print(maxWakeLatencyMs);
+    Console.println(F(" ms)"));
   }
+
+  // Supply current awake but silent and asleep, and the charge spent
+  // waiting out the timeout before each sleep
+  uint32_t awakeMicroamps = Board::awakeMicroamps + DFPLAYER_IDLE_MICROAMPS;
+  uint32_t sleepMicroamps = Board::sleepMicroamps + DFPLAYER_SLEEP_MICROAMPS;
+  Console.print(F("Budget: idle "));
+  Console.print(awakeMicroamps);
+  Console.print(F(" uA, asleep "));
+  Console.print(sleepMicroamps);
+  Console.print(F(" uA, "));
+  // Whole hours and the remainder apart, so seconds * uA cannot overflow
+  // 32 bits for long timeouts
+  uint32_t idleSeconds = idleSleepMs / 1000;
+  Console.print(idleSeconds / 3600 * awakeMicroamps + idleSeconds % 3600 * awakeMicroamps / 3600);
+  Console.println(F(" uAh idle before each sleep"));
 }
 
-void button3ISR()
+// "folder/track" as folder << 8 | track, 0 if malformed
+uint16_t parseFolderTrack(const char *arg)
 {
-  button3.read();
+  char *end;
+  unsigned long folder = strtoul(arg, &end, 10);
+  if (*end != '/' || folder > 0xFF)
+    return 0;
+  unsigned long track = strtoul(end + 1, &end, 10);
+  if (*end != '\0' || track > 0xFF)
+    return 0;
+  return (folder << 8) | track;
 }
 
-void button3Pressed()
+void printPlaylistEntry(uint8_t entry)
 {
-  // Button 3 single press behavior varies by mode.
-  if (currentMode == MODE_SETTINGS)
+  Console.print(PLAYLIST_ENTRY_FOLDER(entry));
+  Console.print('/');
+  Console.print(PLAYLIST_ENTRY_TRACK(entry));
+}
+
+// Without an argument, the length of each playlist and the favorites; with
+// one, that playlist's entries
+void cmdPlaylist(const char *arg1, const char *arg2)
+{
+  if (arg1)
   {
-    // In settings mode, cycle through available settings options
-    currentSetting = (SettingsOption)((currentSetting + 1) % SETTING_COUNT);
-    // Provide audio feedback for the newly selected setting
-    switch (currentSetting)
+    uint8_t list = atoi(arg1) - 1;
+    if (list >= PLAYLIST_COUNT)
     {
-    case SET_VOLUME:
-      // Indicate volume selection with a short tone
-      playUISound("settings_volume_mode");
-      break;
-    case SET_PLAYBACK_ORDER_MODE:
-      playUISound("settings_playback_order_mode");
-      break;
-    default:
-      playUISound("settings_mode");
-      break;
+      Console.println(F("ERR: no such playlist"));
+      return;
+    }
+    Console.print(F("Playlist "));
+    Console.print(list + 1);
+    Console.print(':');
+    for (uint8_t i = 0; i < playlists.length[list]; i++)
+    {
+      Console.print(' ');
+      printPlaylistEntry(playlistEntry(list, i));
     }
+    Console.println();
+    return;
+  }
+  for (uint8_t i = 0; i < PLAYLIST_COUNT; i++)
+  {
+    Console.print(F("Playlist "));
+    Console.print(i + 1);
+    Console.print(F(": "));
+    Console.print(playlists.length[i]);
+    Console.println(i == currentPlaylist ? F(" entries (current)") : F(" entries"));
+  }
+  Console.print(F("Favorites:"));
+  for (uint8_t i = 0; i < FAVORITE_COUNT; i++)
+  {
+    Console.print(' ');
+    if (playlists.favorites[i] == PLAYLIST_NO_ENTRY)
+      Console.print(F("default"));
+    else
+      printPlaylistEntry(playlists.favorites[i]);
+  }
+  Console.println();
+}
+
+void cmdPlaylistAdd(const char *arg1, const char *arg2)
+{
+  if (runControlCommand(CONTROL_PLAYLIST_ADD, atoi(arg1), parseFolderTrack(arg2)) != CONTROL_OK)
+  {
+    Console.println(F("ERR: playlist full or bad track"));
     return;
   }
+  Console.print(F("CMD: pladd "));
+  Console.print(arg1);
+  Console.print(' ');
+  Console.println(arg2);
+}
 
-  if (currentMode == MODE_FAVORITES)
+void cmdPlaylistRemove(const char *arg1, const char *arg2)
+{
+  if (runControlCommand(CONTROL_PLAYLIST_REMOVE, atoi(arg1), atoi(arg2)) != CONTROL_OK)
   {
-    playFavorite(2);
+    Console.println(F("ERR: no such entry"));
     return;
   }
+  Console.print(F("CMD: pldel "));
+  Console.print(arg1);
+  Console.print(' ');
+  Console.println(arg2);
+}
 
-  // Default: toggle play/pause
-  togglePlayPause();
+void cmdPlaylistClear(const char *arg1, const char *arg2)
+{
+  if (runControlCommand(CONTROL_PLAYLIST_CLEAR, atoi(arg1), 0) != CONTROL_OK)
+  {
+    Console.println(F("ERR: no such playlist"));
+    return;
+  }
+  Console.print(F("CMD: plclear "));
+  Console.println(arg1);
 }
 
-void button3longPressed()
+void cmdFavorite(const char *arg1, const char *arg2)
 {
-  toggleSettingsMode();
+  bool restoreDefault = strcmp_P(arg2, PSTR("default")) == 0;
+  uint16_t track = restoreDefault ? 0 : parseFolderTrack(arg2);
+  if ((track == 0 && !restoreDefault) || runControlCommand(CONTROL_FAVORITE, atoi(arg1), track) != CONTROL_OK)
+  {
+    Console.println(F("ERR: bad button or track"));
+    return;
+  }
+  Console.print(F("CMD: favorite "));
+  Console.print(arg1);
+  Console.print(' ');
+  Console.println(arg2);
 }
 
-void saveSettings()
+void cmdStatus(const char *arg1, const char *arg2)
 {
-  DeviceSettings s;
-  s.volume = currentVolume;
-  s.playbackOrderMode = currentPlaybackOrderMode;
-  settingsFlash.write(s);
+  Console.print(F("State: "));
+  if (playbackState == PLAYBACK_PLAYING)
+    Console.println(F("playing"));
+  else if (playbackState == PLAYBACK_PAUSED)
+    Console.println(F("paused"));
+  else
+    Console.println(F("stopped"));
+  Console.print(F("Volume: "));
+  Console.println(currentVolume);
+  Console.print(F("EQ: "));
+  Console.println(currentEq);
+  Console.print(F("CurrentFile: "));
+  Console.print(lastPlayedFolder);
+  Console.print('/');
+  Console.println(lastPlayedTrack);
+  Console.print(F("Repeat: "));
+  Console.println((const __FlashStringHelper *)CONTINUOUS_MODE_NAMES[currentContinuousMode]);
+  Console.print(F("TrackGap: "));
+  Console.print(lastTrackGapMs);
+  Console.print(F(" ms (max "));
+  Console.print(maxTrackGapMs);
+  Console.println(F(" ms)"));
 }
 
-DeviceSettings loadSettings()
+void cmdHelp(const char *arg1, const char *arg2);
+
+const char USAGE_NONE[] PROGMEM = "";
+const char USAGE_TRACK[] PROGMEM = " <n>";
+const char USAGE_FOLDER_FILE[] PROGMEM = " <folder> <file>";
+const char USAGE_VOLUME[] PROGMEM = " <0-30>";
+const char USAGE_EQ[] PROGMEM = " <normal|pop|rock|jazz|classic|bass>";
+const char USAGE_REPEAT[] PROGMEM = " <off|folder|one|all>";
+const char USAGE_ON_OFF[] PROGMEM = " <on|off>";
+const char USAGE_IDLE[] PROGMEM = " [ms]";
+const char USAGE_PLAYLIST[] PROGMEM = " [list]";
+const char USAGE_PLAYLIST_TRACK[] PROGMEM = " <list> <folder/track>";
+const char USAGE_PLAYLIST_POSITION[] PROGMEM = " <list> <position>";
+const char USAGE_LIST[] PROGMEM = " <list>";
+const char USAGE_FAVORITE[] PROGMEM = " <1-3> <folder/track|default>";
+#ifdef LATENCY_BENCH
+const char USAGE_BENCH[] PROGMEM = " [samples]";
+#endif
+#ifdef LOOP_PROFILER
+const char USAGE_STATS[] PROGMEM = " [reset]";
+#endif
+
+// Sorted by name for binary search; help output is generated from this table.
+const SerialCommand SERIAL_COMMANDS[] PROGMEM = {
+#ifdef LATENCY_BENCH
+    {"bench", 0, USAGE_BENCH, cmdBench},
+#endif
+    {"boot", 0, USAGE_NONE, cmdBoot},
+    {"eq", 1, USAGE_EQ, cmdEq},
+    {"favorite", 2, USAGE_FAVORITE, cmdFavorite},
+    {"help", 0, USAGE_NONE, cmdHelp},
+    {"idle", 0, USAGE_IDLE, cmdIdle},
+    {"jingle", 1, USAGE_ON_OFF, cmdJingle},
+    {"loopfolder", 1, USAGE_TRACK, cmdLoopFolder},
+    {"next", 0, USAGE_NONE, cmdNext},
+    {"pause", 0, USAGE_NONE, cmdPause},
+    {"pladd", 2, USAGE_PLAYLIST_TRACK, cmdPlaylistAdd},
+    {"play", 1, USAGE_TRACK, cmdPlay},
+    {"playfolder", 2, USAGE_FOLDER_FILE, cmdPlayFolder},
+    {"playlist", 0, USAGE_PLAYLIST, cmdPlaylist},
+    {"plclear", 1, USAGE_LIST, cmdPlaylistClear},
+    {"pldel", 2, USAGE_PLAYLIST_POSITION, cmdPlaylistRemove},
+    {"prev", 0, USAGE_NONE, cmdPrevious},
+    {"previous", 0, USAGE_NONE, cmdPrevious},
+    {"repeat", 1, USAGE_REPEAT, cmdRepeat},
+    {"reset", 0, USAGE_NONE, cmdReset},
+    {"resume", 0, USAGE_NONE, cmdResume},
+    {"sleep", 0, USAGE_NONE, cmdSleep},
+    {"start", 0, USAGE_NONE, cmdResume},
+#ifdef LOOP_PROFILER
+    {"stats", 0, USAGE_STATS, cmdStats},
+#endif
+    {"status", 0, USAGE_NONE, cmdStatus},
+    {"stop", 0, USAGE_NONE, cmdStop},
+    {"vol", 1, USAGE_VOLUME, cmdVolume},
+    {"voldown", 0, USAGE_NONE, cmdVolumeDown},
+    {"volume", 1, USAGE_VOLUME, cmdVolume},
+    {"volumedown", 0, USAGE_NONE, cmdVolumeDown},
+    {"volumeup", 0, USAGE_NONE, cmdVolumeUp},
+    {"volup", 0, USAGE_NONE, cmdVolumeUp}};
+
+#define NUM_SERIAL_COMMANDS (sizeof(SERIAL_COMMANDS) / sizeof(SERIAL_COMMANDS[0]))
+
+void cmdHelp(const char *arg1, const char *arg2)
 {
-  DeviceSettings s;
-  settingsFlash.read(s);
-  // Validate and provide sensible defaults if uninitialized
-  if (s.volume < 1 || s.volume > 30)
+  Console.print(F("Supported commands:"));
+  for (uint8_t i = 0; i < NUM_SERIAL_COMMANDS; i++)
   {
-    s.volume = DEFAULT_VOLUME;
+    Console.print(i == 0 ? F(" ") : F(", "));
+    Console.print((const __FlashStringHelper *)SERIAL_COMMANDS[i].name);
+    Console.print((const __FlashStringHelper *)pgm_read_ptr(&SERIAL_COMMANDS[i].usage));
   }
-  if (s.playbackOrderMode > PLAYBACK_ORDER_MODE_RANDOM)
+  Console.println();
+}
+
+const SerialCommand *findSerialCommand(const char *name)
+{
+  int low = 0;
+  int high = NUM_SERIAL_COMMANDS - 1;
+  while (low <= high)
   {
-    s.playbackOrderMode = PLAYBACK_ORDER_MODE_SEQUENTIAL;
+    int mid = (low + high) / 2;
+    int cmp = strcmp_P(name, SERIAL_COMMANDS[mid].name);
+    if (cmp == 0)
+      return &SERIAL_COMMANDS[mid];
+    if (cmp < 0)
+      high = mid - 1;
+    else
+      low = mid + 1;
   }
-  return s;
+  return NULL;
 }
 
-// Serial command handling moved out of loop() for clarity
-void handleSerialCommands()
+// Split off the next whitespace-separated token in place
+char *nextToken(char *&cursor)
 {
-  // Parse any incoming serial commands from the USB serial (Serial)
-  if (Serial.available())
+  while (*cursor == ' ' || *cursor == '\t')
+    cursor++;
+  if (*cursor == '\0')
+    return NULL;
+  char *token = cursor;
+  while (*cursor && *cursor != ' ' && *cursor != '\t')
+    cursor++;
+  if (*cursor)
+    *cursor++ = '\0';
+  return token;
+}
+
+// Tokenize and run one complete (already lowercased) command line
+void dispatchSerialCommand(char *line)
+{
+  char *cursor = line;
+  char *name = nextToken(cursor);
+  if (name == NULL)
+    return;
+  char *arg1 = nextToken(cursor);
+  char *arg2 = arg1 ? nextToken(cursor) : NULL;
+
+  const SerialCommand *command = findSerialCommand(name);
+  if (command == NULL)
+  {
+    Console.print(F("ERR: unknown command: "));
+    Console.println(name);
+    return;
+  }
+  uint8_t argc = arg2 ? 2 : (arg1 ? 1 : 0);
+  if (argc < pgm_read_byte(&command->minArgs))
+  {
+    Console.print(F("ERR: usage: "));
+    Console.print((const __FlashStringHelper *)command->name);
+    Console.println((const __FlashStringHelper *)pgm_read_ptr(&command->usage));
+    return;
+  }
+  SerialCommandHandler handler = (SerialCommandHandler)pgm_read_ptr(&command->handler);
+  handler(arg1, arg2);
+}
+
+// -- Binary control frames --
+
+void sendControlFrame(const uint8_t *payload, uint8_t length)
+{
+  uint16_t crc = controlCrc16(0xFFFF, length);
+  for (uint8_t i = 0; i < length; i++)
+    crc = controlCrc16(crc, payload[i]);
+  Console.write((uint8_t)CONTROL_FRAME_SYNC);
+  Console.write(length);
+  Console.write(payload, length);
+  Console.write((uint8_t)(crc >> 8));
+  Console.write((uint8_t)crc);
+}
+
+// Run every command in a frame and answer with a single reply frame
+void handleControlFrame(const uint8_t *payload, uint8_t length)
+{
+  uint8_t reply[CONTROL_MAX_PAYLOAD];
+  uint8_t replyLength = 0;
+  uint8_t i = 0;
+  while (i < length && replyLength + 2 + CONTROL_STATUS_LENGTH <= CONTROL_MAX_PAYLOAD)
   {
-    // Read a full line (ending with '\n') and handle it.
-    String line = Serial.readStringUntil('\n');
-    line.trim();
-    if (line.length() > 0)
+    uint8_t id = payload[i++];
+    int argLength = controlArgLength(id);
+    // Without a known, complete argument list the next command's boundary
+    // is unknown, so the rest of the frame is skipped
+    bool parsed = argLength >= 0 && i + argLength <= length;
+    uint8_t result = argLength < 0 ? CONTROL_ERR_UNKNOWN : CONTROL_ERR_ARGS;
+    if (parsed)
     {
-      // Handle command
-      // Convert to a c-string for simple tokenization
-      char buf[128];
-      line.toCharArray(buf, sizeof(buf));
-      // convert buffer to lowercase for case-insensitive commands
-      for (char *p = buf; *p; ++p)
-        *p = tolower((unsigned char)*p);
-      char *token = strtok(buf, " \t");
-      if (token != NULL)
+      const uint8_t *args = payload + i;
+      uint16_t arg1 = 0;
+      uint16_t arg2 = 0;
+      if (id == CONTROL_PLAY_FOLDER || id == CONTROL_PLAYLIST_REMOVE)
+      {
+        arg1 = args[0];
+        arg2 = args[1];
+      }
+      else if (argLength == 3)
       {
-        // play <track>
-        if (strcmp(token, "play") == 0)
-        {
-          char *arg = strtok(NULL, " \t");
-          if (arg)
-          {
-            int track = atoi(arg);
-            DFPlayer.play(track);
-            Serial.print(F("CMD: play "));
-            // Serial.println(track);
-          }
-          else
-          {
-            // Serial.println(F("ERR: play requires a track number"));
-          }
-        }
-        // playfolder <folder> <file>
-        else if (strcmp(token, "playfolder") == 0)
-        {
-          char *a1 = strtok(NULL, " \t");
-          char *a2 = strtok(NULL, " \t");
-          if (a1 && a2)
-          {
-            int folder = atoi(a1);
-            int file = atoi(a2);
-            DFPlayer.playFolder(folder, file);
-            Serial.print(F("CMD: playfolder "));
-            Serial.print(folder);
-            Serial.print(' ');
-            // Serial.println(file);
-          }
-          else
-          {
-            // Serial.println(F("ERR: playfolder requires folder and file"));
-          }
-        }
-        // next
-        else if (strcmp(token, "next") == 0)
-        {
-          DFPlayer.next();
-          // Serial.println(F("CMD: next"));
-        }
-        // prev | previous
-        else if (strcmp(token, "prev") == 0 || strcmp(token, "previous") == 0)
-        {
-          DFPlayer.previous();
-          // Serial.println(F("CMD: previous"));
-        }
-        // pause
-        else if (strcmp(token, "pause") == 0)
-        {
-          DFPlayer.pause();
-          // Serial.println(F("CMD: pause"));
-        }
-        // resume | start
-        else if (strcmp(token, "resume") == 0 || strcmp(token, "start") == 0)
-        {
-          DFPlayer.start();
-          // Serial.println(F("CMD: start/resume"));
-        }
-        // stop
-        else if (strcmp(token, "stop") == 0)
-        {
-          DFPlayer.stop();
-          // Serial.println(F("CMD: stop"));
-        }
-        // volume <0-30>
-        else if (strcmp(token, "volume") == 0 || strcmp(token, "vol") == 0)
-        {
-          char *a = strtok(NULL, " \t");
-          if (a)
-          {
-            int v = atoi(a);
-            if (v < 0)
-              v = 0;
-            if (v > 30)
-              v = 30;
-            DFPlayer.volume(v);
-            saveVolumeToEEPROM(v);
-            Serial.print(F("CMD: volume "));
-            // Serial.println(v);
-          }
-          else
-          {
-            // Serial.println(F("ERR: volume requires a value 0-30"));
-          }
-        }
-        // volup
-        else if (strcmp(token, "volup") == 0 || strcmp(token, "volumeup") == 0)
-        {
-          increaseVolume();
-          // Serial.println(F("CMD: volumeUp"));
-        }
-        // voldown
-        else if (strcmp(token, "voldown") == 0 || strcmp(token, "volumedown") == 0)
-        {
-          decreaseVolume();
-          // Serial.println(F("CMD: volumeDown"));
-        }
-        // eq <normal|pop|rock|jazz|classic|bass>
-        else if (strcmp(token, "eq") == 0)
-        {
-          char *a = strtok(NULL, " \t");
-          if (a)
-          {
-            if (strcmp(a, "normal") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_NORMAL);
-            else if (strcmp(a, "pop") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_POP);
-            else if (strcmp(a, "rock") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_ROCK);
-            else if (strcmp(a, "jazz") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_JAZZ);
-            else if (strcmp(a, "classic") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_CLASSIC);
-            else if (strcmp(a, "bass") == 0)
-              DFPlayer.EQ(DFPLAYER_EQ_BASS);
-            else
-            {
-              // Serial.println(F("ERR: unknown eq value"));
-              a = NULL;
-            }
-            if (a)
-            {
-              Serial.print(F("CMD: eq "));
-              // Serial.println(a);
-            }
-          }
-          else
-          {
-            // Serial.println(F("ERR: eq requires a value"));
-          }
-        }
-        // loopfolder <n>
-        else if (strcmp(token, "loopfolder") == 0)
-        {
-          char *a = strtok(NULL, " \t");
-          if (a)
-          {
-            int f = atoi(a);
-            DFPlayer.loopFolder(f);
-            Serial.print(F("CMD: loopFolder "));
-            // Serial.println(f);
-          }
-          else
-          {
-            // Serial.println(F("ERR: loopfolder requires a folder number"));
-          }
-        }
-        // sleep
-        else if (strcmp(token, "sleep") == 0)
-        {
-          DFPlayer.sleep();
-          // Serial.println(F("CMD: sleep"));
-        }
-        // reset
-        else if (strcmp(token, "reset") == 0)
-        {
-          DFPlayer.reset();
-          // Serial.println(F("CMD: reset"));
-        }
-        // status - read some info
-        else if (strcmp(token, "status") == 0)
-        {
-          Serial.print(F("State: "));
-          // Serial.println(DFPlayer.readState());
-          Serial.print(F("Volume: "));
-          // Serial.println(DFPlayer.readVolume());
-          Serial.print(F("EQ: "));
-          // Serial.println(DFPlayer.readEQ());
-          Serial.print(F("CurrentFile: "));
-          // Serial.println(DFPlayer.readCurrentFileNumber());
-        }
-        // help
-        else if (strcmp(token, "help") == 0)
-        {
-          // Serial.println(F("Supported commands: play <n>, playfolder <f> <n>, next, prev, pause, resume, stop, volume <0-30>, volup, voldown, eq <normal|pop|rock|jazz|classic|bass>, loopfolder <n>, sleep, reset, status"));
-        }
-        else
-        {
-          Serial.print(F("ERR: unknown command: "));
-          // Serial.println(token);
-        }
+        arg1 = args[0];
+        arg2 = (args[1] << 8) | args[2]; // folder, track
       }
+      else if (argLength == 2)
+        arg1 = (args[0] << 8) | args[1];
+      else if (argLength == 1)
+        arg1 = args[0];
+      i += argLength;
+      result = runControlCommand(id, arg1, arg2);
+    }
+
+    reply[replyLength++] = id;
+    reply[replyLength++] = result;
+    if (id == CONTROL_STATUS && result == CONTROL_OK)
+    {
+      reply[replyLength++] = playbackState;
+      reply[replyLength++] = currentVolume;
+      reply[replyLength++] = currentEq;
+      reply[replyLength++] = lastPlayedFolder;
+      reply[replyLength++] = lastPlayedTrack;
+      reply[replyLength++] = currentMode;
+      reply[replyLength++] = currentPlaybackOrderMode;
+      reply[replyLength++] = currentContinuousMode;
+    }
+    if (!parsed)
+      break;
+  }
+  sendControlFrame(reply, replyLength);
+}
+
+// Advance the binary frame receiver by one byte
+void feedControlFrameByte(uint8_t b)
+{
+  switch (serialParseState)
+  {
+  case SERIAL_FRAME_LENGTH:
+    if (b == 0 || b > CONTROL_MAX_PAYLOAD)
+    {
+      serialParseState = SERIAL_TEXT;
+      return;
     }
+    serialFrameLength = b;
+    serialLineLength = 0;
+    serialFrameCrc = controlCrc16(0xFFFF, b);
+    serialParseState = SERIAL_FRAME_PAYLOAD;
+    break;
+  case SERIAL_FRAME_PAYLOAD:
+    serialLine[serialLineLength++] = b;
+    serialFrameCrc = controlCrc16(serialFrameCrc, b);
+    if (serialLineLength == serialFrameLength)
+      serialParseState = SERIAL_FRAME_CRC_HIGH;
+    break;
+  case SERIAL_FRAME_CRC_HIGH:
+    serialFrameCrc ^= (uint16_t)b << 8;
+    serialParseState = SERIAL_FRAME_CRC_LOW;
+    break;
+  case SERIAL_FRAME_CRC_LOW:
+    serialFrameCrc ^= b;
+    if (serialFrameCrc == 0)
+      handleControlFrame((const uint8_t *)serialLine, serialFrameLength);
+    // A corrupt frame gets no reply; the host retries after its timeout
+    serialLineLength = 0;
+    serialParseState = SERIAL_TEXT;
+    break;
+  default:
+    serialParseState = SERIAL_TEXT;
+    break;
+  }
+}
+
+// Feed one received byte to the line parser. Lines longer than the buffer
+// are discarded whole rather than run truncated.
+void feedSerialCommandByte(char c)
+{
+  if (serialParseState != SERIAL_TEXT)
+  {
+    feedControlFrameByte(c);
+    return;
+  }
+  // A sync byte at the start of a line begins a binary control frame
+  if ((uint8_t)c == CONTROL_FRAME_SYNC && serialLineLength == 0 && !serialLineOverflow)
+  {
+    serialParseState = SERIAL_FRAME_LENGTH;
+    return;
+  }
+  if (c == '\n' || c == '\r')
+  {
+    if (!serialLineOverflow && serialLineLength > 0)
+    {
+      serialLine[serialLineLength] = '\0';
+      dispatchSerialCommand(serialLine);
+    }
+    serialLineLength = 0;
+    serialLineOverflow = false;
+    return;
+  }
+  if (serialLineLength >= SERIAL_LINE_LENGTH - 1)
+  {
+    serialLineOverflow = true;
+    return;
+  }
+  serialLine[serialLineLength++] = tolower((unsigned char)c);
+}
+
+// Consume whatever bytes the USB serial port already has; never waits for a
+// complete line or frame, so loop() keeps running while a command arrives.
+// Text commands and binary control frames are told apart per line.
+void handleSerialCommands()
+{
+  PROFILE_SCOPE(PROFILE_SERIAL);
+  // Drop a binary frame whose remaining bytes never arrived
+  if (serialParseState != SERIAL_TEXT && halMillis() - serialLastByteAt >= CONTROL_FRAME_TIMEOUT)
+  {
+    serialParseState = SERIAL_TEXT;
+    serialLineLength = 0;
+  }
+  while (Console.available())
+  {
+    serialLastByteAt = halMillis();
+    noteActivity();
+    feedSerialCommandByte(Console.read());
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,366 @@
+// Binary control protocol, end to end: tools/control_client talks to the
+// native build of the player over a pseudo-terminal pair.
+//
+// The player runs in a child process on the pty's master side, clocked in
+// real time so frame timeouts mean what they do on the board; the client
+// opens the slave side like a USB serial port. A second descriptor on the
+// slave writes frames the client would never produce (bad CRCs, truncated
+// or pipelined frames) and reads their replies.
+//
+//   pio test -e native -f test_control_protocol
+#include <unity.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hal.h"
+#include "control_client.h"
+#include "dfplayer_protocol.h"
+
+static pid_t player = -1;
+static char portPath[64];
+static ControlClient client;
+static int rawPort = -1;
+static std::vector<uint8_t> rawReceived;
+
+static long monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Run the player on the master side of a new pty until this process exits
+static bool startPlayer()
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    return false;
+  snprintf(portPath, sizeof(portPath), "%s", ptsname(master));
+
+  pid_t parent = getpid();
+  player = fork();
+  if (player < 0)
+    return false;
+  if (player == 0)
+  {
+    if (!simConsoleFd(master))
+      _exit(1);
+    simBegin(/*realTime = */ true);
+    while (getppid() == parent)
+    {
+      simStep();
+      usleep(200);
+    }
+    _exit(0);
+  }
+  close(master);
+
+  rawPort = open(portPath, O_RDWR | O_NOCTTY);
+  return rawPort >= 0 && client.open(portPath);
+}
+
+static void stopPlayer()
+{
+  client.close();
+  if (rawPort >= 0)
+    close(rawPort);
+  if (player > 0)
+  {
+    kill(player, SIGTERM);
+    waitpid(player, NULL, 0);
+  }
+}
+
+static void rawWrite(const std::vector<uint8_t> &bytes)
+{
+  TEST_ASSERT_EQUAL((ssize_t)bytes.size(), write(rawPort, bytes.data(), bytes.size()));
+}
+
+static std::vector<uint8_t> frame(std::initializer_list<uint8_t> payload)
+{
+  return encodeControlFrame(std::vector<uint8_t>(payload));
+}
+
+// Next reply frame on the raw descriptor; false if none within timeoutMs
+static bool rawReply(std::vector<ControlReply> &replies, int timeoutMs = 500)
+{
+  long deadline = monotonicMs() + timeoutMs;
+  std::vector<uint8_t> payload;
+  while (!decodeControlFrame(rawReceived, payload))
+  {
+    long remaining = deadline - monotonicMs();
+    struct pollfd pfd = {rawPort, POLLIN, 0};
+    if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0)
+      return false;
+    uint8_t buffer[128];
+    ssize_t n = read(rawPort, buffer, sizeof(buffer));
+    if (n <= 0)
+      return false;
+    rawReceived.insert(rawReceived.end(), buffer, buffer + n);
+  }
+  return parseControlReply(payload, replies);
+}
+
+// Send the client's batch, expecting it to be a single command that succeeds
+static void expectOk(uint8_t command)
+{
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_TRUE(client.send(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(command, replies[0].command);
+  TEST_ASSERT_EQUAL(CONTROL_OK, replies[0].result);
+}
+
+static ControlStatus status()
+{
+  ControlStatus s;
+  TEST_ASSERT_TRUE(client.status(s));
+  return s;
+}
+
+void setUp()
+{
+  rawReceived.clear();
+}
+
+void tearDown()
+{
+}
+
+void test_playback_opcodes_round_trip()
+{
+  client.play(1);
+  expectOk(CONTROL_PLAY);
+  client.playFolder(3, 2);
+  expectOk(CONTROL_PLAY_FOLDER);
+  ControlStatus playing = status();
+  TEST_ASSERT_EQUAL(3, playing.folder);
+  TEST_ASSERT_EQUAL(2, playing.track);
+  client.command(CONTROL_PAUSE);
+  expectOk(CONTROL_PAUSE);
+  TEST_ASSERT_EQUAL(2, status().state);
+  client.command(CONTROL_RESUME);
+  expectOk(CONTROL_RESUME);
+  TEST_ASSERT_EQUAL(1, status().state);
+  client.command(CONTROL_NEXT);
+  expectOk(CONTROL_NEXT);
+  client.command(CONTROL_PREVIOUS);
+  expectOk(CONTROL_PREVIOUS);
+  client.command(CONTROL_STOP);
+  expectOk(CONTROL_STOP);
+  TEST_ASSERT_EQUAL(0, status().state);
+  client.loopFolder(3);
+  expectOk(CONTROL_LOOP_FOLDER);
+}
+
+void test_setting_opcodes_round_trip()
+{
+  client.volume(12);
+  expectOk(CONTROL_VOLUME);
+  TEST_ASSERT_EQUAL(12, status().volume);
+  client.command(CONTROL_VOLUME_UP);
+  expectOk(CONTROL_VOLUME_UP);
+  TEST_ASSERT_EQUAL(13, status().volume);
+  client.command(CONTROL_VOLUME_DOWN);
+  expectOk(CONTROL_VOLUME_DOWN);
+  TEST_ASSERT_EQUAL(12, status().volume);
+  client.eq(DFPLAYER_EQ_JAZZ);
+  expectOk(CONTROL_EQ);
+  TEST_ASSERT_EQUAL(DFPLAYER_EQ_JAZZ, status().eq);
+  client.repeat(1); // folder
+  expectOk(CONTROL_REPEAT);
+  TEST_ASSERT_EQUAL(1, status().continuousMode);
+}
+
+void test_playlist_opcodes_round_trip()
+{
+  client.playlistAdd(1, 3, 2);
+  expectOk(CONTROL_PLAYLIST_ADD);
+  client.playlistRemove(1, 1);
+  expectOk(CONTROL_PLAYLIST_REMOVE);
+  client.playlistClear(1);
+  expectOk(CONTROL_PLAYLIST_CLEAR);
+  client.favorite(1, 3, 4);
+  expectOk(CONTROL_FAVORITE);
+  client.favorite(1, 0, 0);
+  expectOk(CONTROL_FAVORITE);
+}
+
+void test_power_opcodes_round_trip()
+{
+  client.command(CONTROL_SLEEP);
+  expectOk(CONTROL_SLEEP);
+  client.command(CONTROL_RESET);
+  expectOk(CONTROL_RESET);
+  client.command(CONTROL_STATUS);
+  expectOk(CONTROL_STATUS);
+}
+
+void test_batch_is_answered_in_command_order()
+{
+  client.volume(7);
+  client.eq(DFPLAYER_EQ_POP);
+  client.command(CONTROL_STATUS);
+  client.repeat(0);
+  client.command(CONTROL_STATUS);
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_TRUE(client.send(replies));
+  TEST_ASSERT_EQUAL(5, replies.size());
+  const uint8_t expected[] = {CONTROL_VOLUME, CONTROL_EQ, CONTROL_STATUS, CONTROL_REPEAT, CONTROL_STATUS};
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    TEST_ASSERT_EQUAL_HEX8(expected[i], replies[i].command);
+    TEST_ASSERT_EQUAL(CONTROL_OK, replies[i].result);
+  }
+  TEST_ASSERT_EQUAL(7, replies[2].status.volume);
+  TEST_ASSERT_EQUAL(DFPLAYER_EQ_POP, replies[2].status.eq);
+  TEST_ASSERT_EQUAL(1, replies[2].status.continuousMode);
+  TEST_ASSERT_EQUAL(0, replies[4].status.continuousMode);
+}
+
+void test_pipelined_frames_are_answered_in_order()
+{
+  std::vector<uint8_t> bytes = frame({CONTROL_VOLUME, 9});
+  std::vector<uint8_t> second = frame({CONTROL_STATUS});
+  std::vector<uint8_t> third = frame({CONTROL_EQ, DFPLAYER_EQ_ROCK});
+  bytes.insert(bytes.end(), second.begin(), second.end());
+  bytes.insert(bytes.end(), third.begin(), third.end());
+  rawWrite(bytes);
+
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_TRUE(rawReply(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(CONTROL_VOLUME, replies[0].command);
+  TEST_ASSERT_TRUE(rawReply(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(CONTROL_STATUS, replies[0].command);
+  TEST_ASSERT_EQUAL(9, replies[0].status.volume);
+  TEST_ASSERT_TRUE(rawReply(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(CONTROL_EQ, replies[0].command);
+}
+
+void test_late_reply_is_not_taken_for_the_next_one()
+{
+  // Answered while nobody is reading, as after a client timeout
+  rawWrite(frame({CONTROL_STATUS}));
+  usleep(100000);
+
+  client.volume(11);
+  expectOk(CONTROL_VOLUME);
+  TEST_ASSERT_EQUAL(11, status().volume);
+}
+
+void test_corrupt_crc_is_dropped_without_reply()
+{
+  client.volume(10);
+  expectOk(CONTROL_VOLUME);
+
+  std::vector<uint8_t> corrupt = frame({CONTROL_VOLUME, 5});
+  corrupt.back() ^= 0x01;
+  rawWrite(corrupt);
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_FALSE(rawReply(replies, 200));
+
+  // The next frame is parsed normally
+  TEST_ASSERT_EQUAL(10, status().volume);
+}
+
+// Module events, such as a track ending, put nothing on the port between
+// replies
+void test_track_end_sends_nothing_unsolicited()
+{
+  rawWrite(frame({CONTROL_PLAY_FOLDER, 1, 8})); // a 130 ms tone
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_TRUE(rawReply(replies));
+  TEST_ASSERT_EQUAL(CONTROL_OK, replies[0].result);
+  TEST_ASSERT_EQUAL(0, rawReceived.size());
+  struct pollfd pfd = {rawPort, POLLIN, 0};
+  TEST_ASSERT_EQUAL(0, poll(&pfd, 1, 1000));
+}
+
+void test_truncated_frame_is_dropped_after_timeout()
+{
+  client.volume(10);
+  expectOk(CONTROL_VOLUME);
+
+  std::vector<uint8_t> truncated = frame({CONTROL_VOLUME, 5});
+  truncated.resize(truncated.size() - 2); // CRC never arrives
+  rawWrite(truncated);
+  usleep((CONTROL_FRAME_TIMEOUT + 50) * 1000L);
+
+  TEST_ASSERT_EQUAL(10, status().volume);
+}
+
+void test_unknown_command_skips_rest_of_frame()
+{
+  client.command((ControlCommandId)0x7F);
+  client.volume(3);
+  std::vector<ControlReply> replies;
+  TEST_ASSERT_TRUE(client.send(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(0x7F, replies[0].command);
+  TEST_ASSERT_EQUAL(CONTROL_ERR_UNKNOWN, replies[0].result);
+  TEST_ASSERT_TRUE(status().volume != 3);
+}
+
+void test_bad_arguments_are_rejected()
+{
+  std::vector<ControlReply> replies;
+  client.volume(31);
+  TEST_ASSERT_TRUE(client.send(replies));
+  TEST_ASSERT_EQUAL(CONTROL_ERR_ARGS, replies[0].result);
+
+  client.playlistRemove(5, 1); // there are four playlists
+  TEST_ASSERT_TRUE(client.send(replies));
+  TEST_ASSERT_EQUAL(CONTROL_ERR_ARGS, replies[0].result);
+
+  // Too few argument bytes for the command
+  rawWrite(frame({CONTROL_VOLUME}));
+  TEST_ASSERT_TRUE(rawReply(replies));
+  TEST_ASSERT_EQUAL(1, replies.size());
+  TEST_ASSERT_EQUAL_HEX8(CONTROL_VOLUME, replies[0].command);
+  TEST_ASSERT_EQUAL(CONTROL_ERR_ARGS, replies[0].result);
+}
+
+void test_text_commands_share_the_port()
+{
+  const char line[] = "volume 14\n";
+  rawWrite(std::vector<uint8_t>(line, line + sizeof(line) - 1));
+  TEST_ASSERT_EQUAL(14, status().volume);
+}
+
+int main(int argc, char **argv)
+{
+  if (!startPlayer())
+  {
+    perror("starting the player on a pty");
+    stopPlayer();
+    return 1;
+  }
+  UNITY_BEGIN();
+  RUN_TEST(test_playback_opcodes_round_trip);
+  RUN_TEST(test_setting_opcodes_round_trip);
+  RUN_TEST(test_playlist_opcodes_round_trip);
+  RUN_TEST(test_power_opcodes_round_trip);
+  RUN_TEST(test_batch_is_answered_in_command_order);
+  RUN_TEST(test_pipelined_frames_are_answered_in_order);
+  RUN_TEST(test_late_reply_is_not_taken_for_the_next_one);
+  RUN_TEST(test_corrupt_crc_is_dropped_without_reply);
+  RUN_TEST(test_track_end_sends_nothing_unsolicited);
+  RUN_TEST(test_truncated_frame_is_dropped_after_timeout);
+  RUN_TEST(test_unknown_command_skips_rest_of_frame);
+  RUN_TEST(test_bad_arguments_are_rejected);
+  RUN_TEST(test_text_commands_share_the_port);
+  int failures = UNITY_END();
+  stopPlayer();
+  return failures;
+}
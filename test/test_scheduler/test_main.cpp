@@ -0,0 +1,208 @@
+// Cooperative scheduler (src/main.cpp) and a store write it defers, against
+// a fake clock.
+//
+//   pio test -e native -f test_scheduler
+#include <unity.h>
+
+#include "hal.h"
+
+// From src/main.cpp
+typedef void (*TaskCallback)();
+int scheduleOnce(unsigned long delayMs, TaskCallback callback);
+int scheduleEvery(unsigned long intervalMs, TaskCallback callback);
+void cancelTask(int id);
+void runScheduler();
+bool tasksPending();
+extern unsigned long (*schedulerClock)();
+bool setFavorite(uint8_t slot, uint8_t folder, uint8_t track);
+
+#define PLAYLIST_SAVE_DELAY 3000
+#define PLAYLIST_HEADER_SIZE 9     // PlaylistHeader: magic, four lengths, three favorites
+#define PLAYLIST_FIRST_FAVORITE 6
+
+static unsigned long fakeNow;
+static char runs[16]; // task names in the order they ran
+static uint8_t runCount;
+
+static unsigned long fakeMillis()
+{
+  return fakeNow;
+}
+
+static void record(char name)
+{
+  if (runCount < sizeof(runs) - 1)
+    runs[runCount++] = name;
+  runs[runCount] = '\0';
+}
+
+static void taskA() { record('a'); }
+static void taskB() { record('b'); }
+static void taskC() { record('c'); }
+
+// Step the fake clock a millisecond at a time up to `until`, servicing the
+// scheduler at each step as loop() would
+static void runUntil(unsigned long until)
+{
+  while (fakeNow != until)
+  {
+    fakeNow++;
+    runScheduler();
+  }
+}
+
+void setUp()
+{
+  for (int i = 0; i < Board::scheduledTasks; i++)
+    cancelTask(i);
+  schedulerClock = fakeMillis;
+  fakeNow = 1000;
+  runCount = 0;
+  runs[0] = '\0';
+}
+
+void tearDown()
+{
+}
+
+void test_one_shot_runs_once_when_due()
+{
+  TEST_ASSERT_GREATER_OR_EQUAL(0, scheduleOnce(100, taskA));
+  runUntil(1099);
+  TEST_ASSERT_EQUAL_STRING("", runs);
+  runUntil(1100);
+  TEST_ASSERT_EQUAL_STRING("a", runs);
+  runUntil(1500);
+  TEST_ASSERT_EQUAL_STRING("a", runs);
+  TEST_ASSERT_FALSE(tasksPending());
+}
+
+void test_tasks_run_in_deadline_order()
+{
+  scheduleOnce(300, taskA);
+  scheduleOnce(100, taskB);
+  scheduleOnce(200, taskC);
+  runUntil(1400);
+  TEST_ASSERT_EQUAL_STRING("bca", runs);
+}
+
+void test_tasks_due_together_run_in_scheduling_order()
+{
+  scheduleOnce(50, taskC);
+  scheduleOnce(50, taskA);
+  scheduleOnce(50, taskB);
+  fakeNow += 200; // loop() was late; all three are overdue
+  runScheduler();
+  TEST_ASSERT_EQUAL_STRING("cab", runs);
+}
+
+void test_cancelled_task_never_runs()
+{
+  int a = scheduleOnce(100, taskA);
+  scheduleOnce(150, taskB);
+  runUntil(1050);
+  cancelTask(a);
+  runUntil(1300);
+  TEST_ASSERT_EQUAL_STRING("b", runs);
+
+  // Ids that were never handed out are ignored
+  cancelTask(-1);
+  cancelTask(Board::scheduledTasks);
+  TEST_ASSERT_FALSE(tasksPending());
+}
+
+void test_cancelled_slot_is_reused()
+{
+  int a = scheduleOnce(100, taskA);
+  cancelTask(a);
+  TEST_ASSERT_EQUAL(a, scheduleOnce(100, taskB));
+}
+
+void test_full_table_returns_minus_one()
+{
+  for (int i = 0; i < Board::scheduledTasks; i++)
+    TEST_ASSERT_EQUAL(i, scheduleOnce(10 + i, taskA));
+  TEST_ASSERT_EQUAL(-1, scheduleOnce(10, taskB));
+  TEST_ASSERT_EQUAL(-1, scheduleEvery(10, taskB));
+
+  // A slot frees up as soon as its task has run
+  runUntil(1010);
+  TEST_ASSERT_EQUAL(0, scheduleOnce(10, taskB));
+}
+
+void test_rejects_missing_callback_and_zero_interval()
+{
+  TEST_ASSERT_EQUAL(-1, scheduleOnce(10, NULL));
+  TEST_ASSERT_EQUAL(-1, scheduleEvery(0, taskA));
+  TEST_ASSERT_FALSE(tasksPending());
+}
+
+void test_periodic_task_stays_phase_locked()
+{
+  int id = scheduleEvery(50, taskA);
+  runUntil(1150);
+  TEST_ASSERT_EQUAL_STRING("aaa", runs);
+
+  // A late pass runs it once and the next run keeps the original phase
+  fakeNow = 1230;
+  runScheduler();
+  TEST_ASSERT_EQUAL_STRING("aaaa", runs);
+  runUntil(1249);
+  TEST_ASSERT_EQUAL_STRING("aaaa", runs);
+  runUntil(1250);
+  TEST_ASSERT_EQUAL_STRING("aaaaa", runs);
+
+  cancelTask(id);
+  runUntil(1500);
+  TEST_ASSERT_EQUAL_STRING("aaaaa", runs);
+}
+
+void test_deadline_across_millis_wraparound()
+{
+  fakeNow = (unsigned long)-20;
+  scheduleOnce(50, taskA);
+  scheduleEvery(15, taskB);
+  runUntil((unsigned long)-1);
+  TEST_ASSERT_EQUAL_STRING("b", runs);
+  runUntil(29); // 49 ms after scheduling
+  TEST_ASSERT_EQUAL_STRING("bbb", runs);
+  runUntil(30);
+  TEST_ASSERT_EQUAL_STRING("bbba", runs);
+}
+
+// A favorite is set from a long press, so the header is only written by
+// the save task once edits have stopped, never from the handler itself
+void test_favorite_is_written_after_the_quiet_period()
+{
+  uint8_t before[PLAYLIST_HEADER_SIZE];
+  uint8_t stored[PLAYLIST_HEADER_SIZE];
+  halStoreReadAt(HAL_STORE_PLAYLISTS, 0, before, sizeof(before));
+  TEST_ASSERT_TRUE(setFavorite(0, 3, 4));
+  TEST_ASSERT_TRUE(setFavorite(0, 3, 5));
+  halStoreReadAt(HAL_STORE_PLAYLISTS, 0, stored, sizeof(stored));
+  TEST_ASSERT_EQUAL_MEMORY(before, stored, sizeof(stored));
+
+  runUntil(fakeNow + PLAYLIST_SAVE_DELAY - 1);
+  halStoreReadAt(HAL_STORE_PLAYLISTS, 0, stored, sizeof(stored));
+  TEST_ASSERT_EQUAL_MEMORY(before, stored, sizeof(stored));
+  runUntil(fakeNow + 1);
+  halStoreReadAt(HAL_STORE_PLAYLISTS, 0, stored, sizeof(stored));
+  TEST_ASSERT_EQUAL_HEX8((3 - 1) << 6 | (5 - 1), stored[PLAYLIST_FIRST_FAVORITE]);
+  TEST_ASSERT_FALSE(tasksPending());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_one_shot_runs_once_when_due);
+  RUN_TEST(test_tasks_run_in_deadline_order);
+  RUN_TEST(test_tasks_due_together_run_in_scheduling_order);
+  RUN_TEST(test_cancelled_task_never_runs);
+  RUN_TEST(test_cancelled_slot_is_reused);
+  RUN_TEST(test_full_table_returns_minus_one);
+  RUN_TEST(test_rejects_missing_callback_and_zero_interval);
+  RUN_TEST(test_periodic_task_stays_phase_locked);
+  RUN_TEST(test_deadline_across_millis_wraparound);
+  RUN_TEST(test_favorite_is_written_after_the_quiet_period);
+  return UNITY_END();
+}
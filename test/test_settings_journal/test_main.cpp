@@ -0,0 +1,306 @@
+// Settings journal (lib/SettingsJournal) on the emulated NOR flash
+// (tools/flash_emulator): wear levelling, compaction, recovery from power
+// cuts and the flash time a save costs.
+//
+//   pio test -e native -f test_settings_journal
+#include <unity.h>
+
+#include "SettingsJournal.h"
+#include "emulated_flash.h"
+
+#include <string.h>
+
+// The XIAO's geometry: four 256-byte NVM rows
+#define ROW_SIZE 256
+#define ROW_COUNT 4
+
+// Same size as DeviceSettings, so 15 records fit a row after its header and
+// the fourth (bytes 52..67) straddles the first 64-byte page boundary
+#define RECORD_LENGTH 12
+#define RECORD_VERSION 3
+#define RECORDS_PER_ROW ((ROW_SIZE - 4) / (4 + RECORD_LENGTH))
+
+struct Record
+{
+  uint8_t bytes[RECORD_LENGTH];
+};
+
+static Record record(uint32_t n)
+{
+  Record r;
+  memset(r.bytes, 0, sizeof(r.bytes));
+  memcpy(r.bytes, &n, sizeof(n));
+  r.bytes[RECORD_LENGTH - 1] = 0x5A;
+  return r;
+}
+
+// Number stored in the journal's latest record, -1 if it has none
+static int32_t latest(const EmulatedFlash &flash)
+{
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  Record r;
+  uint8_t version = 0;
+  if (journal.read(r.bytes, sizeof(r.bytes), &version) != RECORD_LENGTH)
+    return -1;
+  TEST_ASSERT_EQUAL(RECORD_VERSION, version);
+  TEST_ASSERT_EQUAL_HEX8(0x5A, r.bytes[RECORD_LENGTH - 1]);
+  uint32_t n;
+  memcpy(&n, r.bytes, sizeof(n));
+  return n;
+}
+
+static JournalWriteResult save(SettingsJournal &journal, uint32_t n)
+{
+  Record r = record(n);
+  return journal.write(r.bytes, sizeof(r.bytes), RECORD_VERSION);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_empty_journal_reads_nothing()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  TEST_ASSERT_EQUAL(-1, latest(flash));
+}
+
+void test_latest_record_survives_a_restart()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  save(journal, 1);
+  save(journal, 2);
+  save(journal, 3);
+  TEST_ASSERT_EQUAL(3, latest(flash));
+}
+
+void test_unchanged_save_writes_nothing()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  save(journal, 7);
+  uint32_t programmed = flash.bytesProgrammed();
+  TEST_ASSERT_EQUAL(JOURNAL_UNCHANGED, save(journal, 7));
+  TEST_ASSERT_EQUAL(programmed, flash.bytesProgrammed());
+
+  // Also straight after a restart
+  SettingsJournal restarted(flash.flash());
+  restarted.begin();
+  TEST_ASSERT_EQUAL(JOURNAL_UNCHANGED, save(restarted, 7));
+  TEST_ASSERT_EQUAL(programmed, flash.bytesProgrammed());
+}
+
+void test_oversized_record_is_refused()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  uint8_t big[JOURNAL_MAX_RECORD + 1] = {0};
+  TEST_ASSERT_EQUAL(JOURNAL_TOO_LARGE, journal.write(big, sizeof(big), RECORD_VERSION));
+  TEST_ASSERT_EQUAL(JOURNAL_TOO_LARGE, journal.write(big, 0, RECORD_VERSION));
+  TEST_ASSERT_EQUAL(0, flash.bytesProgrammed());
+}
+
+void test_row_is_erased_only_when_full()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  TEST_ASSERT_EQUAL(JOURNAL_COMPACTED, save(journal, 0)); // first row
+  for (uint32_t n = 1; n < RECORDS_PER_ROW; n++)
+    TEST_ASSERT_EQUAL(JOURNAL_WRITTEN, save(journal, n));
+  TEST_ASSERT_EQUAL(1, flash.totalErases());
+
+  TEST_ASSERT_EQUAL(JOURNAL_COMPACTED, save(journal, RECORDS_PER_ROW));
+  TEST_ASSERT_EQUAL(2, flash.totalErases());
+  TEST_ASSERT_EQUAL(1, flash.rowErases(1));
+  TEST_ASSERT_EQUAL(RECORDS_PER_ROW, latest(flash));
+}
+
+void test_wear_is_spread_over_the_rows()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  const uint32_t saves = RECORDS_PER_ROW * ROW_COUNT * 50;
+  for (uint32_t n = 0; n < saves; n++)
+    save(journal, n);
+
+  // One erase per filled row, shared evenly by the ring
+  TEST_ASSERT_EQUAL(saves / RECORDS_PER_ROW, flash.totalErases());
+  for (uint8_t row = 0; row < ROW_COUNT; row++)
+    TEST_ASSERT_EQUAL(saves / RECORDS_PER_ROW / ROW_COUNT, flash.rowErases(row));
+  TEST_ASSERT_EQUAL(0, flash.programViolations());
+  TEST_ASSERT_EQUAL(0, flash.pageCrossings());
+  TEST_ASSERT_EQUAL(saves - 1, latest(flash));
+}
+
+// The emulated NVM refuses a program that runs into the next page, as the
+// SAMD21's page buffer cannot write it
+void test_flash_refuses_a_program_across_pages()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  const JournalFlash &nvm = flash.flash();
+  const uint8_t zeros[8] = {0};
+  nvm.program(nvm.context, EMULATED_PAGE_SIZE - 4, zeros, sizeof(zeros));
+  TEST_ASSERT_EQUAL(1, flash.pageCrossings());
+  TEST_ASSERT_EQUAL(0, flash.bytesProgrammed());
+  for (size_t i = 0; i < flash.contents().size(); i++)
+    TEST_ASSERT_EQUAL_HEX8(0xFF, flash.contents()[i]);
+}
+
+// Every record position in a row, page-straddling ones included, reads back
+// after a restart
+void test_records_across_page_boundaries_survive_a_restart()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  for (uint32_t n = 0; n < 2 * RECORDS_PER_ROW; n++)
+  {
+    save(journal, n);
+    TEST_ASSERT_EQUAL(n, latest(flash));
+  }
+  TEST_ASSERT_EQUAL(0, flash.pageCrossings());
+
+  // Storage with no page limit (the Nano's EEPROM) takes whole records
+  EmulatedFlash eeprom(128, 2, 128);
+  SettingsJournal eepromJournal(eeprom.flash());
+  eepromJournal.begin();
+  for (uint32_t n = 0; n < 20; n++)
+    save(eepromJournal, n);
+  TEST_ASSERT_EQUAL(0, eeprom.pageCrossings());
+  TEST_ASSERT_EQUAL(19, latest(eeprom));
+}
+
+void test_row_sequence_wraps_around()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  // Enough compactions to take the 16-bit row sequence past 0xFFFF
+  const uint32_t saves = RECORDS_PER_ROW * 0x10010UL;
+  for (uint32_t n = 0; n < saves; n++)
+    save(journal, n);
+  TEST_ASSERT_EQUAL(saves - 1, latest(flash));
+
+  // And appending carries on in the newest row after a restart
+  SettingsJournal restarted(flash.flash());
+  restarted.begin();
+  save(restarted, saves);
+  TEST_ASSERT_EQUAL(saves, latest(flash));
+}
+
+void test_torn_record_falls_back_to_the_previous_one()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  save(journal, 1);
+  save(journal, 2);
+
+  flash.cutPowerAfter(6); // part way through the next record's payload
+  save(journal, 3);
+  TEST_ASSERT_TRUE(flash.poweredOff());
+  flash.powerCycle();
+  TEST_ASSERT_EQUAL(2, latest(flash));
+
+  // The damaged bytes are never programmed over: the next save starts a
+  // clean row
+  SettingsJournal restarted(flash.flash());
+  restarted.begin();
+  uint32_t violations = flash.programViolations();
+  TEST_ASSERT_EQUAL(JOURNAL_COMPACTED, save(restarted, 4));
+  TEST_ASSERT_EQUAL(violations, flash.programViolations());
+  TEST_ASSERT_EQUAL(4, latest(flash));
+}
+
+// Power lost at every point of a compaction: the erase of the next row, the
+// record written into it, and the row header that commits it
+void test_power_cut_anywhere_in_a_compaction_keeps_a_record()
+{
+  const uint16_t compactionBytes = 4 + RECORD_LENGTH + 4;
+  for (uint16_t cut = 0; cut <= compactionBytes; cut++)
+  {
+    EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+    SettingsJournal journal(flash.flash());
+    journal.begin();
+    for (uint32_t n = 0; n < RECORDS_PER_ROW; n++)
+      save(journal, n);
+
+    flash.cutPowerAfter(cut);
+    save(journal, 100);
+    flash.powerCycle();
+    int32_t n = latest(flash);
+    if (cut < compactionBytes)
+      TEST_ASSERT_EQUAL_MESSAGE(RECORDS_PER_ROW - 1, n, "uncommitted row taken");
+    else
+      TEST_ASSERT_EQUAL_MESSAGE(100, n, "committed row lost");
+
+    SettingsJournal restarted(flash.flash());
+    restarted.begin();
+    save(restarted, 200);
+    TEST_ASSERT_EQUAL(200, latest(flash));
+  }
+}
+
+// Simulated NVM busy time per save: an append is one page program (two when
+// the record straddles a page), a compaction adds a row erase and the row
+// header. On average that is well under rewriting a whole row every time.
+void test_save_latency()
+{
+  EmulatedFlash flash(ROW_SIZE, ROW_COUNT);
+  SettingsJournal journal(flash.flash());
+  journal.begin();
+  save(journal, 0);
+
+  const uint32_t saves = RECORDS_PER_ROW * ROW_COUNT * 10;
+  uint64_t worst = 0;
+  uint64_t total = 0;
+  for (uint32_t n = 1; n <= saves; n++)
+  {
+    uint64_t before = flash.busyMicros();
+    JournalWriteResult result = save(journal, n);
+    uint64_t spent = flash.busyMicros() - before;
+    total += spent;
+    if (spent > worst)
+      worst = spent;
+    if (result == JOURNAL_WRITTEN)
+      TEST_ASSERT_LESS_OR_EQUAL(2 * EMULATED_PAGE_PROGRAM_US, spent);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(EMULATED_ROW_ERASE_US + 3 * EMULATED_PAGE_PROGRAM_US, worst);
+
+  const uint32_t rowRewrite = EMULATED_ROW_ERASE_US + (ROW_SIZE / EMULATED_PAGE_SIZE) * EMULATED_PAGE_PROGRAM_US;
+  TEST_ASSERT_LESS_THAN(rowRewrite / 4, total / saves);
+
+  // Saving unchanged settings costs nothing
+  uint64_t before = flash.busyMicros();
+  save(journal, saves);
+  TEST_ASSERT_EQUAL(before, flash.busyMicros());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_journal_reads_nothing);
+  RUN_TEST(test_latest_record_survives_a_restart);
+  RUN_TEST(test_unchanged_save_writes_nothing);
+  RUN_TEST(test_oversized_record_is_refused);
+  RUN_TEST(test_row_is_erased_only_when_full);
+  RUN_TEST(test_wear_is_spread_over_the_rows);
+  RUN_TEST(test_flash_refuses_a_program_across_pages);
+  RUN_TEST(test_records_across_page_boundaries_survive_a_restart);
+  RUN_TEST(test_row_sequence_wraps_around);
+  RUN_TEST(test_torn_record_falls_back_to_the_previous_one);
+  RUN_TEST(test_power_cut_anywhere_in_a_compaction_keeps_a_record);
+  RUN_TEST(test_save_latency);
+  return UNITY_END();
+}
@@ -0,0 +1,403 @@
+// Software UART framing and buffering (lib/TimerSerial), without the AVR.
+//
+// The bytes on the RX line come from tools/dfplayer_emulator: its replies,
+// timed as the module sends them, or bytes laid out at its 9600-baud byte
+// time. They are drawn on a simulated line, a tick per Timer2 count, and
+// read by TimerSerial's own receive path (SerialReceivePath) with the
+// hardware around it modelled: the pin-change interrupt hands it the level
+// of each edge until a frame starts, then the compare match fires half a bit
+// later and every bit after, until the frame is over.
+//
+//   pio test -e native -f test_timer_serial
+#include <unity.h>
+
+#include "TimerSerial.h"
+#include "dfplayer_emulator.h"
+
+#include <vector>
+
+// Timer2 at F_CPU / 8 on a 16 MHz Nano, and the bit period TimerSerial::begin()
+// works out for the module's 9600 baud
+#define TICKS_PER_US 2
+#define TICKS_PER_BIT (16000000 / 8 / DFPLAYER_BAUD)
+#define TICKS_PER_BYTE (DFPLAYER_BYTE_US * TICKS_PER_US)
+
+typedef std::vector<bool> Line;
+
+struct TimedByte
+{
+  uint32_t startTick; // leading edge of the start bit
+  uint32_t ticks;     // the whole frame, start bit to the end of the stop bit
+  uint8_t value;
+};
+
+typedef std::vector<TimedByte> TimedBytes;
+
+// Draw each byte's frame, as SerialTransmitter produces it, with its ten
+// bits spread evenly over the byte's time; the line idles high in between
+static Line drawLine(const TimedBytes &bytes, uint32_t idleTicks = TICKS_PER_BIT)
+{
+  Line line;
+  for (const TimedByte &byte : bytes)
+  {
+    if (line.size() < byte.startTick)
+      line.resize(byte.startTick, true);
+    SerialTransmitter transmitter;
+    transmitter.load(byte.value);
+    for (uint32_t bit = 0; transmitter.busy(); bit++)
+      line.resize(byte.startTick + (bit + 1) * byte.ticks / 10, transmitter.nextLevel());
+  }
+  line.resize(line.size() + idleTicks, true);
+  return line;
+}
+
+// Bytes back to back at the emulator's byte time, or stretched for a sender
+// whose clock is off
+static TimedBytes atByteTime(const std::vector<uint8_t> &values, uint32_t ticks = TICKS_PER_BYTE)
+{
+  TimedBytes bytes;
+  uint32_t tick = TICKS_PER_BIT;
+  for (uint8_t value : values)
+  {
+    bytes.push_back({tick, ticks, value});
+    tick += ticks;
+  }
+  return bytes;
+}
+
+// Send the emulated module a query frame for each command and collect its
+// ACKs and replies, each byte timed by when the module finishes sending it
+static TimedBytes moduleReplies(const std::vector<uint8_t> &queries)
+{
+  DFPlayerEmulator module;
+  uint64_t nowUs = 0;
+  for (uint8_t command : queries)
+  {
+    uint8_t frame[DFPLAYER_FRAME_LENGTH];
+    dfplayerEncodeFrame(frame, command, /*feedback = */ true, 0);
+    for (uint8_t b : frame)
+      module.receive(b, nowUs);
+    nowUs += 30000; // answered long before the next query
+  }
+
+  TimedBytes bytes;
+  std::vector<uint8_t> out;
+  for (uint64_t atUs = module.nextEventUs(); atUs != UINT64_MAX; atUs = module.nextEventUs())
+  {
+    out.clear();
+    module.update(atUs, out);
+    for (uint8_t value : out)
+      bytes.push_back({(uint32_t)(atUs - DFPLAYER_BYTE_US) * TICKS_PER_US, TICKS_PER_BYTE, value});
+  }
+  return bytes;
+}
+
+static std::vector<uint8_t> values(const TimedBytes &bytes)
+{
+  std::vector<uint8_t> result;
+  for (const TimedByte &byte : bytes)
+    result.push_back(byte.value);
+  return result;
+}
+
+// SerialReceivePath with Timer2's compare channel B and the RX pin's
+// pin-change interrupt around it, programmed as TimerSerial::onPinChange()
+// and onReceiveTick() do. Pin changes are masked while a frame is sampled
+// and their flag cleared when they are unmasked, so an edge seen in the
+// meantime never starts a frame.
+template <uint8_t size>
+struct ReceivePort
+{
+  SerialReceivePath<size> path;
+  std::vector<uint32_t> samples; // tick of every compare match
+  std::vector<uint32_t> queued;  // tick at which each byte reached the ring
+
+  void run(const Line &line, uint32_t ticksPerBit = TICKS_PER_BIT)
+  {
+    bool pinChangeEnabled = true;
+    bool compareEnabled = false;
+    uint32_t compareAt = 0;
+    bool previous = true;
+    for (uint32_t tick = 0; tick < line.size(); tick++)
+    {
+      bool level = line[tick];
+      if (pinChangeEnabled && level != previous && path.startBit(level))
+      {
+        compareAt = tick + ticksPerBit / 2;
+        compareEnabled = true;
+        pinChangeEnabled = false;
+      }
+      else if (compareEnabled && tick == compareAt)
+      {
+        compareAt += ticksPerBit;
+        samples.push_back(tick);
+        uint8_t before = path.received().count() + path.received().dropped();
+        if (path.sample(level))
+        {
+          compareEnabled = false;
+          pinChangeEnabled = true;
+        }
+        if ((uint8_t)(path.received().count() + path.received().dropped()) != before)
+          queued.push_back(tick);
+      }
+      previous = level;
+    }
+  }
+
+  std::vector<uint8_t> received()
+  {
+    std::vector<uint8_t> bytes;
+    uint8_t byte;
+    while (path.received().pop(&byte))
+      bytes.push_back(byte);
+    return bytes;
+  }
+};
+
+static void assertBytes(const std::vector<uint8_t> &expected, const std::vector<uint8_t> &actual)
+{
+  TEST_ASSERT_EQUAL(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); i++)
+    TEST_ASSERT_EQUAL_HEX8(expected[i], actual[i]);
+}
+
+// Every byte was sampled ten times, each close to the middle of its bit
+// (the receiver's bit period is a third of a tick short of 9600 baud, so the
+// last samples drift by a few ticks), and reached the ring at its stop bit
+template <uint8_t size>
+static void assertSampledMidBit(const TimedBytes &sent, const ReceivePort<size> &port)
+{
+  TEST_ASSERT_EQUAL(sent.size() * 10, port.samples.size());
+  TEST_ASSERT_EQUAL(sent.size(), port.queued.size());
+  for (size_t i = 0; i < sent.size(); i++)
+  {
+    for (uint32_t bit = 0; bit < 10; bit++)
+    {
+      uint32_t middle = sent[i].startTick + (2 * bit + 1) * sent[i].ticks / 20;
+      TEST_ASSERT_INT_WITHIN(TICKS_PER_BIT / 16, middle, port.samples[i * 10 + bit]);
+    }
+    TEST_ASSERT_EQUAL(port.samples[i * 10 + 9], port.queued[i]);
+  }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_transmitter_frame_levels()
+{
+  SerialTransmitter transmitter;
+  TEST_ASSERT_FALSE(transmitter.busy());
+  transmitter.load(0x35); // 0011 0101, sent LSB first
+  const bool levels[] = {false, true, false, true, false, true, true, false, false, true};
+  for (bool level : levels)
+  {
+    TEST_ASSERT_TRUE(transmitter.busy());
+    TEST_ASSERT_EQUAL(level, transmitter.nextLevel());
+  }
+  TEST_ASSERT_FALSE(transmitter.busy());
+}
+
+void test_receiver_assembles_a_byte()
+{
+  SerialReceiver receiver;
+  receiver.begin();
+  const bool levels[] = {false, true, false, true, false, false, true, false, true}; // start, then 0xA5
+  for (bool level : levels)
+    TEST_ASSERT_EQUAL(SERIAL_SAMPLE_MORE, receiver.sample(level));
+  TEST_ASSERT_EQUAL(SERIAL_SAMPLE_BYTE, receiver.sample(true));
+  TEST_ASSERT_EQUAL_HEX8(0xA5, receiver.data());
+
+  // begin() starts the next frame afresh
+  receiver.begin();
+  TEST_ASSERT_EQUAL(SERIAL_SAMPLE_MORE, receiver.sample(false));
+  for (int i = 0; i < 8; i++)
+    receiver.sample(false);
+  TEST_ASSERT_EQUAL(SERIAL_SAMPLE_BYTE, receiver.sample(true));
+  TEST_ASSERT_EQUAL_HEX8(0x00, receiver.data());
+}
+
+// ACKs and query replies as the module sends them: frames of ten bytes back
+// to back, the gaps between them as its processing delays leave them
+void test_module_replies_are_decoded_mid_bit()
+{
+  const TimedBytes sent = moduleReplies({PLAYER_CMD_QUERY_STATUS, PLAYER_CMD_QUERY_VOLUME, PLAYER_CMD_QUERY_EQ,
+                                         PLAYER_CMD_QUERY_FOLDERS});
+  TEST_ASSERT_EQUAL(8 * DFPLAYER_FRAME_LENGTH, sent.size());
+
+  ReceivePort<128> port;
+  port.run(drawLine(sent));
+  std::vector<uint8_t> received = port.received();
+  assertBytes(values(sent), received);
+  for (size_t i = 0; i < received.size(); i += DFPLAYER_FRAME_LENGTH)
+    TEST_ASSERT_TRUE(dfplayerFrameValid(&received[i]));
+  TEST_ASSERT_EQUAL_HEX8(PLAYER_FB_ACK, received[3]);
+  TEST_ASSERT_EQUAL_HEX8(PLAYER_CMD_QUERY_STATUS, received[13]);
+  TEST_ASSERT_EQUAL_HEX8(PLAYER_CMD_QUERY_VOLUME, received[33]);
+  TEST_ASSERT_EQUAL(0, port.path.framingErrors());
+  TEST_ASSERT_FALSE(port.path.receiving());
+  assertSampledMidBit(sent, port);
+}
+
+void test_every_byte_round_trips()
+{
+  for (int first = 0; first < 256; first += 64)
+  {
+    std::vector<uint8_t> bytes;
+    for (int b = first; b < first + 64; b++)
+      bytes.push_back(b);
+    TimedBytes sent = atByteTime(bytes);
+    ReceivePort<128> port;
+    port.run(drawLine(sent));
+    assertBytes(bytes, port.received());
+    assertSampledMidBit(sent, port);
+    TEST_ASSERT_EQUAL(0, port.path.framingErrors());
+  }
+}
+
+// Sampling mid-bit leaves half a bit either side: edges smeared by a quarter
+// of a bit, and a sender a few percent off the receiver's rate, still read
+// correctly
+void test_samples_are_taken_mid_bit()
+{
+  const std::vector<uint8_t> bytes = {0x55, 0xAA, 0x0F, 0xF0, 0x7E};
+  Line line = drawLine(atByteTime(bytes));
+  for (size_t tick = TICKS_PER_BIT + 1; tick + TICKS_PER_BIT / 4 < line.size(); tick++)
+  {
+    if (line[tick] == line[tick - 1])
+      continue;
+    // Ring for a quarter of a bit after each edge
+    for (size_t i = 1; i < TICKS_PER_BIT / 4; i += 2)
+      line[tick + i] = !line[tick + i];
+    tick += TICKS_PER_BIT / 4;
+  }
+  ReceivePort<16> port;
+  port.run(line);
+  assertBytes(bytes, port.received());
+
+  const uint32_t byteTimes[] = {TICKS_PER_BYTE * 96 / 100, TICKS_PER_BYTE * 104 / 100};
+  for (uint32_t ticks : byteTimes)
+  {
+    ReceivePort<16> skewedPort;
+    skewedPort.run(drawLine(atByteTime(bytes, ticks)));
+    assertBytes(bytes, skewedPort.received());
+  }
+}
+
+// A glitch gone before the start bit's middle is sampled once and dropped,
+// and the next falling edge starts a frame
+void test_short_low_pulse_is_noise()
+{
+  TimedBytes sent = atByteTime({0x42});
+  sent[0].startTick += 3 * TICKS_PER_BIT;
+  Line line = drawLine(sent);
+  for (uint32_t tick = TICKS_PER_BIT; tick < TICKS_PER_BIT + TICKS_PER_BIT / 3; tick++)
+    line[tick] = false;
+
+  ReceivePort<16> port;
+  port.run(line);
+  assertBytes({0x42}, port.received());
+  TEST_ASSERT_EQUAL(1 + 10, port.samples.size());
+  TEST_ASSERT_EQUAL(TICKS_PER_BIT + TICKS_PER_BIT / 2, port.samples[0]);
+  TEST_ASSERT_EQUAL(0, port.path.framingErrors());
+}
+
+void test_missing_stop_bit_is_a_framing_error()
+{
+  TimedBytes sent = atByteTime({0x24});
+  sent[0].startTick += 13 * TICKS_PER_BIT;
+  Line line = drawLine(sent);
+  for (uint32_t tick = TICKS_PER_BIT; tick < 13 * TICKS_PER_BIT; tick++)
+    line[tick] = false; // a break: low through the stop bit
+
+  ReceivePort<16> port;
+  port.run(line);
+  TEST_ASSERT_EQUAL(1, port.path.framingErrors());
+  assertBytes({0x24}, port.received()); // nothing from the break itself
+  TEST_ASSERT_EQUAL(2 * 10, port.samples.size()); // the break ending is no start bit
+}
+
+// Replies left unread by loop() fill the ring the firmware is built with;
+// the oldest are kept and the rest counted
+void test_unread_replies_overflow_the_receive_ring()
+{
+  std::vector<uint8_t> queries(TIMER_SERIAL_RX_BUFFER_SIZE / (2 * DFPLAYER_FRAME_LENGTH) + 1,
+                               PLAYER_CMD_QUERY_VOLUME);
+  const TimedBytes sent = moduleReplies(queries);
+  TEST_ASSERT_TRUE(sent.size() >= TIMER_SERIAL_RX_BUFFER_SIZE);
+
+  ReceivePort<TIMER_SERIAL_RX_BUFFER_SIZE> port;
+  port.run(drawLine(sent));
+  TEST_ASSERT_EQUAL(sent.size() - (TIMER_SERIAL_RX_BUFFER_SIZE - 1), port.path.received().dropped());
+  std::vector<uint8_t> kept = values(sent);
+  kept.resize(TIMER_SERIAL_RX_BUFFER_SIZE - 1);
+  assertBytes(kept, port.received());
+  TEST_ASSERT_EQUAL(0, port.path.framingErrors());
+}
+
+void test_ring_wraps_in_order()
+{
+  SerialByteRing<8> ring;
+  uint8_t next = 0;
+  uint8_t expected = 0;
+  for (int round = 0; round < 100; round++)
+  {
+    for (int i = 0; i < 5; i++)
+      TEST_ASSERT_TRUE(ring.push(next++));
+    TEST_ASSERT_EQUAL(5, ring.count());
+    TEST_ASSERT_EQUAL(2, ring.space());
+    TEST_ASSERT_EQUAL(expected, ring.peek());
+    uint8_t byte;
+    for (int i = 0; i < 5; i++)
+    {
+      TEST_ASSERT_TRUE(ring.pop(&byte));
+      TEST_ASSERT_EQUAL_HEX8(expected++, byte);
+    }
+    TEST_ASSERT_EQUAL(0, ring.count());
+  }
+  TEST_ASSERT_EQUAL(0, ring.dropped());
+}
+
+void test_ring_full_and_empty()
+{
+  SerialByteRing<8> ring;
+  uint8_t byte;
+  TEST_ASSERT_FALSE(ring.pop(&byte));
+  TEST_ASSERT_EQUAL(-1, ring.peek());
+  TEST_ASSERT_EQUAL(7, ring.space()); // one slot tells full from empty
+
+  for (int i = 0; i < 7; i++)
+    TEST_ASSERT_TRUE(ring.push(0x10 + i));
+  TEST_ASSERT_TRUE(ring.full());
+  TEST_ASSERT_FALSE(ring.push(0xEE));
+  TEST_ASSERT_EQUAL(1, ring.dropped());
+  TEST_ASSERT_EQUAL(7, ring.count());
+  TEST_ASSERT_TRUE(ring.pop(&byte));
+  TEST_ASSERT_EQUAL_HEX8(0x10, byte); // the rejected byte did not displace anything
+
+  // The drop count wraps at 256
+  TEST_ASSERT_TRUE(ring.push(0x17));
+  for (int i = 0; i < 299; i++)
+    ring.push(0xEE);
+  TEST_ASSERT_EQUAL(300 % 256, ring.dropped());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_transmitter_frame_levels);
+  RUN_TEST(test_receiver_assembles_a_byte);
+  RUN_TEST(test_module_replies_are_decoded_mid_bit);
+  RUN_TEST(test_every_byte_round_trips);
+  RUN_TEST(test_samples_are_taken_mid_bit);
+  RUN_TEST(test_short_low_pulse_is_noise);
+  RUN_TEST(test_missing_stop_bit_is_a_framing_error);
+  RUN_TEST(test_unread_replies_overflow_the_receive_ring);
+  RUN_TEST(test_ring_wraps_in_order);
+  RUN_TEST(test_ring_full_and_empty);
+  return UNITY_END();
+}
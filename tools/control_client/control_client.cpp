@@ -0,0 +1,293 @@
+#include "control_client.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+std::vector<uint8_t> encodeControlFrame(const std::vector<uint8_t> &payload)
+{
+  std::vector<uint8_t> frame;
+  uint16_t crc = controlCrc16(0xFFFF, payload.size());
+  frame.push_back(CONTROL_FRAME_SYNC);
+  frame.push_back(payload.size());
+  for (size_t i = 0; i < payload.size(); i++)
+  {
+    frame.push_back(payload[i]);
+    crc = controlCrc16(crc, payload[i]);
+  }
+  frame.push_back(crc >> 8);
+  frame.push_back(crc & 0xFF);
+  return frame;
+}
+
+bool decodeControlFrame(std::vector<uint8_t> &bytes, std::vector<uint8_t> &payload)
+{
+  while (!bytes.empty())
+  {
+    if (bytes[0] != CONTROL_FRAME_SYNC)
+    {
+      bytes.erase(bytes.begin()); // text output from the firmware
+      continue;
+    }
+    if (bytes.size() < 2)
+      return false;
+    size_t length = bytes[1];
+    if (length == 0 || length > CONTROL_MAX_PAYLOAD)
+    {
+      bytes.erase(bytes.begin());
+      continue;
+    }
+    if (bytes.size() < length + 4)
+      return false;
+
+    uint16_t crc = controlCrc16(0xFFFF, length);
+    for (size_t i = 0; i < length; i++)
+      crc = controlCrc16(crc, bytes[2 + i]);
+    uint16_t received = (bytes[2 + length] << 8) | bytes[3 + length];
+    if (crc != received)
+    {
+      bytes.erase(bytes.begin());
+      continue;
+    }
+    payload.assign(bytes.begin() + 2, bytes.begin() + 2 + length);
+    bytes.erase(bytes.begin(), bytes.begin() + 4 + length);
+    return true;
+  }
+  return false;
+}
+
+bool parseControlReply(const std::vector<uint8_t> &payload, std::vector<ControlReply> &replies)
+{
+  replies.clear();
+  size_t i = 0;
+  while (i + 2 <= payload.size())
+  {
+    ControlReply reply = ControlReply();
+    reply.command = payload[i++];
+    reply.result = payload[i++];
+    if (reply.command == CONTROL_STATUS && reply.result == CONTROL_OK)
+    {
+      if (i + CONTROL_STATUS_LENGTH > payload.size())
+        return false;
+      reply.status.state = payload[i];
+      reply.status.volume = payload[i + 1];
+      reply.status.eq = payload[i + 2];
+      reply.status.folder = payload[i + 3];
+      reply.status.track = payload[i + 4];
+      reply.status.mode = payload[i + 5];
+      reply.status.playbackOrder = payload[i + 6];
+      reply.status.continuousMode = payload[i + 7];
+      i += CONTROL_STATUS_LENGTH;
+    }
+    replies.push_back(reply);
+  }
+  return i == payload.size();
+}
+
+// Command ids in a batch, in order, up to the first one without a known
+// argument length
+static std::vector<uint8_t> batchCommands(const std::vector<uint8_t> &payload)
+{
+  std::vector<uint8_t> commands;
+  size_t i = 0;
+  while (i < payload.size())
+  {
+    commands.push_back(payload[i]);
+    int argLength = controlArgLength(payload[i]);
+    if (argLength < 0)
+      break;
+    i += 1 + argLength;
+  }
+  return commands;
+}
+
+// A reply belongs to the batch if it answers the batch's commands in order.
+// The firmware stops at the first command it cannot parse, so a reply may
+// cover only the start of the batch.
+static bool replyMatches(const std::vector<uint8_t> &commands, const std::vector<ControlReply> &replies)
+{
+  if (replies.empty() || replies.size() > commands.size())
+    return false;
+  for (size_t i = 0; i < replies.size(); i++)
+    if (replies[i].command != commands[i])
+      return false;
+  return true;
+}
+
+static speed_t baudConstant(int baud)
+{
+  switch (baud)
+  {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  default:
+    return B115200;
+  }
+}
+
+static long monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+ControlClient::ControlClient() : fd_(-1) {}
+
+ControlClient::~ControlClient()
+{
+  close();
+}
+
+bool ControlClient::open(const char *device, int baud)
+{
+  close();
+  fd_ = ::open(device, O_RDWR | O_NOCTTY);
+  if (fd_ < 0)
+    return false;
+  struct termios tio;
+  if (tcgetattr(fd_, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baudConstant(baud));
+    cfsetospeed(&tio, baudConstant(baud));
+    tcsetattr(fd_, TCSANOW, &tio);
+  }
+  received_.clear();
+  return true;
+}
+
+void ControlClient::close()
+{
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+}
+
+void ControlClient::play(uint16_t track)
+{
+  batch_.push_back(CONTROL_PLAY);
+  batch_.push_back(track >> 8);
+  batch_.push_back(track & 0xFF);
+}
+
+void ControlClient::playFolder(uint8_t folder, uint8_t track)
+{
+  batch_.push_back(CONTROL_PLAY_FOLDER);
+  batch_.push_back(folder);
+  batch_.push_back(track);
+}
+
+void ControlClient::volume(uint8_t volume)
+{
+  batch_.push_back(CONTROL_VOLUME);
+  batch_.push_back(volume);
+}
+
+void ControlClient::eq(uint8_t eq)
+{
+  batch_.push_back(CONTROL_EQ);
+  batch_.push_back(eq);
+}
+
+void ControlClient::loopFolder(uint8_t folder)
+{
+  batch_.push_back(CONTROL_LOOP_FOLDER);
+  batch_.push_back(folder);
+}
+
+void ControlClient::repeat(uint8_t continuousMode)
+{
+  batch_.push_back(CONTROL_REPEAT);
+  batch_.push_back(continuousMode);
+}
+
+void ControlClient::playlistAdd(uint8_t playlist, uint8_t folder, uint8_t track)
+{
+  batch_.push_back(CONTROL_PLAYLIST_ADD);
+  batch_.push_back(playlist);
+  batch_.push_back(folder);
+  batch_.push_back(track);
+}
+
+void ControlClient::playlistRemove(uint8_t playlist, uint8_t position)
+{
+  batch_.push_back(CONTROL_PLAYLIST_REMOVE);
+  batch_.push_back(playlist);
+  batch_.push_back(position);
+}
+
+void ControlClient::playlistClear(uint8_t playlist)
+{
+  batch_.push_back(CONTROL_PLAYLIST_CLEAR);
+  batch_.push_back(playlist);
+}
+
+void ControlClient::favorite(uint8_t button, uint8_t folder, uint8_t track)
+{
+  batch_.push_back(CONTROL_FAVORITE);
+  batch_.push_back(button);
+  batch_.push_back(folder);
+  batch_.push_back(track);
+}
+
+void ControlClient::command(ControlCommandId id)
+{
+  batch_.push_back(id);
+}
+
+bool ControlClient::send(std::vector<ControlReply> &replies, int timeoutMs)
+{
+  std::vector<uint8_t> payload;
+  payload.swap(batch_);
+  if (fd_ < 0 || payload.empty() || payload.size() > CONTROL_MAX_PAYLOAD)
+    return false;
+
+  std::vector<uint8_t> frame = encodeControlFrame(payload);
+  if (write(fd_, frame.data(), frame.size()) != (ssize_t)frame.size())
+    return false;
+
+  // Frames answering something else (a batch that timed out earlier) are
+  // skipped until this batch's reply arrives
+  std::vector<uint8_t> commands = batchCommands(payload);
+  long deadline = monotonicMs() + timeoutMs;
+  std::vector<uint8_t> reply;
+  while (true)
+  {
+    while (decodeControlFrame(received_, reply))
+      if (parseControlReply(reply, replies) && replyMatches(commands, replies))
+        return true;
+    replies.clear();
+
+    long remaining = deadline - monotonicMs();
+    if (remaining <= 0)
+      return false;
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    if (poll(&pfd, 1, remaining) <= 0)
+      return false;
+    uint8_t buffer[128];
+    ssize_t n = read(fd_, buffer, sizeof(buffer));
+    if (n <= 0)
+      return false;
+    received_.insert(received_.end(), buffer, buffer + n);
+  }
+}
+
+bool ControlClient::status(ControlStatus &status, int timeoutMs)
+{
+  std::vector<ControlReply> replies;
+  batch_.clear();
+  command(CONTROL_STATUS);
+  if (!send(replies, timeoutMs) || replies.empty() || replies[0].result != CONTROL_OK)
+    return false;
+  status = replies[0].status;
+  return true;
+}
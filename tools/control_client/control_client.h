@@ -0,0 +1,79 @@
+// Host-side client for the binary control protocol (include/control_protocol.h).
+//
+// Talks to the player over its USB serial port (or any tty/pty). Commands are
+// collected into a batch and sent as a single frame; send() waits for the
+// reply frame and returns one result per command. Frames carry no sequence
+// number, so a reply is matched to its batch by the command ids it answers,
+// in order; a late reply to a batch that timed out is skipped.
+//
+// Build with the protocol header on the include path, e.g.
+//   g++ -std=c++11 -Iinclude tools/control_client/control_client.cpp your_tool.cpp
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "control_protocol.h"
+
+struct ControlStatus
+{
+  uint8_t state; // 0 stopped, 1 playing, 2 paused
+  uint8_t volume;
+  uint8_t eq;
+  uint8_t folder;
+  uint8_t track;
+  uint8_t mode;
+  uint8_t playbackOrder;
+  uint8_t continuousMode; // 0 off, 1 folder, 2 repeat one, 3 repeat all
+};
+
+struct ControlReply
+{
+  uint8_t command;
+  uint8_t result;       // ControlResult
+  ControlStatus status; // valid for a successful CONTROL_STATUS
+};
+
+// Frame encoding/decoding, usable without a port (e.g. over a pipe)
+std::vector<uint8_t> encodeControlFrame(const std::vector<uint8_t> &payload);
+
+// Extract one frame's payload from the front of `bytes`. Returns false if no
+// complete, valid frame is available yet; bytes before a frame are discarded.
+bool decodeControlFrame(std::vector<uint8_t> &bytes, std::vector<uint8_t> &payload);
+
+bool parseControlReply(const std::vector<uint8_t> &payload, std::vector<ControlReply> &replies);
+
+class ControlClient
+{
+public:
+  ControlClient();
+  ~ControlClient();
+
+  bool open(const char *device, int baud = 115200);
+  void close();
+
+  // Batch building; nothing is sent until send()
+  void play(uint16_t track);
+  void playFolder(uint8_t folder, uint8_t track);
+  void volume(uint8_t volume);
+  void eq(uint8_t eq);
+  void loopFolder(uint8_t folder);
+  void repeat(uint8_t continuousMode);
+  void playlistAdd(uint8_t playlist, uint8_t folder, uint8_t track); // playlist from 1
+  void playlistRemove(uint8_t playlist, uint8_t position);           // position from 1
+  void playlistClear(uint8_t playlist);
+  void favorite(uint8_t button, uint8_t folder, uint8_t track); // folder 0 restores the default
+  void command(ControlCommandId id); // any command without arguments
+
+  // Send the batch as one frame and wait up to timeoutMs for the reply
+  bool send(std::vector<ControlReply> &replies, int timeoutMs = 500);
+
+  // Convenience: a single STATUS request
+  bool status(ControlStatus &status, int timeoutMs = 500);
+
+private:
+  int fd_;
+  std::vector<uint8_t> batch_;
+  std::vector<uint8_t> received_;
+};
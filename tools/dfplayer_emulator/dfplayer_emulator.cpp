@@ -0,0 +1,549 @@
+#include "dfplayer_emulator.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+const DFPlayerTiming DFPLAYER_DEFAULT_TIMING = {
+    10000,   // replyDelayUs
+    2000,    // queryDelayUs
+    40000,   // playStartUs
+    1500000, // resetUs
+    20000    // frameTimeoutUs
+};
+
+// Tracks in the order the module numbers them: folders 01..99, then MP3/
+static bool cardOrder(const DFPlayerTrack &a, const DFPlayerTrack &b)
+{
+  int folderA = a.folder ? a.folder : 100;
+  int folderB = b.folder ? b.folder : 100;
+  if (folderA != folderB)
+    return folderA < folderB;
+  return a.number < b.number;
+}
+
+DFPlayerEmulator::DFPlayerEmulator(const DFPlayerTiming &timing)
+    : timing_(timing), log_(NULL), logContext_(NULL), rxLineFreeUs_(0), rxLength_(0), rxFrameStartUs_(0),
+      rxLastByteUs_(0), txLineFreeUs_(0), lastCommandStartUs_(0), state_(STOPPED), current_(-1), startsAtUs_(0),
+      endsAtUs_(0), remainingUs_(0), loopFolder_(0), volume_(DFPLAYER_MAX_VOLUME), eq_(DFPLAYER_EQ_NORMAL),
+      sleeping_(false), resetting_(false), onlineAtUs_(0)
+{
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+// Leading digits of a file or folder name, -1 unless there are exactly `digits`
+static int leadingNumber(const char *name, int digits)
+{
+  int value = 0;
+  for (int i = 0; i < digits; i++)
+  {
+    if (!isdigit((unsigned char)name[i]))
+      return -1;
+    value = value * 10 + (name[i] - '0');
+  }
+  return isdigit((unsigned char)name[digits]) ? -1 : value;
+}
+
+static bool isMp3(const char *name)
+{
+  size_t length = strlen(name);
+  return length > 4 && strcasecmp(name + length - 4, ".mp3") == 0;
+}
+
+int DFPlayerEmulator::loadMedia(const char *root)
+{
+  DIR *dir = opendir(root);
+  if (!dir)
+    return -1;
+  int found = 0;
+  struct dirent *folderEntry;
+  while ((folderEntry = readdir(dir)) != NULL)
+  {
+    int folder = leadingNumber(folderEntry->d_name, 2);
+    int digits = 3;
+    if (strcasecmp(folderEntry->d_name, "MP3") == 0)
+    {
+      folder = 0; // playMp3Folder() files, NNNN.mp3
+      digits = 4;
+    }
+    else if (folder < 1 || folderEntry->d_name[2] != '\0')
+      continue;
+
+    std::string path = std::string(root) + "/" + folderEntry->d_name;
+    DIR *tracks = opendir(path.c_str());
+    if (!tracks)
+      continue;
+    struct dirent *trackEntry;
+    while ((trackEntry = readdir(tracks)) != NULL)
+    {
+      int number = leadingNumber(trackEntry->d_name, digits);
+      if (number < 1 || !isMp3(trackEntry->d_name))
+        continue;
+      addTrack(folder, number, mp3DurationMs(path + "/" + trackEntry->d_name));
+      found++;
+    }
+    closedir(tracks);
+  }
+  closedir(dir);
+  return found;
+}
+
+void DFPlayerEmulator::addTrack(uint8_t folder, uint16_t number, uint32_t durationMs)
+{
+  DFPlayerTrack track = {folder, number, durationMs};
+  tracks_.insert(std::upper_bound(tracks_.begin(), tracks_.end(), track, cardOrder), track);
+}
+
+void DFPlayerEmulator::setLog(DFPlayerFrameLog log, void *context)
+{
+  log_ = log;
+  logContext_ = context;
+}
+
+void DFPlayerEmulator::reset(uint64_t nowUs)
+{
+  state_ = STOPPED;
+  current_ = -1;
+  loopFolder_ = 0;
+  volume_ = DFPLAYER_MAX_VOLUME;
+  eq_ = DFPLAYER_EQ_NORMAL;
+  sleeping_ = false;
+  resetting_ = true;
+  onlineAtUs_ = nowUs + timing_.resetUs;
+}
+
+void DFPlayerEmulator::receive(uint8_t b, uint64_t nowUs)
+{
+  uint64_t startUs = std::max(nowUs, rxLineFreeUs_);
+  TimedByte timed = {startUs + DFPLAYER_BYTE_US, b};
+  rxPending_.push_back(timed);
+  rxLineFreeUs_ = timed.atUs;
+}
+
+uint64_t DFPlayerEmulator::nextEventUs() const
+{
+  uint64_t next = UINT64_MAX;
+  if (!rxPending_.empty())
+    next = std::min(next, rxPending_.front().atUs);
+  if (!txPending_.empty())
+    next = std::min(next, txPending_.front().atUs);
+  if (state_ == PLAYING)
+    next = std::min(next, endsAtUs_);
+  if (resetting_)
+    next = std::min(next, onlineAtUs_);
+  return next;
+}
+
+void DFPlayerEmulator::update(uint64_t nowUs, std::vector<uint8_t> &out)
+{
+  // Handle the module's own events and received bytes in time order
+  while (true)
+  {
+    uint64_t rxAt = rxPending_.empty() ? UINT64_MAX : rxPending_.front().atUs;
+    uint64_t endAt = state_ == PLAYING ? endsAtUs_ : UINT64_MAX;
+    uint64_t onlineAt = resetting_ ? onlineAtUs_ : UINT64_MAX;
+    uint64_t next = std::min(rxAt, std::min(endAt, onlineAt));
+    if (next > nowUs)
+      break;
+
+    if (next == onlineAt)
+    {
+      resetting_ = false;
+      send(PLAYER_FB_CARD_ONLINE, DFPLAYER_DEVICE_SD, onlineAt);
+    }
+    else if (next == endAt)
+    {
+      finishTrack();
+    }
+    else
+    {
+      TimedByte timed = rxPending_.front();
+      rxPending_.erase(rxPending_.begin());
+      if (rxLength_ > 0 && timed.atUs - rxLastByteUs_ > timing_.frameTimeoutUs)
+      {
+        rxLength_ = 0;
+        stats_.framesDropped++;
+      }
+      rxLastByteUs_ = timed.atUs;
+      if (rxLength_ == 0)
+      {
+        if (timed.value != DFPLAYER_FRAME_START)
+          continue; // resynchronise on the start byte
+        rxFrameStartUs_ = timed.atUs - DFPLAYER_BYTE_US;
+      }
+      rxFrame_[rxLength_++] = timed.value;
+      if (rxLength_ == DFPLAYER_FRAME_LENGTH)
+      {
+        rxLength_ = 0;
+        handleFrame(rxFrame_, timed.atUs);
+      }
+    }
+  }
+
+  size_t sent = 0;
+  while (sent < txPending_.size() && txPending_[sent].atUs <= nowUs)
+    out.push_back(txPending_[sent++].value);
+  txPending_.erase(txPending_.begin(), txPending_.begin() + sent);
+}
+
+bool DFPlayerEmulator::busy(uint64_t nowUs) const
+{
+  return state_ == PLAYING && nowUs >= startsAtUs_ && nowUs < endsAtUs_;
+}
+
+void DFPlayerEmulator::handleFrame(const uint8_t *frame, uint64_t atUs)
+{
+  stats_.framesReceived++;
+  if (log_)
+    log_(logContext_, atUs, true, frame);
+  uint64_t replyAt = atUs + timing_.replyDelayUs;
+  if (!dfplayerFrameValid(frame))
+  {
+    stats_.checksumErrors++;
+    send(PLAYER_FB_ERROR, CheckSumNotMatch, replyAt);
+    return;
+  }
+  if (resetting_)
+  {
+    send(PLAYER_FB_ERROR, Busy, replyAt);
+    return;
+  }
+
+  lastCommandStartUs_ = rxFrameStartUs_;
+  uint8_t command = frame[3];
+  bool feedback = frame[4] != 0;
+  uint16_t param = (frame[5] << 8) | frame[6];
+  uint8_t error = handleCommand(command, param, atUs);
+  if (error)
+    send(PLAYER_FB_ERROR, error, replyAt); // in place of the ACK
+  else if (feedback)
+    send(PLAYER_FB_ACK, 0, replyAt);
+
+  uint64_t queryAt = replyAt + timing_.queryDelayUs;
+  switch (error ? 0 : command)
+  {
+  case PLAYER_CMD_QUERY_STATUS:
+    send(command, (DFPLAYER_DEVICE_SD << 8) | state_, queryAt);
+    break;
+  case PLAYER_CMD_QUERY_VOLUME:
+    send(command, volume_, queryAt);
+    break;
+  case PLAYER_CMD_QUERY_EQ:
+    send(command, eq_, queryAt);
+    break;
+  case PLAYER_CMD_QUERY_SD_FILES:
+    send(command, tracks_.size(), queryAt);
+    break;
+  case PLAYER_CMD_QUERY_SD_CURRENT:
+    send(command, current_ + 1, queryAt);
+    break;
+  case PLAYER_CMD_QUERY_FOLDER_FILES:
+    send(command, filesInFolder(param), queryAt);
+    break;
+  case PLAYER_CMD_QUERY_FOLDERS:
+    send(command, folderCount(), queryAt);
+    break;
+  default:
+    break;
+  }
+}
+
+// Apply a command received at atUs; returns a PlayerErrorCode, or 0
+uint8_t DFPlayerEmulator::handleCommand(uint8_t command, uint16_t param, uint64_t atUs)
+{
+  if (sleeping_ && command != PLAYER_CMD_OUTPUT_DEVICE && command != PLAYER_CMD_RESET)
+    return Sleeping;
+
+  switch (command)
+  {
+  case PLAYER_CMD_NEXT:
+  case PLAYER_CMD_PREVIOUS:
+  {
+    if (tracks_.empty())
+      return FileIndexOut;
+    int count = tracks_.size();
+    int step = command == PLAYER_CMD_NEXT ? 1 : count - 1;
+    loopFolder_ = 0;
+    play(current_ < 0 ? 0 : (current_ + step) % count, atUs);
+    break;
+  }
+  case PLAYER_CMD_PLAY:
+    if (param < 1 || param > tracks_.size())
+      return FileIndexOut;
+    loopFolder_ = 0;
+    play(param - 1, atUs);
+    break;
+  case PLAYER_CMD_VOLUME_UP:
+    if (volume_ < DFPLAYER_MAX_VOLUME)
+      volume_++;
+    break;
+  case PLAYER_CMD_VOLUME_DOWN:
+    if (volume_ > 0)
+      volume_--;
+    break;
+  case PLAYER_CMD_VOLUME:
+    volume_ = std::min<uint16_t>(param, DFPLAYER_MAX_VOLUME);
+    break;
+  case PLAYER_CMD_EQ:
+    if (param <= DFPLAYER_EQ_BASS)
+      eq_ = param;
+    break;
+  case PLAYER_CMD_OUTPUT_DEVICE:
+    sleeping_ = false;
+    break;
+  case PLAYER_CMD_SLEEP:
+    state_ = STOPPED;
+    sleeping_ = true;
+    break;
+  case PLAYER_CMD_RESET:
+    reset(atUs);
+    break;
+  case PLAYER_CMD_START:
+    if (state_ == PAUSED)
+    {
+      state_ = PLAYING;
+      endsAtUs_ = atUs + remainingUs_;
+      startsAtUs_ = atUs;
+    }
+    else if (state_ == STOPPED && current_ >= 0)
+      play(current_, atUs);
+    break;
+  case PLAYER_CMD_PAUSE:
+    if (state_ == PLAYING)
+    {
+      state_ = PAUSED;
+      remainingUs_ = endsAtUs_ - std::max(atUs, startsAtUs_);
+    }
+    break;
+  case PLAYER_CMD_PLAY_FOLDER:
+  {
+    int index = findTrack(param >> 8, param & 0xFF);
+    if (index < 0)
+      return FileMismatch;
+    loopFolder_ = 0;
+    play(index, atUs);
+    break;
+  }
+  case PLAYER_CMD_PLAY_MP3_FOLDER:
+  {
+    int index = findTrack(0, param);
+    if (index < 0)
+      return FileMismatch;
+    loopFolder_ = 0;
+    play(index, atUs);
+    break;
+  }
+  case PLAYER_CMD_STOP:
+    state_ = STOPPED;
+    loopFolder_ = 0;
+    break;
+  case PLAYER_CMD_LOOP_FOLDER:
+  {
+    int index = -1;
+    for (size_t i = 0; i < tracks_.size() && index < 0; i++)
+      if (tracks_[i].folder == param && param > 0)
+        index = i;
+    if (index < 0)
+      return FileMismatch;
+    loopFolder_ = param;
+    play(index, atUs);
+    break;
+  }
+  case PLAYER_CMD_QUERY_FOLDER_FILES:
+    // A folder that does not exist is an error rather than a zero count
+    if (filesInFolder(param) == 0)
+      return FileIndexOut;
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+bool DFPlayerEmulator::play(int index, uint64_t atUs)
+{
+  current_ = index;
+  state_ = PLAYING;
+  startsAtUs_ = atUs + timing_.playStartUs;
+  endsAtUs_ = startsAtUs_ + (uint64_t)tracks_[index].durationMs * 1000;
+  return true;
+}
+
+// The module reports the end of a track twice, as the real one does
+void DFPlayerEmulator::finishTrack()
+{
+  uint64_t atUs = endsAtUs_;
+  send(PLAYER_FB_PLAY_FINISHED, current_ + 1, atUs);
+  send(PLAYER_FB_PLAY_FINISHED, current_ + 1, atUs);
+  state_ = STOPPED;
+  if (loopFolder_ == 0)
+    return;
+
+  // Next track of the looped folder, wrapping to its first
+  int next = current_ + 1;
+  if (next >= (int)tracks_.size() || tracks_[next].folder != loopFolder_)
+  {
+    next = current_;
+    while (next > 0 && tracks_[next - 1].folder == loopFolder_)
+      next--;
+  }
+  play(next, atUs);
+}
+
+int DFPlayerEmulator::findTrack(uint8_t folder, uint16_t number) const
+{
+  for (size_t i = 0; i < tracks_.size(); i++)
+    if (tracks_[i].folder == folder && tracks_[i].number == number)
+      return i;
+  return -1;
+}
+
+uint16_t DFPlayerEmulator::folderCount() const
+{
+  uint16_t count = 0;
+  for (size_t i = 0; i < tracks_.size(); i++)
+    if (tracks_[i].folder > 0 && (i == 0 || tracks_[i - 1].folder != tracks_[i].folder))
+      count++;
+  return count;
+}
+
+uint16_t DFPlayerEmulator::filesInFolder(uint8_t folder) const
+{
+  uint16_t count = 0;
+  for (size_t i = 0; i < tracks_.size(); i++)
+    if (folder > 0 && tracks_[i].folder == folder)
+      count++;
+  return count;
+}
+
+// Queue a frame to go out once the module is ready at atUs and the line is
+// free; each byte is released when its stop bit would have been sent
+void DFPlayerEmulator::send(uint8_t command, uint16_t param, uint64_t atUs)
+{
+  uint8_t frame[DFPLAYER_FRAME_LENGTH];
+  dfplayerEncodeFrame(frame, command, false, param);
+  uint64_t startUs = std::max(atUs, txLineFreeUs_);
+  for (uint8_t i = 0; i < DFPLAYER_FRAME_LENGTH; i++)
+  {
+    TimedByte timed = {startUs + (uint64_t)(i + 1) * DFPLAYER_BYTE_US, frame[i]};
+    txPending_.push_back(timed);
+  }
+  txLineFreeUs_ = startUs + DFPLAYER_FRAME_LENGTH * DFPLAYER_BYTE_US;
+
+  stats_.framesSent++;
+  if (command == PLAYER_FB_ERROR)
+    stats_.errors++;
+  if (command == PLAYER_FB_ACK)
+  {
+    uint32_t roundTripUs = txLineFreeUs_ - lastCommandStartUs_;
+    stats_.acks++;
+    stats_.ackRoundTripUs += roundTripUs;
+    stats_.maxAckRoundTripUs = std::max(stats_.maxAckRoundTripUs, roundTripUs);
+  }
+  if (log_)
+    log_(logContext_, txLineFreeUs_, false, frame);
+}
+
+// -- MP3 parsing, as in scripts/generate_media_manifest.py --
+
+// kbps, indexed by [MPEG-1 ? 0 : 1][layer - 1][bitrate index]
+static const uint16_t MP3_BITRATES[2][3][15] = {
+    {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+     {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+    {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}}};
+
+struct Mp3Frame
+{
+  uint32_t length;
+  uint32_t samples;
+  uint32_t sampleRate;
+};
+
+static bool parseMp3Frame(const std::vector<uint8_t> &data, size_t pos, Mp3Frame *frame)
+{
+  if (pos + 4 > data.size() || data[pos] != 0xFF || (data[pos + 1] & 0xE0) != 0xE0)
+    return false;
+  uint8_t b1 = data[pos + 1], b2 = data[pos + 2];
+  int version = (b1 >> 3) & 0x03; // 3 = MPEG-1, 2 = MPEG-2, 0 = MPEG-2.5
+  int layer = 4 - ((b1 >> 1) & 0x03);
+  int bitrateIndex = (b2 >> 4) & 0x0F;
+  int rateIndex = (b2 >> 2) & 0x03;
+  if (version == 1 || layer == 4 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+    return false;
+  static const uint32_t rates[3] = {44100, 48000, 32000};
+  bool mpeg1 = version == 3;
+  uint32_t bitrate = MP3_BITRATES[mpeg1 ? 0 : 1][layer - 1][bitrateIndex];
+  frame->sampleRate = rates[rateIndex] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  uint32_t padding = (b2 >> 1) & 0x01;
+  if (layer == 1)
+  {
+    frame->samples = 384;
+    frame->length = (12 * bitrate * 1000 / frame->sampleRate + padding) * 4;
+  }
+  else
+  {
+    frame->samples = (layer == 2 || mpeg1) ? 1152 : 576;
+    frame->length = frame->samples / 8 * bitrate * 1000 / frame->sampleRate + padding;
+  }
+  return true;
+}
+
+static uint32_t readBigEndian32(const std::vector<uint8_t> &data, size_t pos)
+{
+  return ((uint32_t)data[pos] << 24) | ((uint32_t)data[pos + 1] << 16) | ((uint32_t)data[pos + 2] << 8) | data[pos + 3];
+}
+
+uint32_t mp3DurationMs(const std::string &path)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return 0;
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + n);
+  fclose(file);
+
+  size_t pos = 0;
+  if (data.size() >= 10 && memcmp(&data[0], "ID3", 3) == 0)
+  {
+    uint32_t size = 0;
+    for (int i = 6; i < 10; i++)
+      size = (size << 7) | (data[i] & 0x7F);
+    pos = 10 + size + ((data[5] & 0x10) ? 10 : 0);
+  }
+
+  // Find the first frame whose successor is also a valid frame header
+  Mp3Frame frame, following;
+  while (pos < data.size() && !(parseMp3Frame(data, pos, &frame) && parseMp3Frame(data, pos + frame.length, &following)))
+    pos++;
+  if (pos >= data.size())
+    return 0;
+
+  // A Xing/Info tag in the first frame gives the frame count directly
+  size_t sideInfo = ((data[pos + 1] >> 3) & 0x03) == 3 ? 32 : 17;
+  if ((data[pos + 3] >> 6) == 3) // mono
+    sideInfo = sideInfo == 32 ? 17 : 9;
+  size_t tag = pos + 4 + sideInfo;
+  if (tag + 12 <= data.size() && (memcmp(&data[tag], "Xing", 4) == 0 || memcmp(&data[tag], "Info", 4) == 0) &&
+      (readBigEndian32(data, tag + 4) & 0x01))
+    return (uint64_t)readBigEndian32(data, tag + 8) * frame.samples * 1000 / frame.sampleRate;
+
+  // Otherwise walk every frame (handles VBR without a tag)
+  uint64_t totalSamples = 0;
+  uint32_t sampleRate = frame.sampleRate;
+  while (parseMp3Frame(data, pos, &frame))
+  {
+    totalSamples += frame.samples;
+    sampleRate = frame.sampleRate;
+    pos += frame.length;
+  }
+  return totalSamples * 1000 / sampleRate;
+}
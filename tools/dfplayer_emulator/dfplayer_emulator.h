@@ -0,0 +1,159 @@
+// Host-side emulator of the DFPlayer Mini serial protocol
+// (include/dfplayer_protocol.h).
+//
+// Parses 10-byte frames from the host, checks their checksums, answers with
+// ACKs and query replies, and plays the card image in media/tf: each track
+// lasts as long as its MP3 file, after which the module reports
+// play-finished; a track that is not on the card is reported as
+// FileMismatch. Both directions of the link are timed as a 9600-baud 8N1
+// UART, one byte every DFPLAYER_BYTE_US, and the module adds its own
+// processing delays (DFPlayerTiming), so ACK round trips cost what they do on
+// hardware.
+//
+// The emulator is driven by a microsecond clock supplied by the caller:
+// receive() hands it bytes as the host writes them, update() returns the
+// bytes whose transmission has finished by then. dfplayer_pty.cpp wraps it
+// in a pseudo-terminal so the firmware or the DFRobotDFPlayerMini library
+// can talk to it as to a serial port.
+//
+// Build with the protocol header on the include path, e.g.
+//   g++ -std=c++11 -Iinclude tools/dfplayer_emulator/dfplayer_emulator.cpp your_tool.cpp
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "dfplayer_protocol.h"
+
+#define DFPLAYER_BAUD 9600
+#define DFPLAYER_BYTE_US 1042 // start + 8 data + stop bits at 9600 baud
+#define DFPLAYER_MAX_VOLUME 30
+
+// Module-side delays. The defaults are typical of a YX5200-based module and
+// can be tuned to match a particular one.
+struct DFPlayerTiming
+{
+  uint32_t replyDelayUs;   // end of a command frame to the start of its ACK
+  uint32_t queryDelayUs;   // ACK to the reply of a query
+  uint32_t playStartUs;    // play command to audio starting (file lookup, decoder)
+  uint32_t resetUs;        // reset to card online; commands meanwhile are Busy
+  uint32_t frameTimeoutUs; // a partial frame idle this long is dropped
+};
+
+extern const DFPlayerTiming DFPLAYER_DEFAULT_TIMING;
+
+// Counters for the link, readable while running
+struct DFPlayerStats
+{
+  uint32_t framesReceived;
+  uint32_t checksumErrors;
+  uint32_t framesDropped; // partial frames that timed out
+  uint32_t framesSent;
+  uint32_t acks;
+  uint32_t errors;         // PLAYER_FB_ERROR frames sent
+  uint64_t ackRoundTripUs; // summed: first command byte to last ACK byte
+  uint32_t maxAckRoundTripUs;
+};
+
+struct DFPlayerTrack
+{
+  uint8_t folder; // 1..99, or 0 for the MP3/ folder
+  uint16_t number;
+  uint32_t durationMs;
+};
+
+// Called for every complete frame in either direction, at the time its last
+// byte finished on the wire
+typedef void (*DFPlayerFrameLog)(void *context, uint64_t atUs, bool fromHost, const uint8_t *frame);
+
+class DFPlayerEmulator
+{
+public:
+  explicit DFPlayerEmulator(const DFPlayerTiming &timing = DFPLAYER_DEFAULT_TIMING);
+
+  // Load the card image: NN/NNN*.mp3 folders and MP3/NNNN*.mp3. Returns the
+  // number of tracks found, or -1 if the directory cannot be read.
+  int loadMedia(const char *root);
+  void addTrack(uint8_t folder, uint16_t number, uint32_t durationMs);
+
+  // The module starts powered and online; reset() replays its power-up
+  void reset(uint64_t nowUs);
+
+  // A byte written by the host at nowUs. It is received once the previous
+  // byte has finished and its own bit time has passed.
+  void receive(uint8_t b, uint64_t nowUs);
+
+  // Run the module up to nowUs and append every byte it has finished
+  // sending by then to `out`
+  void update(uint64_t nowUs, std::vector<uint8_t> &out);
+
+  // Earliest time at which update() has something to do; UINT64_MAX if idle
+  uint64_t nextEventUs() const;
+
+  // Level of the BUSY pin: true while audio plays
+  bool busy(uint64_t nowUs) const;
+
+  void setLog(DFPlayerFrameLog log, void *context);
+  const DFPlayerStats &stats() const { return stats_; }
+  const std::vector<DFPlayerTrack> &tracks() const { return tracks_; }
+
+private:
+  struct TimedByte
+  {
+    uint64_t atUs; // when the byte's stop bit ends
+    uint8_t value;
+  };
+
+  enum PlayState
+  {
+    STOPPED,
+    PLAYING,
+    PAUSED
+  };
+
+  DFPlayerTiming timing_;
+  std::vector<DFPlayerTrack> tracks_; // in card order
+  DFPlayerFrameLog log_;
+  void *logContext_;
+  DFPlayerStats stats_;
+
+  // Host -> module
+  std::vector<TimedByte> rxPending_;
+  uint64_t rxLineFreeUs_;
+  uint8_t rxFrame_[DFPLAYER_FRAME_LENGTH];
+  uint8_t rxLength_;
+  uint64_t rxFrameStartUs_;
+  uint64_t rxLastByteUs_;
+
+  // Module -> host
+  std::vector<TimedByte> txPending_;
+  uint64_t txLineFreeUs_;
+  uint64_t lastCommandStartUs_; // for the ACK round trip
+
+  // Player state
+  PlayState state_;
+  int current_; // index into tracks_, -1 if none
+  uint64_t startsAtUs_;
+  uint64_t endsAtUs_;
+  uint64_t remainingUs_; // while paused
+  uint8_t loopFolder_;   // 0 when not looping a folder
+  uint8_t volume_;
+  uint8_t eq_;
+  bool sleeping_;
+  bool resetting_;
+  uint64_t onlineAtUs_; // card comes online after a reset
+
+  void handleFrame(const uint8_t *frame, uint64_t atUs);
+  uint8_t handleCommand(uint8_t command, uint16_t param, uint64_t atUs);
+  void finishTrack();
+  bool play(int index, uint64_t atUs);
+  int findTrack(uint8_t folder, uint16_t number) const;
+  uint16_t folderCount() const;
+  uint16_t filesInFolder(uint8_t folder) const;
+  void send(uint8_t command, uint16_t param, uint64_t atUs);
+};
+
+// Playback length of an MP3 file from its frame headers (or Xing/Info tag),
+// 0 if it cannot be parsed. Mirrors scripts/generate_media_manifest.py.
+uint32_t mp3DurationMs(const std::string &path);
@@ -0,0 +1,165 @@
+// Pseudo-terminal front end for the DFPlayer emulator.
+//
+// Creates a pty whose other end behaves like a DFPlayer Mini on a 9600-baud
+// UART, prints its path and logs every frame on stderr with its wire time.
+// Point the native build at it (program --player <path>), run the
+// DFRobotDFPlayerMini library against it on the host, or bridge it to a
+// board's UART through a USB serial adapter (socat). Ctrl-C prints the link
+// statistics.
+//
+//   g++ -std=c++11 -Iinclude tools/dfplayer_emulator/*.cpp -o dfplayer_pty
+//   ./dfplayer_pty [--media media/tf] [--link /tmp/dfplayer] [--reset] [--quiet]
+//
+// --reset starts with the module's power-up delay instead of online.
+#include "dfplayer_emulator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+  stopRequested = 1;
+}
+
+static uint64_t monotonicUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void logFrame(void *context, uint64_t atUs, bool fromHost, const uint8_t *frame)
+{
+  uint64_t startUs = *(const uint64_t *)context;
+  fprintf(stderr, "%10.3f %s %02X %02X%02X%s\n", (atUs - startUs) / 1000.0, fromHost ? "->" : "<-", frame[3], frame[5],
+          frame[6], dfplayerFrameValid(frame) ? "" : " (bad checksum)");
+}
+
+static void printStats(const DFPlayerStats &stats)
+{
+  fprintf(stderr, "frames in %u (checksum errors %u, dropped %u), out %u (errors %u)\n", stats.framesReceived,
+          stats.checksumErrors, stats.framesDropped, stats.framesSent, stats.errors);
+  if (stats.acks > 0)
+    fprintf(stderr, "ACK round trip: mean %.2f ms, max %.2f ms over %u commands\n",
+            stats.ackRoundTripUs / 1000.0 / stats.acks, stats.maxAckRoundTripUs / 1000.0, stats.acks);
+}
+
+static bool makeRaw(int fd)
+{
+  struct termios tty;
+  if (tcgetattr(fd, &tty) != 0)
+    return false;
+  cfmakeraw(&tty);
+  cfsetispeed(&tty, B9600);
+  cfsetospeed(&tty, B9600);
+  return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *media = "media/tf";
+  const char *link = NULL;
+  bool startReset = false;
+  bool quiet = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--media") == 0 && i + 1 < argc)
+      media = argv[++i];
+    else if (strcmp(argv[i], "--link") == 0 && i + 1 < argc)
+      link = argv[++i];
+    else if (strcmp(argv[i], "--reset") == 0)
+      startReset = true;
+    else if (strcmp(argv[i], "--quiet") == 0)
+      quiet = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--media dir] [--link path] [--reset] [--quiet]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  DFPlayerEmulator player;
+  int tracks = player.loadMedia(media);
+  if (tracks < 0)
+  {
+    fprintf(stderr, "cannot read %s\n", media);
+    return 1;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+  {
+    perror("posix_openpt");
+    return 1;
+  }
+  const char *slavePath = ptsname(master);
+  // Holding the slave open keeps the master from reporting hang-ups while no
+  // client is connected
+  int slave = open(slavePath, O_RDWR | O_NOCTTY);
+  if (slave < 0 || !makeRaw(slave))
+  {
+    perror(slavePath);
+    return 1;
+  }
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  if (link)
+  {
+    unlink(link);
+    if (symlink(slavePath, link) != 0)
+      perror(link);
+  }
+  printf("%s\n", link ? link : slavePath);
+  fflush(stdout);
+  fprintf(stderr, "%d tracks from %s\n", tracks, media);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  uint64_t startUs = monotonicUs();
+  if (!quiet)
+    player.setLog(logFrame, &startUs);
+  if (startReset)
+    player.reset(startUs);
+
+  std::vector<uint8_t> out;
+  while (!stopRequested)
+  {
+    uint64_t nowUs = monotonicUs();
+    uint8_t buffer[64];
+    ssize_t n;
+    while ((n = read(master, buffer, sizeof(buffer))) > 0)
+      for (ssize_t i = 0; i < n; i++)
+        player.receive(buffer[i], nowUs);
+
+    out.clear();
+    player.update(nowUs, out);
+    if (!out.empty() && write(master, &out[0], out.size()) < 0 && errno != EAGAIN)
+      perror("write");
+
+    // Sleep until the next byte is due or the host writes
+    uint64_t nextUs = player.nextEventUs();
+    uint64_t waitUs = nextUs == UINT64_MAX ? 100000 : nextUs > nowUs ? nextUs - nowUs : 0;
+    if (waitUs > 100000)
+      waitUs = 100000;
+    struct timespec timeout = {(time_t)(waitUs / 1000000), (long)(waitUs % 1000000) * 1000};
+    struct pollfd input = {master, POLLIN, 0};
+    ppoll(&input, 1, &timeout, NULL);
+  }
+
+  printStats(player.stats());
+  if (link)
+    unlink(link);
+  close(slave);
+  close(master);
+  return 0;
+}
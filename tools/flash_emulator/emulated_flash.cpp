@@ -0,0 +1,108 @@
+#include "emulated_flash.h"
+
+#include <string.h>
+
+EmulatedFlash::EmulatedFlash(uint16_t rowSize, uint8_t rowCount, uint16_t pageSize)
+    : memory_((size_t)rowSize * rowCount, 0xFF), rowErases_(rowCount, 0), bytesProgrammed_(0),
+      programViolations_(0), pageCrossings_(0), busyMicros_(0), powerCutArmed_(false), powerCutBytes_(0), poweredOff_(false)
+{
+  flash_.rowSize = rowSize;
+  flash_.pageSize = pageSize;
+  flash_.rowCount = rowCount;
+  flash_.context = this;
+  flash_.read = read;
+  flash_.program = program;
+  flash_.erase = erase;
+}
+
+void EmulatedFlash::cutPowerAfter(uint32_t bytes)
+{
+  powerCutArmed_ = true;
+  powerCutBytes_ = bytes;
+}
+
+void EmulatedFlash::powerCycle()
+{
+  powerCutArmed_ = false;
+  poweredOff_ = false;
+}
+
+uint32_t EmulatedFlash::maxRowErases() const
+{
+  uint32_t most = 0;
+  for (size_t i = 0; i < rowErases_.size(); i++)
+    if (rowErases_[i] > most)
+      most = rowErases_[i];
+  return most;
+}
+
+uint32_t EmulatedFlash::totalErases() const
+{
+  uint32_t total = 0;
+  for (size_t i = 0; i < rowErases_.size(); i++)
+    total += rowErases_[i];
+  return total;
+}
+
+void EmulatedFlash::resetStats()
+{
+  for (size_t i = 0; i < rowErases_.size(); i++)
+    rowErases_[i] = 0;
+  bytesProgrammed_ = 0;
+  programViolations_ = 0;
+  pageCrossings_ = 0;
+  busyMicros_ = 0;
+}
+
+void EmulatedFlash::read(void *context, uint32_t address, void *data, uint16_t length)
+{
+  EmulatedFlash *self = (EmulatedFlash *)context;
+  memcpy(data, &self->memory_[address], length);
+}
+
+void EmulatedFlash::program(void *context, uint32_t address, const void *data, uint16_t length)
+{
+  EmulatedFlash *self = (EmulatedFlash *)context;
+  if (self->poweredOff_ || length == 0)
+    return;
+  uint16_t pageSize = self->flash_.pageSize;
+  if (address / pageSize != (address + length - 1) / pageSize)
+  {
+    self->pageCrossings_++;
+    return;
+  }
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (uint16_t i = 0; i < length; i++)
+  {
+    if (self->powerCutArmed_ && self->powerCutBytes_-- == 0)
+    {
+      self->poweredOff_ = true;
+      return;
+    }
+    uint8_t &cell = self->memory_[address + i];
+    if (bytes[i] & ~cell)
+      self->programViolations_++;
+    cell &= bytes[i];
+    self->bytesProgrammed_++;
+  }
+  self->busyMicros_ += EMULATED_PAGE_PROGRAM_US;
+}
+
+void EmulatedFlash::erase(void *context, uint8_t row)
+{
+  EmulatedFlash *self = (EmulatedFlash *)context;
+  if (self->poweredOff_)
+    return;
+  uint8_t *cells = &self->memory_[(size_t)row * self->flash_.rowSize];
+  if (self->powerCutArmed_ && self->powerCutBytes_ == 0)
+  {
+    // Interrupted erase: leave the row in an indeterminate state
+    for (uint16_t i = 0; i < self->flash_.rowSize; i += 2)
+      cells[i] = 0xFF;
+    self->poweredOff_ = true;
+    return;
+  }
+  memset(cells, 0xFF, self->flash_.rowSize);
+  self->rowErases_[row]++;
+  self->busyMicros_ += EMULATED_ROW_ERASE_US;
+}
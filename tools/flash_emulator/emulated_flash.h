@@ -0,0 +1,70 @@
+// Host-side NOR flash emulator for the settings journal
+// (lib/SettingsJournal).
+//
+// Behaves like the SAMD21's NVM: erased bytes read 0xFF, programming can only
+// clear bits, and a row must be erased to set them again. Every erase and
+// program is counted per row and charged a simulated busy time, so wear and
+// write latency can be measured from a host program. A power cut can be
+// scheduled part way through a program or erase to exercise recovery.
+//
+// As on the NVM controller, a program goes through a one-page buffer, so a
+// range that crosses a page boundary cannot be written: it is refused,
+// leaves the flash untouched and is counted in pageCrossings().
+//
+// Build with the journal on the include path, e.g.
+//   g++ -std=c++11 -Ilib/SettingsJournal lib/SettingsJournal/SettingsJournal.cpp
+//       tools/flash_emulator/emulated_flash.cpp your_tool.cpp
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "SettingsJournal.h"
+
+// SAMD21 NVM characteristics (datasheet, typical)
+#define EMULATED_PAGE_SIZE 64
+#define EMULATED_PAGE_PROGRAM_US 2500
+#define EMULATED_ROW_ERASE_US 6000
+
+class EmulatedFlash
+{
+public:
+  EmulatedFlash(uint16_t rowSize, uint8_t rowCount, uint16_t pageSize = EMULATED_PAGE_SIZE);
+
+  // Primitives bound to this emulator, for SettingsJournal
+  const JournalFlash &flash() const { return flash_; }
+
+  // Lose power after `bytes` more bytes have been programmed (or during the
+  // next erase if it comes first). Until powerCycle() every later program
+  // and erase is dropped, as the MCU would be off.
+  void cutPowerAfter(uint32_t bytes);
+  void powerCycle();
+  bool poweredOff() const { return poweredOff_; }
+
+  uint32_t rowErases(uint8_t row) const { return rowErases_[row]; }
+  uint32_t maxRowErases() const;
+  uint32_t totalErases() const;
+  uint32_t bytesProgrammed() const { return bytesProgrammed_; }
+  uint32_t programViolations() const { return programViolations_; } // attempts to set a cleared bit
+  uint32_t pageCrossings() const { return pageCrossings_; }          // programs refused for crossing a page
+  uint64_t busyMicros() const { return busyMicros_; }                // simulated time spent in NVM operations
+  void resetStats();
+
+  const std::vector<uint8_t> &contents() const { return memory_; }
+
+private:
+  JournalFlash flash_;
+  std::vector<uint8_t> memory_;
+  std::vector<uint32_t> rowErases_;
+  uint32_t bytesProgrammed_;
+  uint32_t programViolations_;
+  uint32_t pageCrossings_;
+  uint64_t busyMicros_;
+  bool powerCutArmed_;
+  uint32_t powerCutBytes_;
+  bool poweredOff_;
+
+  static void read(void *context, uint32_t address, void *data, uint16_t length);
+  static void program(void *context, uint32_t address, const void *data, uint16_t length);
+  static void erase(void *context, uint8_t row);
+};